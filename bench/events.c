@@ -0,0 +1,394 @@
+#include "../src/watchful.h"
+
+#include <sys/wait.h>
+
+/* Measures the inotify backend end to end on trees generated in a tmpfs
+ * directory (/dev/shm unless another is given). Each workload builds its tree,
+ * starts a monitor and, for the storms, makes one change per entry while the
+ * callback records when each change arrives. Every row reports the time taken
+ * to start (and of that, to crawl), the events delivered per second from the
+ * first change to the last event, the p50 and p99 latency from a change to its
+ * callback, and the memory held per watch both as resident set growth and as
+ * counted by the monitor. Each workload runs in a process of its own so that
+ * the memory it grows is not reused from the last. The trees and changes are
+ * the same on every run. */
+
+#ifndef LINUX
+
+int main(void) {
+    fprintf(stderr, "events benchmark needs the inotify backend\n");
+    return 1;
+}
+
+#else
+
+#define WAIT_IDLE 2.0
+
+typedef struct Bench Bench;
+
+typedef struct Workload {
+    const char *name;
+    size_t dirs;
+    size_t ops_len;
+    int type;
+    char prefix;
+    int (*storm)(Bench *, size_t);
+} Workload;
+
+struct Bench {
+    const char *root;
+    size_t ops_len;
+    int type;
+    char prefix;
+    double *issued;
+    double *arrived;
+    size_t received;
+    double last;
+};
+
+typedef struct Row {
+    const char *workload;
+    size_t dirs;
+    size_t ops;
+    double start_ms;
+    double crawl_ms;
+    size_t events;
+    double events_per_sec;
+    double p50_us;
+    double p99_us;
+    double rss_per_watch;
+    double memory_per_watch;
+    uint64_t overflows;
+} Row;
+
+/* Helper Functions */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t rss_bytes(void) {
+    unsigned long pages = 0;
+    unsigned long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (NULL == statm) return 0;
+    int matched = fscanf(statm, "%lu %lu", &pages, &resident);
+    fclose(statm);
+    if (matched != 2) return 0;
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int path_of(char *buf, size_t buf_len, const char *root, const char *rel) {
+    int len = snprintf(buf, buf_len, "%s/%s", root, rel);
+    return (len < 0 || (size_t)len >= buf_len) ? 1 : 0;
+}
+
+static int remove_tree(const char *path) {
+    /* Depth first so that each directory is empty when it is removed */
+    DIR *dir = opendir(path);
+    if (NULL == dir) return 1;
+    struct dirent *entry;
+    int err = 0;
+    while (!err && (entry = readdir(dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        char child[PATH_MAX];
+        if (path_of(child, sizeof(child), path, entry->d_name)) {
+            err = 1;
+            break;
+        }
+        if (entry->d_type == DT_DIR) err = remove_tree(child);
+        else err = unlink(child);
+    }
+    closedir(dir);
+    if (err) return 1;
+    return rmdir(path);
+}
+
+/* Tree Functions */
+
+static int make_wide(const char *root, size_t dirs) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < dirs; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "w%zu", i);
+        if (path_of(path, sizeof(path), root, name) || mkdir(path, 0755)) return 1;
+    }
+    return 0;
+}
+
+static int make_deep(const char *root, size_t chains, size_t depth) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < chains; i++) {
+        int len = snprintf(path, sizeof(path), "%s/c%zu", root, i);
+        if (mkdir(path, 0755)) return 1;
+        for (size_t j = 1; j < depth; j++) {
+            len += snprintf(path + len, sizeof(path) - (size_t)len, "/l%zu", j);
+            if ((size_t)len >= sizeof(path) || mkdir(path, 0755)) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Storm Functions */
+
+static int file_of(char *buf, size_t buf_len, const char *root, size_t dirs, size_t i, char prefix) {
+    /* Changes are spread over the directories of a wide tree in turn */
+    int len = snprintf(buf, buf_len, "%s/w%zu/%c%zu", root, i % dirs, prefix, i);
+    return (len < 0 || (size_t)len >= buf_len) ? 1 : 0;
+}
+
+static int storm_create(Bench *bench, size_t dirs) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (file_of(path, sizeof(path), bench->root, dirs, i, 'f')) return 1;
+        bench->issued[i] = now();
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) return 1;
+        close(fd);
+    }
+    return 0;
+}
+
+static int storm_modify(Bench *bench, size_t dirs) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (file_of(path, sizeof(path), bench->root, dirs, i, 'f')) return 1;
+        bench->issued[i] = now();
+        int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1) return 1;
+        ssize_t written = write(fd, "x", 1);
+        close(fd);
+        if (written != 1) return 1;
+    }
+    return 0;
+}
+
+static int storm_delete(Bench *bench, size_t dirs) {
+    char path[PATH_MAX];
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (file_of(path, sizeof(path), bench->root, dirs, i, 'f')) return 1;
+        bench->issued[i] = now();
+        if (unlink(path)) return 1;
+    }
+    return 0;
+}
+
+static int storm_rename(Bench *bench, size_t dirs) {
+    /* Each directory moved holds a subdirectory so its watches move too */
+    char path[PATH_MAX];
+    char new_path[PATH_MAX];
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (file_of(path, sizeof(path), bench->root, dirs, i, 'd')) return 1;
+        if (mkdir(path, 0755)) return 1;
+        size_t len = strlen(path);
+        if (path_of(path + len, sizeof(path) - len, "", "sub") || mkdir(path, 0755)) return 1;
+        path[len] = '\0';
+    }
+    /* The creations are let through before the renames begin */
+    struct timespec settle = {0, 200000000};
+    nanosleep(&settle, NULL);
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (file_of(path, sizeof(path), bench->root, dirs, i, 'd')) return 1;
+        if (file_of(new_path, sizeof(new_path), bench->root, dirs, i, 'r')) return 1;
+        bench->issued[i] = now();
+        if (rename(path, new_path)) return 1;
+    }
+    return 0;
+}
+
+/* Monitor Functions */
+
+static int callback(const WatchfulEvent *event, void *info) {
+    /* Only the first event of the storm's type for each entry is timed */
+    Bench *bench = info;
+    double at = now();
+    if (event->type != bench->type) return 0;
+
+    const char *name = strrchr(event->path, '/');
+    size_t path_len = strlen(event->path);
+    if (path_len > 1 && event->path[path_len - 1] == '/') {
+        name = event->path + path_len - 2;
+        while (name > event->path && *name != '/') name--;
+    }
+    if (NULL == name || name[1] != bench->prefix) return 0;
+    char *end = NULL;
+    unsigned long i = strtoul(name + 2, &end, 10);
+    if (end == name + 2 || i >= bench->ops_len || bench->arrived[i] > 0) return 0;
+
+    bench->arrived[i] = at;
+    __atomic_store(&bench->last, &at, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&bench->received, 1, __ATOMIC_ACQ_REL);
+
+    return 0;
+}
+
+static void wait_for(Bench *bench) {
+    /* Stops at the last expected event or when nothing arrives for a while */
+    size_t seen = 0;
+    double idle_since = now();
+    struct timespec pause = {0, 1000000};
+    while (1) {
+        size_t received = __atomic_load_n(&bench->received, __ATOMIC_ACQUIRE);
+        if (received >= bench->ops_len) return;
+        if (received != seen) {
+            seen = received;
+            idle_since = now();
+        } else if (now() - idle_since > WAIT_IDLE) {
+            return;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void row_latency(Row *row, Bench *bench) {
+    double *latencies = malloc(sizeof(double) * (bench->ops_len + 1));
+    if (NULL == latencies) return;
+    size_t len = 0;
+    double first = 0;
+    for (size_t i = 0; i < bench->ops_len; i++) {
+        if (0 == i || bench->issued[i] < first) first = bench->issued[i];
+        if (bench->arrived[i] > 0) latencies[len++] = bench->arrived[i] - bench->issued[i];
+    }
+    row->events = len;
+    if (len) {
+        qsort(latencies, len, sizeof(double), cmp_double);
+        row->p50_us = latencies[(len - 1) / 2] * 1e6;
+        row->p99_us = latencies[((len - 1) * 99) / 100] * 1e6;
+        double span = bench->last - first;
+        row->events_per_sec = (span > 0) ? (double)len / span : 0;
+    }
+    free(latencies);
+}
+
+static void row_print(Row *row) {
+    printf("%s,%zu,%zu,%.3f,%.3f,%zu,%.0f,%.1f,%.1f,%.1f,%.1f,%llu\n",
+            row->workload, row->dirs, row->ops, row->start_ms, row->crawl_ms,
+            row->events, row->events_per_sec, row->p50_us, row->p99_us,
+            row->rss_per_watch, row->memory_per_watch, (unsigned long long)row->overflows);
+    fflush(stdout);
+}
+
+static int run(const Workload *workload, const char *root) {
+    Bench bench = {
+        .root = root,
+        .ops_len = workload->ops_len,
+        .type = workload->type,
+        .prefix = workload->prefix,
+    };
+    Row row = {
+        .workload = workload->name,
+        .dirs = workload->dirs,
+        .ops = workload->ops_len,
+    };
+    WatchfulMonitor *wm = NULL;
+    bool is_started = false;
+
+    if (bench.ops_len) {
+        bench.issued = calloc(bench.ops_len, sizeof(double));
+        bench.arrived = calloc(bench.ops_len, sizeof(double));
+        if (NULL == bench.issued || NULL == bench.arrived) goto error;
+    }
+
+    wm = watchful_monitor_create(&watchful_inotify, root, 0, NULL, WATCHFUL_EVENT_ALL, 0, callback, &bench);
+    if (NULL == wm) goto error;
+
+    size_t rss = rss_bytes();
+    double start = now();
+    if (watchful_monitor_start(wm)) goto error;
+    is_started = true;
+    row.start_ms = (now() - start) * 1e3;
+
+    WatchfulStats stats;
+    watchful_monitor_stats(wm, &stats);
+    row.crawl_ms = stats.crawl_duration * 1e3;
+    size_t rss_grown = rss_bytes() - rss;
+    if (stats.watches) {
+        row.rss_per_watch = (double)rss_grown / (double)stats.watches;
+        row.memory_per_watch = (double)stats.watches_memory / (double)stats.watches;
+    }
+
+    if (NULL != workload->storm) {
+        if (workload->storm(&bench, workload->dirs)) goto error;
+        wait_for(&bench);
+        row_latency(&row, &bench);
+    }
+
+    watchful_monitor_stats(wm, &stats);
+    row.overflows = stats.overflows;
+
+    if (watchful_monitor_stop(wm)) goto error;
+    watchful_monitor_destroy(wm);
+    free(bench.issued);
+    free(bench.arrived);
+
+    row_print(&row);
+
+    return 0;
+
+error:
+    if (is_started) watchful_monitor_stop(wm);
+    if (NULL != wm) watchful_monitor_destroy(wm);
+    free(bench.issued);
+    free(bench.arrived);
+    fprintf(stderr, "workload %s failed\n", workload->name);
+    return 1;
+}
+
+static int run_apart(const Workload *workload, const char *root) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) return 1;
+    if (0 == pid) _exit(run(workload, root));
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) return 1;
+    return !WIFEXITED(status) || 0 != WEXITSTATUS(status);
+}
+
+static int fresh(const char *root) {
+    struct stat st;
+    if (stat(root, &st) == 0 && remove_tree(root)) return 1;
+    return mkdir(root, 0755);
+}
+
+int main(int argc, char **argv) {
+    char root[PATH_MAX];
+    const char *base = (argc > 1) ? argv[1] : "/dev/shm";
+    int len = snprintf(root, sizeof(root), "%s/watchful-bench-%ld", base, (long)getpid());
+    if (len < 0 || (size_t)len >= sizeof(root)) return 1;
+
+    int err = 0;
+    printf("workload,dirs,ops,start_ms,crawl_ms,events,events_per_sec,p50_us,p99_us,rss_bytes_per_watch,memory_bytes_per_watch,overflows\n");
+
+    /* Crawls of a flat tree and of long chains */
+    Workload wide = {"wide", 20000, 0, 0, 0, NULL};
+    Workload deep = {"deep", 10000, 0, 0, 0, NULL};
+    err = fresh(root) || make_wide(root, wide.dirs) || run_apart(&wide, root);
+    if (!err) err = fresh(root) || make_deep(root, 200, deep.dirs / 200) || run_apart(&deep, root);
+
+    /* Storms spread over a hundred directories (the files persist between them) */
+    Workload storms[] = {
+        {"create", 100, 10000, WATCHFUL_EVENT_CREATED, 'f', storm_create},
+        {"modify", 100, 10000, WATCHFUL_EVENT_MODIFIED, 'f', storm_modify},
+        {"delete", 100, 10000, WATCHFUL_EVENT_DELETED, 'f', storm_delete},
+        {"rename", 100, 2000, WATCHFUL_EVENT_RENAMED, 'r', storm_rename},
+    };
+    size_t storms_len = sizeof(storms) / sizeof(storms[0]);
+    if (!err) err = fresh(root) || make_wide(root, 100);
+    for (size_t i = 0; i < storms_len && !err; i++) err = run_apart(&storms[i], root);
+
+    struct stat st;
+    if (stat(root, &st) == 0) remove_tree(root);
+
+    return err;
+}
+
+#endif
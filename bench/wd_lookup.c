@@ -0,0 +1,71 @@
+#include "../src/watchful.h"
+
+/* Measures the cost of finding the watch for a watch descriptor, which the
+ * inotify backend does once per event, as the number of watches grows. The
+ * 'random' column spreads lookups over every watch (cache-hostile); the 'hot'
+ * column confines them to 64 directories, as during a build storm. */
+
+#define LOOKUPS 10000000
+#define KEYS_LEN 65536
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static double bench_table(size_t watches_len, WatchfulWatch *watches, const int *keys) {
+    WatchfulTable wds;
+    if (watchful_table_init(&wds, 0)) return -1;
+    for (size_t i = 0; i < watches_len; i++) {
+        if (watchful_table_put(&wds, (uint64_t)watches[i].wd, &watches[i])) return -1;
+    }
+
+    struct timespec start, end;
+    size_t found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        WatchfulWatch *watch = watchful_table_get(&wds, (uint64_t)keys[i & (KEYS_LEN - 1)]);
+        if (NULL != watch) found++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    watchful_table_deinit(&wds);
+    if (found != LOOKUPS) return -1;
+
+    return elapsed_ns(&start, &end) / LOOKUPS;
+}
+
+int main(void) {
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    size_t sizes_len = sizeof(sizes) / sizeof(sizes[0]);
+
+    printf("watches,random_ns_per_lookup,hot_ns_per_lookup\n");
+
+    for (size_t s = 0; s < sizes_len; s++) {
+        size_t watches_len = sizes[s];
+        WatchfulWatch *watches = malloc(sizeof(WatchfulWatch) * watches_len);
+        int *keys = malloc(sizeof(int) * KEYS_LEN);
+        if (NULL == watches || NULL == keys) return 1;
+
+        /* inotify hands out descriptors sequentially, starting at 1 */
+        for (size_t i = 0; i < watches_len; i++) {
+            watches[i].wd = (int)i + 1;
+            watches[i].name = NULL;
+        }
+
+        srand(1);
+        for (size_t i = 0; i < KEYS_LEN; i++) keys[i] = (rand() % (int)watches_len) + 1;
+        double random_ns = bench_table(watches_len, watches, keys);
+        if (random_ns < 0) return 1;
+
+        for (size_t i = 0; i < KEYS_LEN; i++) keys[i] = ((rand() % 64) * ((int)watches_len / 64)) + 1;
+        double hot_ns = bench_table(watches_len, watches, keys);
+        if (hot_ns < 0) return 1;
+
+        printf("%zu,%.2f,%.2f\n", watches_len, random_ns, hot_ns);
+
+        free(keys);
+        free(watches);
+    }
+
+    return 0;
+}
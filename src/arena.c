@@ -0,0 +1,95 @@
+#include "watchful.h"
+
+/* An arena hands out strings from chunks that are kept between uses. Once
+ * the chunks are large enough for a batch of events, resetting the arena
+ * and filling it again does not touch the heap. */
+
+#define ARENA_CHUNK_SIZE 65536
+
+/* Helper Functions */
+
+static WatchfulArenaChunk *chunk_create(WatchfulArena *arena, size_t len) {
+    size_t size = (len > arena->chunk_size) ? len : arena->chunk_size;
+    WatchfulArenaChunk *chunk = malloc(sizeof(WatchfulArenaChunk) + size);
+    if (NULL == chunk) return NULL;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->allocations++;
+    return chunk;
+}
+
+/* Arena Functions */
+
+void watchful_arena_init(WatchfulArena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->chunk_size = (0 == chunk_size) ? ARENA_CHUNK_SIZE : chunk_size;
+    arena->allocations = 0;
+    return;
+}
+
+void watchful_arena_deinit(WatchfulArena *arena) {
+    WatchfulArenaChunk *chunk = arena->head;
+    while (NULL != chunk) {
+        WatchfulArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->current = NULL;
+    return;
+}
+
+char *watchful_arena_alloc(WatchfulArena *arena, size_t len) {
+    WatchfulArenaChunk *chunk = arena->current;
+    if (NULL != chunk && chunk->size - chunk->used >= len) {
+        char *ptr = chunk->data + chunk->used;
+        chunk->used += len;
+        return ptr;
+    }
+
+    /* Move on to the next chunk kept from before or put a new one there */
+    WatchfulArenaChunk *next = (NULL == chunk) ? arena->head : chunk->next;
+    if (NULL == next || next->size < len) {
+        WatchfulArenaChunk *created = chunk_create(arena, len);
+        if (NULL == created) return NULL;
+        created->next = next;
+        if (NULL == chunk) arena->head = created;
+        else chunk->next = created;
+        next = created;
+    }
+
+    next->used = len;
+    arena->current = next;
+
+    return next->data;
+}
+
+char *watchful_arena_strdup(WatchfulArena *arena, const char *str) {
+    size_t len = strlen(str);
+    char *copy = watchful_arena_alloc(arena, len + 1);
+    if (NULL == copy) return NULL;
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+WatchfulArenaMark watchful_arena_mark(WatchfulArena *arena) {
+    WatchfulArenaMark mark = {
+        .chunk = arena->current,
+        .used = (NULL == arena->current) ? 0 : arena->current->used,
+    };
+    return mark;
+}
+
+void watchful_arena_rewind(WatchfulArena *arena, WatchfulArenaMark mark) {
+    /* Everything handed out since the mark is given back */
+    arena->current = mark.chunk;
+    if (NULL != mark.chunk) mark.chunk->used = mark.used;
+    return;
+}
+
+void watchful_arena_reset(WatchfulArena *arena) {
+    arena->current = NULL;
+    return;
+}
@@ -0,0 +1,460 @@
+#include "../watchful.h"
+
+#ifndef LINUX
+
+WatchfulBackend watchful_fanotify = {
+    .name = "fanotify",
+    .setup = NULL,
+    .teardown = NULL,
+    .process = NULL,
+};
+
+#else
+
+/* A single filesystem mark reports every change on the filesystem holding the
+ * monitored path, so no directories are crawled or watched. Each event names
+ * its directory by file handle; handles are resolved to paths (and cached)
+ * and events outside the monitored path are dropped. Mount marks cannot
+ * report directory entry events, and both kinds of mark need CAP_SYS_ADMIN. */
+
+#define FANOTIFY_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR)
+#define FANOTIFY_DIRS_MAX 4096
+
+typedef struct {
+    size_t handle_len;
+    char *path;
+    int is_excluded;
+    unsigned char handle[];
+} FanotifyDir;
+
+/* Directory Functions */
+
+static uint64_t handle_hash(const struct file_handle *handle) {
+    /* FNV-1a over the type and the opaque bytes */
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    const unsigned char *bytes = (const unsigned char *)&handle->handle_type;
+    for (size_t i = 0; i < sizeof(handle->handle_type); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    for (size_t i = 0; i < handle->handle_bytes; i++) {
+        hash ^= handle->f_handle[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static size_t handle_len(const struct file_handle *handle) {
+    return sizeof(struct file_handle) + handle->handle_bytes;
+}
+
+static void dirs_clear(WatchfulMonitor *wm) {
+    for (size_t i = 0; i < wm->dirs.cap; i++) {
+        FanotifyDir *dir = wm->dirs.entries[i].value;
+        if (NULL == dir) continue;
+        free(dir->path);
+        free(dir);
+    }
+    watchful_table_clear(&wm->dirs);
+    return;
+}
+
+static char *dir_resolve(WatchfulMonitor *wm, struct file_handle *handle) {
+    /* The handle of a directory that is gone cannot be opened and the path of
+     * one that is deleted but still open is marked as such; either way it
+     * cannot be under the monitored path any longer */
+    int fd = open_by_handle_at(wm->mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+    char buf[PATH_MAX];
+    ssize_t len = readlink(link, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return NULL;
+    buf[len] = '\0';
+
+    const char *deleted = " (deleted)";
+    size_t deleted_len = strlen(deleted);
+    if ((size_t)len > deleted_len && 0 == strcmp(buf + len - deleted_len, deleted)) return NULL;
+
+    return watchful_path_create(buf, NULL, true);
+}
+
+static FanotifyDir *dir_for_handle(WatchfulMonitor *wm, struct file_handle *handle) {
+    uint64_t key = handle_hash(handle);
+    size_t len = handle_len(handle);
+
+    FanotifyDir *dir = watchful_table_get(&wm->dirs, key);
+    if (NULL != dir && dir->handle_len == len && 0 == memcmp(dir->handle, handle, len)) return dir;
+
+    char *path = dir_resolve(wm, handle);
+    if (NULL == path) return NULL;
+
+    if (NULL != dir) {
+        watchful_table_remove(&wm->dirs, key);
+        free(dir->path);
+        free(dir);
+    }
+
+    /* The cache is bounded by starting over rather than by evicting */
+    if (wm->dirs.len >= FANOTIFY_DIRS_MAX) dirs_clear(wm);
+
+    dir = malloc(sizeof(FanotifyDir) + len);
+    if (NULL == dir) goto error;
+    dir->handle_len = len;
+    dir->path = path;
+    dir->is_excluded = -1;
+    memcpy(dir->handle, handle, len);
+
+    int err = watchful_table_put(&wm->dirs, key, dir);
+    if (err) goto error;
+
+    return dir;
+
+error:
+    free(dir);
+    free(path);
+    return NULL;
+}
+
+static bool dir_excludes(WatchfulMonitor *wm, const char *path) {
+    /* Excluding a directory excludes everything beneath it, so each directory
+     * between the monitored path and this one is checked */
+    char buf[PATH_MAX];
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(buf)) return false;
+    memcpy(buf, path, path_len + 1);
+    for (size_t i = strlen(wm->path); i < path_len; i++) {
+        if (buf[i] != '/') continue;
+        char next = buf[i + 1];
+        buf[i + 1] = '\0';
+        bool is_excluded = watchful_monitor_excludes_path(wm, buf);
+        buf[i + 1] = next;
+        if (is_excluded) return true;
+    }
+    return false;
+}
+
+/* Event Functions */
+
+static char *event_path(WatchfulMonitor *wm, const struct fanotify_event_info_fid *fid, bool is_dir) {
+    /* The handle is followed by the name of the entry in that directory */
+    struct file_handle *handle = (struct file_handle *)fid->handle;
+    const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+
+    FanotifyDir *entry = dir_for_handle(wm, handle);
+    if (NULL == entry) return NULL;
+    const char *dir = entry->path;
+
+    size_t real_root_len = strlen(wm->real_root);
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    if (0 == strcmp(name, ".")) name_len = 0;
+
+    /* The monitored directory is itself reported by name from its parent */
+    bool is_root = is_dir && dir_len + name_len + 1 == real_root_len &&
+        0 == strncmp(wm->real_root, dir, dir_len) &&
+        0 == strncmp(wm->real_root + dir_len, name, name_len);
+    if (!is_root && !watchful_path_is_prefixed(dir, wm->real_root)) return NULL;
+
+    /* Paths are reported under the monitored path as given, not as resolved */
+    size_t path_len = strlen(wm->path);
+    size_t rest_len = is_root ? 0 : (dir_len - real_root_len) + name_len + (is_dir && name_len ? 1 : 0);
+    WatchfulArenaMark mark = watchful_arena_mark(&wm->batch.arena);
+    char *path = watchful_arena_alloc(&wm->batch.arena, path_len + rest_len + 1);
+    if (NULL == path) return NULL;
+
+    char *end = path;
+    memcpy(end, wm->path, path_len);
+    end += path_len;
+    if (!is_root) {
+        memcpy(end, dir + real_root_len, dir_len - real_root_len);
+        end += dir_len - real_root_len;
+        memcpy(end, name, name_len);
+        end += name_len;
+        if (is_dir && name_len) *end++ = '/';
+    }
+    *end = '\0';
+
+    if (!is_root && entry->is_excluded == -1) {
+        char saved = path[path_len + (dir_len - real_root_len)];
+        path[path_len + (dir_len - real_root_len)] = '\0';
+        entry->is_excluded = dir_excludes(wm, path);
+        path[path_len + (dir_len - real_root_len)] = saved;
+    }
+    if (!is_root && entry->is_excluded) {
+        watchful_arena_rewind(&wm->batch.arena, mark);
+        return NULL;
+    }
+
+    return path;
+}
+
+static bool event_exists(const char *path) {
+    struct stat st;
+    return 0 == fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW);
+}
+
+static bool event_is_hidden(WatchfulMonitor *wm, const char *path) {
+    return watchful_monitor_excludes_path(wm, path) || !watchful_monitor_includes_path(wm, path);
+}
+
+static int event_add(WatchfulMonitor *wm, int event_type, char *path, char *old_path) {
+    if (!(wm->events & event_type)) {
+        __atomic_fetch_add(&wm->stats.events_filtered, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (event_is_hidden(wm, path)) {
+        __atomic_fetch_add(&wm->stats.events_excluded, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return (wm->delay > 0) ?
+        watchful_debounce_add(wm, event_type, path, old_path) :
+        watchful_batch_add(wm, event_type, path, old_path);
+}
+
+static int event_rename(WatchfulMonitor *wm, char *path, char *old_path) {
+    /* A move across the edge of the monitored path is one half of a rename */
+    if (NULL == path && NULL == old_path) return 0;
+    if (NULL == old_path) return event_add(wm, WATCHFUL_EVENT_CREATED, path, NULL);
+    if (NULL == path) return event_add(wm, WATCHFUL_EVENT_DELETED, old_path, NULL);
+    if (event_is_hidden(wm, old_path)) return event_add(wm, WATCHFUL_EVENT_CREATED, path, NULL);
+    if (event_is_hidden(wm, path)) return event_add(wm, WATCHFUL_EVENT_DELETED, old_path, NULL);
+    return event_add(wm, WATCHFUL_EVENT_RENAMED, path, old_path);
+}
+
+static int handle_event(WatchfulMonitor *wm) {
+    const struct fanotify_event_metadata *metadata;
+    WatchfulArena *arena = &wm->batch.arena;
+
+    /* Read until the queue is empty */
+    ssize_t size;
+    while ((size = read(wm->fd, wm->buf, wm->read_len)) > 0) {
+        __atomic_fetch_add(&wm->stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&wm->stats.bytes_read, (uint64_t)size, __ATOMIC_RELAXED);
+        metadata = (const struct fanotify_event_metadata *)wm->buf;
+        for (; FAN_EVENT_OK(metadata, size); metadata = FAN_EVENT_NEXT(metadata, size)) {
+            if (metadata->vers != FANOTIFY_METADATA_VERSION) goto error;
+            __atomic_fetch_add(&wm->stats.events_read, 1, __ATOMIC_RELAXED);
+
+            /* 0. Report that the kernel had to drop events. */
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                __atomic_fetch_add(&wm->stats.overflows, 1, __ATOMIC_RELAXED);
+                char *path = watchful_arena_strdup(arena, wm->path);
+                if (NULL == path) goto error;
+                if (watchful_batch_add(wm, WATCHFUL_EVENT_OVERFLOW, path, NULL)) goto error;
+                continue;
+            }
+
+            /* 1. Find the directory entries named by the event. */
+            bool is_dir = (metadata->mask & FAN_ONDIR) != 0;
+            const struct fanotify_event_info_fid *fid = NULL;
+            const struct fanotify_event_info_fid *old_fid = NULL;
+            const struct fanotify_event_info_fid *new_fid = NULL;
+            const char *info = (const char *)metadata + metadata->metadata_len;
+            const char *info_end = (const char *)metadata + metadata->event_len;
+            while (info + sizeof(struct fanotify_event_info_header) <= info_end) {
+                const struct fanotify_event_info_header *header = (const struct fanotify_event_info_header *)info;
+                if (0 == header->len) break;
+                if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                    fid = (const struct fanotify_event_info_fid *)info;
+#ifdef FAN_RENAME
+                } else if (header->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) {
+                    old_fid = (const struct fanotify_event_info_fid *)info;
+                } else if (header->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) {
+                    new_fid = (const struct fanotify_event_info_fid *)info;
+#endif
+                }
+                info += header->len;
+            }
+
+            /* 2. Forget cached paths a directory move can change. */
+            bool is_moved = (metadata->mask & FAN_MOVED_FROM) != 0;
+#ifdef FAN_RENAME
+            is_moved = is_moved || (metadata->mask & FAN_RENAME);
+#endif
+            if (is_dir && is_moved) dirs_clear(wm);
+
+            WatchfulArenaMark mark = watchful_arena_mark(arena);
+            int err = 0;
+
+            /* 3. Pair the two sides of a rename. */
+#ifdef FAN_RENAME
+            if (metadata->mask & FAN_RENAME) {
+                char *old_path = (NULL == old_fid) ? NULL : event_path(wm, old_fid, is_dir);
+                char *new_path = (NULL == new_fid) ? NULL : event_path(wm, new_fid, is_dir);
+                err = event_rename(wm, new_path, old_path);
+                if (err) goto error;
+            }
+#else
+            (void)old_fid;
+            (void)new_fid;
+            (void)event_rename;
+#endif
+
+            if (NULL == fid) continue;
+            char *path = event_path(wm, fid, is_dir);
+            if (NULL == path) {
+                watchful_arena_rewind(arena, mark);
+                continue;
+            }
+
+            /* 4. Report each change merged into the event. A create and a delete
+             * are ordered by whether the entry is there now. */
+            bool is_created = (metadata->mask & (FAN_CREATE | FAN_MOVED_TO)) != 0;
+            bool is_deleted = (metadata->mask & (FAN_DELETE | FAN_MOVED_FROM)) != 0;
+            bool is_modified = (metadata->mask & (FAN_MODIFY | FAN_ATTRIB)) != 0;
+            bool is_replaced = is_created && is_deleted && event_exists(path);
+            if (is_replaced) err = event_add(wm, WATCHFUL_EVENT_DELETED, path, NULL);
+            if (!err && is_created) err = event_add(wm, WATCHFUL_EVENT_CREATED, path, NULL);
+            if (!err && is_modified) err = event_add(wm, WATCHFUL_EVENT_MODIFIED, path, NULL);
+            if (!err && is_deleted && !is_replaced) err = event_add(wm, WATCHFUL_EVENT_DELETED, path, NULL);
+            if (err) goto error;
+        }
+    }
+    if (size == -1 && errno != EAGAIN && errno != EINTR) goto error;
+
+    /* 5. Flush the batch unless it may wait for more events. */
+    if (watchful_batch_is_due(wm)) return watchful_batch_flush(wm);
+
+    return 0;
+
+error:
+    return 1;
+}
+
+static int process(void *info) {
+    WatchfulMonitor *wm = info;
+    int err = 0;
+
+    uint64_t expirations;
+    ssize_t size = read(wm->timer_fd, &expirations, sizeof(expirations));
+    (void)size;
+
+    /* Let more events queue up so that each read returns more */
+    int queued = 0;
+    if (wm->read_wait > 0 && 0 == ioctl(wm->fd, FIONREAD, &queued) && queued > 0) {
+        struct timespec pause = {
+            .tv_sec = (time_t)wm->read_wait,
+            .tv_nsec = (long)((wm->read_wait - (double)(time_t)wm->read_wait) * 1e9),
+        };
+        nanosleep(&pause, NULL);
+    }
+
+    err = handle_event(wm);
+    if (!err) err = watchful_debounce_release(wm, false);
+    if (!err && watchful_batch_is_due(wm)) err = watchful_batch_flush(wm);
+    if (!err) err = watchful_loop_arm(wm, -1);
+
+    return err;
+}
+
+static int process_external(WatchfulMonitor *wm) {
+    return process(wm);
+}
+
+/* Backend Functions */
+
+static int add_marks(WatchfulMonitor *wm) {
+    /* Renames are reported as one event from Linux 5.17 and as two halves
+     * that cannot be paired before that */
+#ifdef FAN_RENAME
+    int err = fanotify_mark(wm->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS | FAN_RENAME, AT_FDCWD, wm->path);
+    if (!err || errno != EINVAL) return err ? 1 : 0;
+#endif
+    int error = fanotify_mark(wm->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS | FAN_MOVED_FROM | FAN_MOVED_TO, AT_FDCWD, wm->path);
+    return error ? 1 : 0;
+}
+
+static int setup(WatchfulMonitor *wm) {
+    int error = 0;
+
+    /* Changes are not tracked in a snapshot so neither can be honoured */
+    if (wm->rescan || NULL != wm->snapshot_path) return 1;
+
+    wm->mount_fd = -1;
+    wm->real_root = NULL;
+    wm->buf = NULL;
+    wm->timer_fd = -1;
+    wm->dirs.entries = NULL;
+
+    wm->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+    if (wm->fd == -1) return 1;
+
+    error = add_marks(wm);
+    if (error) goto error;
+
+    wm->mount_fd = open(wm->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (wm->mount_fd == -1) goto error;
+
+    char real_root[PATH_MAX];
+    if (NULL == realpath(wm->path, real_root)) goto error;
+    wm->real_root = watchful_path_create(real_root, NULL, true);
+    if (NULL == wm->real_root) goto error;
+
+    /* A read fails unless the buffer can hold an event with a full name */
+    size_t min_len = sizeof(struct fanotify_event_metadata) + 2 * (sizeof(struct fanotify_event_info_fid) + MAX_HANDLE_SZ + NAME_MAX + 1);
+    if (wm->read_len < min_len) wm->read_len = min_len;
+    wm->buf = malloc(sizeof(char) * wm->read_len);
+    if (NULL == wm->buf) goto error;
+
+    error = watchful_table_init(&wm->dirs, 64);
+    if (error) goto error;
+
+    error = watchful_loop_attach(wm, process);
+    if (error) goto error;
+
+    return 0;
+
+error:
+    if (NULL != wm->dirs.entries) watchful_table_deinit(&wm->dirs);
+    free(wm->buf);
+    wm->buf = NULL;
+    free(wm->real_root);
+    wm->real_root = NULL;
+    if (wm->mount_fd != -1) close(wm->mount_fd);
+    wm->mount_fd = -1;
+    close(wm->fd);
+    wm->fd = -1;
+    return 1;
+}
+
+static int teardown(WatchfulMonitor *wm) {
+    watchful_loop_detach(wm);
+
+    close(wm->timer_fd);
+    wm->timer_fd = -1;
+
+    /* Events still held are delivered on the stopping thread */
+    watchful_debounce_release(wm, true);
+    watchful_batch_flush(wm);
+
+    dirs_clear(wm);
+    watchful_table_deinit(&wm->dirs);
+
+    free(wm->buf);
+    wm->buf = NULL;
+
+    free(wm->real_root);
+    wm->real_root = NULL;
+
+    close(wm->mount_fd);
+    wm->mount_fd = -1;
+
+    int error = close(wm->fd);
+    if (error) return 1;
+    wm->fd = -1;
+
+    return 0;
+}
+
+WatchfulBackend watchful_fanotify = {
+    .name = "fanotify",
+    .setup = setup,
+    .teardown = teardown,
+    .process = process_external,
+};
+
+#endif
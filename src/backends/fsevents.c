@@ -6,6 +6,7 @@ WatchfulBackend watchful_fsevents = {
     .name = "fsevents",
     .setup = NULL,
     .teardown = NULL,
+    .process = NULL,
 };
 
 #else
@@ -91,9 +92,9 @@ static void handle_event(
     const char **paths = eventPaths;
     WatchfulMonitor *wm = clientCallBackInfo;
 
+    WatchfulArena *arena = &wm->batch.arena;
     char *path = NULL;
     char *old_path = NULL;
-    WatchfulEvent *event = NULL;
 
     for (size_t i = 0; i < numEvents; i++) {
         /* 1. Set event_type for this event. */
@@ -106,37 +107,35 @@ static void handle_event(
         path = watchful_path_create(paths[i], NULL, eventFlags[i] & kFSEventStreamEventFlagItemIsDir);
         if (NULL == path) goto error;
 
-        /* 4. If file path is not excluded. */
-        if (!watchful_monitor_excludes_path(wm, path)) {
+        /* 4. If file path is not excluded (and is included). */
+        if (!watchful_monitor_excludes_path(wm, path) && watchful_monitor_includes_path(wm, path)) {
             /* 5. Check if file path is the previous name. */
             if (event_type == WATCHFUL_EVENT_RENAMED && access(path, F_OK) != 0) {
-                old_path = path;
+                old_path = watchful_arena_strdup(arena, path);
+                if (NULL == old_path) goto error;
+                free(path);
                 path = NULL;
                 continue;
             }
 
-            event = malloc(sizeof(WatchfulEvent));
-            if (NULL == event) goto error;
-            event->type = event_type;
-            event->at = time(NULL);
-            event->path = path;
-            event->old_path = old_path;
-            wm->callback(event, wm->callback_info);
+            /* 6. Add event to the batch. */
+            char *event_path = watchful_arena_strdup(arena, path);
+            if (NULL == event_path) goto error;
+            int err = watchful_batch_add(wm, event_type, event_path, old_path);
+            if (err) goto error;
         }
 
-        /* 6. Free memory. */
+        /* 7. Free memory. */
         free(path);
         path = NULL;
-        free(old_path);
         old_path = NULL;
-        free(event);
-        event = NULL;
     }
 
+    /* FSEvents already delivers events in groups so each is flushed */
+    watchful_batch_flush(wm);
+
 error:
     free(path);
-    free(old_path);
-    free(event);
 
     return;
 }
@@ -305,6 +304,7 @@ WatchfulBackend watchful_fsevents = {
     .name = "fsevents",
     .setup = setup,
     .teardown = teardown,
+    .process = NULL,
 };
 
 #endif
@@ -6,19 +6,28 @@ WatchfulBackend watchful_inotify = {
     .name = "inotify",
     .setup = NULL,
     .teardown = NULL,
+    .process = NULL,
 };
 
-#else
+WatchfulRegistry *watchful_registry_create(WatchfulLoop *loop) {
+    (void)loop;
+    return NULL;
+}
+
+void watchful_registry_destroy(WatchfulRegistry *registry) {
+    (void)registry;
+    return;
+}
 
-bool start_waiting;
-pthread_mutex_t start_mutex;
-pthread_cond_t start_cond;
+#else
 
 /* Forward declarations */
 static int remove_watch(WatchfulMonitor *wm, WatchfulWatch *watch);
-static int remove_watches_from_root(WatchfulMonitor *wm, const char *root);
-static int add_watch(WatchfulMonitor *wm, char *path);
-static int add_watches_to_root(WatchfulMonitor *wm, const char *root);
+static int remove_watches_from_root(WatchfulMonitor *wm, WatchfulWatch *root);
+static int add_watch(WatchfulMonitor *wm, WatchfulWatch *parent, const char *name, const char *dir_path, int wd, WatchfulWatch **added);
+static int add_watches_to_root(WatchfulMonitor *wm, WatchfulWatch *parent, const char *name);
+static int watch_expand(WatchfulMonitor *wm, WatchfulWatch *watch);
+static bool degraded_forget(WatchfulMonitor *wm, const char *path);
 
 static int translate_event(const struct inotify_event *event) {
     if (event->cookie) {
@@ -36,336 +45,1538 @@ static int translate_event(const struct inotify_event *event) {
 }
 
 static WatchfulWatch *watch_for_wd(WatchfulMonitor *wm, int wd) {
-    for (size_t i = 0; i < wm->watches_len; i++) {
-        if (wd == wm->watches[i]->wd) return wm->watches[i];
+    return watchful_table_get(&wm->wds, (uint64_t)wd);
+}
+
+/* Tree Functions */
+
+static size_t watch_path_len(WatchfulWatch *watch, const char *name, bool is_dir) {
+    size_t len = 0;
+    for (WatchfulWatch *w = watch; NULL != w; w = w->parent) len += strlen(w->name) + ((NULL == w->parent) ? 0 : 1);
+    size_t name_len = (NULL == name) ? 0 : strlen(name);
+    return len + name_len + ((name_len && is_dir) ? 1 : 0);
+}
+
+static void watch_path_write(WatchfulWatch *watch, const char *name, bool is_dir, char *path, size_t path_len) {
+    /* The root holds the absolute path (with separator); others hold a name */
+    size_t name_len = (NULL == name) ? 0 : strlen(name);
+    size_t sep_len = (name_len && is_dir) ? 1 : 0;
+    size_t dir_len = path_len - name_len - sep_len;
+
+    size_t pos = dir_len;
+    WatchfulWatch *root = watch;
+    for (; NULL != root->parent; root = root->parent) {
+        size_t len = strlen(root->name);
+        path[--pos] = '/';
+        pos -= len;
+        memcpy(path + pos, root->name, len);
     }
+    memcpy(path, root->name, pos);
+
+    if (name_len) memcpy(path + dir_len, name, name_len);
+    if (sep_len) path[dir_len + name_len] = '/';
+    path[dir_len + name_len + sep_len] = '\0';
 
+    return;
+}
+
+static char *watch_path_create(WatchfulWatch *watch, const char *name, bool is_dir) {
+    size_t path_len = watch_path_len(watch, name, is_dir);
+    char *path = malloc(sizeof(char) * (path_len + 1));
+    if (NULL == path) return NULL;
+    watch_path_write(watch, name, is_dir, path, path_len);
+    return path;
+}
+
+static char *watch_path_in_arena(WatchfulWatch *watch, const char *name, bool is_dir, WatchfulArena *arena) {
+    /* Paths for events are allocated from the batch they will be added to */
+    size_t path_len = watch_path_len(watch, name, is_dir);
+    char *path = watchful_arena_alloc(arena, path_len + 1);
+    if (NULL == path) return NULL;
+    watch_path_write(watch, name, is_dir, path, path_len);
+    return path;
+}
+
+static bool watch_excludes(WatchfulMonitor *wm, WatchfulWatch *watch, const char *path) {
+    /* Only the patterns that can match beneath the directory are tried */
+    if (wm->excludes->len == 0) return false;
+    return watchful_matcher_matches_in(wm->excludes->matcher, watch->scope, path);
+}
+
+static bool watch_is_unscoped(WatchfulWatch *watch) {
+    return NULL == watch->scope || watch->scope->state == WATCHFUL_SCOPE_NONE;
+}
+
+static bool watch_is_deepest(WatchfulMonitor *wm, size_t depth) {
+    return wm->crawl.max_depth && depth >= wm->crawl.max_depth;
+}
+
+static bool watch_is_reached(WatchfulMonitor *wm, const char *path) {
+    /* Directories on another filesystem than the root's are not crawled */
+    if (!wm->crawl.one_filesystem) return true;
+    struct stat st;
+    if (stat(path, &st) == -1) return false;
+    return st.st_dev == wm->crawl.dev;
+}
+
+static WatchfulWatch *watch_child(WatchfulWatch *parent, const char *name) {
+    for (WatchfulWatch *child = parent->child; NULL != child; child = child->next) {
+        if (!strcmp(child->name, name)) return child;
+    }
     return NULL;
 }
 
-static int handle_event(WatchfulMonitor *wm) {
-    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
-    const struct inotify_event *notify_event;
+static void watch_attach(WatchfulWatch *parent, WatchfulWatch *child) {
+    /* Each watch counts the watches in its subtree, itself included */
+    for (WatchfulWatch *above = parent; NULL != above; above = above->parent) above->watches += child->watches;
+    child->parent = parent;
+    child->prev = NULL;
+    child->next = parent->child;
+    if (NULL != parent->child) parent->child->prev = child;
+    parent->child = child;
+    return;
+}
 
-    /* if (stream->delay) { */
-    /*     int seconds = (int)stream->delay; */
-    /*     int nanoseconds = (int)((stream->delay - seconds) * 100000000); */
-    /*     struct timespec duration = { .tv_sec = seconds, .tv_nsec = nanoseconds, }; */
-    /*     nanosleep(&duration, NULL); */
-    /* } */
+static void watch_detach(WatchfulWatch *child) {
+    if (NULL == child->parent) return;
+    for (WatchfulWatch *above = child->parent; NULL != above; above = above->parent) above->watches -= child->watches;
+    if (NULL != child->prev) child->prev->next = child->next;
+    else child->parent->child = child->next;
+    if (NULL != child->next) child->next->prev = child->prev;
+    child->parent = NULL;
+    child->prev = NULL;
+    child->next = NULL;
+    return;
+}
 
-    int size = read(wm->fd, buf, sizeof(buf));
-    if (size <= 0) return 1;
+static int watch_rename(WatchfulMonitor *wm, WatchfulWatch *watch, WatchfulWatch *parent, const char *name) {
+    size_t name_len = strlen(name);
+    char *new_name = malloc(sizeof(char) * (name_len + 1));
+    if (NULL == new_name) return 1;
+    memcpy(new_name, name, name_len + 1);
 
-    char *path = NULL;
-    char *old_path = NULL;
-    WatchfulEvent *event = NULL;
-
-    for (char *ptr = buf; ptr < buf + size; ptr += sizeof(struct inotify_event) + notify_event->len) {
-        notify_event = (const struct inotify_event *)ptr;
-
-        /* 1. Get watch for watch descriptor. */
-        WatchfulWatch *watch = watch_for_wd(wm, notify_event->wd);
-        if (NULL == watch) continue;
-
-        /* 2. Set event_type for this event. */
-        int event_type = translate_event(notify_event);
-
-        /* 3. If event is excluded, skip. */
-        if (!(event_type && (wm->events & event_type))) continue;
-
-        /* 4. Create absolute path for file. */
-        path = (notify_event->len) ?
-            watchful_path_create(notify_event->name, watch->path, (notify_event->mask & IN_ISDIR) != 0) :
-            watchful_path_create(watch->path, NULL, true);
-        if (path == NULL) goto error;
-
-        /* 5. If file path is not excluded. */
-        if (!watchful_monitor_excludes_path(wm, path)) {
-            /* 6. Add or remove watches as appropriate. */
-            int err = 0;
-            switch (event_type) {
-                case WATCHFUL_EVENT_CREATED:
-                    if (!watchful_path_is_dir(path)) break;
-                    err = add_watches_to_root(wm, path);
-                    if (err) goto error;
-                    break;
-                case WATCHFUL_EVENT_RENAMED:
-                    if (notify_event->mask & IN_MOVED_FROM) {
-                        /* Find other way to check if dir */
-                        remove_watches_from_root(wm, path);
-                        old_path = path;
-                        path = NULL;
-                        continue;
-                    } else if (watchful_path_is_dir(path)) {
-                        err = add_watches_to_root(wm, path);
-                        if (err) goto error;
-                    }
-                    break;
-                case WATCHFUL_EVENT_DELETED:
-                    if (notify_event->mask & IN_DELETE_SELF) remove_watch(wm, watch);
-                    break;
-                default:
-                    break;
+    __atomic_fetch_add(&wm->stats.watches_memory, name_len, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&wm->stats.watches_memory, strlen(watch->name), __ATOMIC_RELAXED);
+    free(watch->name);
+    watch->name = new_name;
+    watch_detach(watch);
+    watch_attach(parent, watch);
+
+    return 0;
+}
+
+static WatchfulWatch *watch_for_dir(WatchfulMonitor *wm, const char *path, size_t path_len) {
+    /* Walks down from the root one name at a time */
+    if (NULL == wm->root) return NULL;
+    size_t root_len = strlen(wm->root->name);
+    if (path_len < root_len || strncmp(path, wm->root->name, root_len)) return NULL;
+
+    WatchfulWatch *watch = wm->root;
+    size_t pos = root_len;
+    while (pos < path_len && NULL != watch) {
+        const char *sep = memchr(path + pos, '/', path_len - pos);
+        size_t name_len = (NULL == sep) ? path_len - pos : (size_t)(sep - (path + pos));
+        WatchfulWatch *child = watch->child;
+        while (NULL != child && (strlen(child->name) != name_len || strncmp(child->name, path + pos, name_len))) child = child->next;
+        watch = child;
+        pos += name_len + 1;
+    }
+
+    return watch;
+}
+
+/* Share Functions */
+
+/* Monitors in a registry read events from one inotify instance. The kernel
+ * already gives an instance one watch per inode, so a directory watched by
+ * several monitors has one watch descriptor and the registry keeps the list
+ * of monitors sharing it. The watch is removed when the last one lets go.
+ * Every shared watch asks for all the events any monitor could want and each
+ * monitor filters them as it would its own. */
+
+#define SHARED_EVENTS (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)
+
+static bool list_has(const WatchfulMonitorList *list, const WatchfulMonitor *wm) {
+    for (size_t i = 0; i < list->len; i++) {
+        if (list->monitors[i] == wm) return true;
+    }
+    return false;
+}
+
+static int list_add(WatchfulMonitorList *list, WatchfulMonitor *wm) {
+    if (list->len == list->cap) {
+        size_t cap = (0 == list->cap) ? 4 : list->cap * 2;
+        WatchfulMonitor **monitors = realloc(list->monitors, sizeof(WatchfulMonitor *) * cap);
+        if (NULL == monitors) return 1;
+        list->monitors = monitors;
+        list->cap = cap;
+    }
+    list->monitors[list->len++] = wm;
+    return 0;
+}
+
+static void list_remove(WatchfulMonitorList *list, const WatchfulMonitor *wm) {
+    /* Order does not matter so the last monitor takes the removed one's place */
+    for (size_t i = 0; i < list->len; i++) {
+        if (list->monitors[i] != wm) continue;
+        list->monitors[i] = list->monitors[--list->len];
+        return;
+    }
+    return;
+}
+
+static int list_copy(WatchfulMonitorList *dst, const WatchfulMonitorList *src) {
+    dst->len = 0;
+    for (size_t i = 0; i < src->len; i++) {
+        if (list_add(dst, src->monitors[i])) return 1;
+    }
+    return 0;
+}
+
+static void share_remove(WatchfulRegistry *registry, int wd, const WatchfulMonitor *wm) {
+    /* The caller holds the registry's lock */
+    WatchfulMonitorList *share = watchful_table_get(&registry->shares, (uint64_t)wd);
+    if (NULL != share) {
+        list_remove(share, wm);
+        if (share->len) return;
+        watchful_table_remove(&registry->shares, (uint64_t)wd);
+        free(share->monitors);
+        free(share);
+    }
+    inotify_rm_watch(registry->fd, wd);
+    return;
+}
+
+static int share_add(WatchfulRegistry *registry, int wd, WatchfulMonitor *wm) {
+    int err = 0;
+    pthread_mutex_lock(&registry->lock);
+
+    WatchfulMonitorList *share = watchful_table_get(&registry->shares, (uint64_t)wd);
+    if (NULL == share) {
+        share = calloc(1, sizeof(WatchfulMonitorList));
+        err = (NULL == share) ? 1 : watchful_table_put(&registry->shares, (uint64_t)wd, share);
+        if (err) {
+            free(share);
+            share = NULL;
+        }
+    }
+    if (!err && !list_has(share, wm)) err = list_add(share, wm);
+    if (err) share_remove(registry, wd, wm);
+
+    pthread_mutex_unlock(&registry->lock);
+    return err;
+}
+
+static int kernel_watch(WatchfulMonitor *wm, const char *path, uint32_t mask, int wd) {
+    /* A watch descriptor already known (e.g. copied from another monitor in
+     * the registry) only needs sharing */
+    WatchfulRegistry *registry = wm->registry;
+    if (NULL == registry) return inotify_add_watch(wm->fd, path, mask);
+
+    if (wd == -1) wd = inotify_add_watch(registry->fd, path, SHARED_EVENTS);
+    if (wd == -1) return -1;
+    if (share_add(registry, wd, wm)) return -1;
+
+    return wd;
+}
+
+static void kernel_unwatch(WatchfulMonitor *wm, int wd) {
+    WatchfulRegistry *registry = wm->registry;
+    if (NULL == registry) {
+        inotify_rm_watch(wm->fd, wd);
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    share_remove(registry, wd, wm);
+    pthread_mutex_unlock(&registry->lock);
+    return;
+}
+
+/* Move Functions */
+
+/* The halves of a rename share a cookie. The first half waits in a table
+ * until the second arrives, which may be in a later read, and expires into
+ * a deletion if it never does. A directory's watches wait with it, detached
+ * from the tree, so that they can be kept if it stays beneath the root. */
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void move_free(WatchfulMonitor *wm, WatchfulMove *move) {
+    if (NULL != move->moved) {
+        __atomic_fetch_sub(&wm->stats.watches_dead, move->moved->watches, __ATOMIC_RELAXED);
+        remove_watches_from_root(wm, move->moved);
+    }
+    free(move->old_path);
+    free(move);
+    return;
+}
+
+static int move_start(WatchfulMonitor *wm, uint32_t cookie, const char *old_path, WatchfulWatch *moved) {
+    WatchfulMove *move = malloc(sizeof(WatchfulMove));
+    if (NULL == move) return 1;
+    move->old_path = NULL;
+    move->moved = moved;
+    move->expires = now_seconds() + WATCHFUL_MOVE_EXPIRY;
+
+    if (NULL != old_path) {
+        size_t old_path_len = strlen(old_path);
+        move->old_path = malloc(sizeof(char) * (old_path_len + 1));
+        if (NULL == move->old_path) goto error;
+        memcpy(move->old_path, old_path, old_path_len + 1);
+    }
+
+    /* A cookie is not reused while its rename is pending but is checked */
+    WatchfulMove *stale = watchful_table_remove(&wm->moves, (uint64_t)cookie);
+    if (NULL != stale) move_free(wm, stale);
+
+    int err = watchful_table_put(&wm->moves, (uint64_t)cookie, move);
+    if (err) goto error;
+
+    return 0;
+
+error:
+    move_free(wm, move);
+    return 1;
+}
+
+static WatchfulMove *move_finish(WatchfulMonitor *wm, uint32_t cookie) {
+    return watchful_table_remove(&wm->moves, (uint64_t)cookie);
+}
+
+static void move_forget_watch(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    /* A detached directory whose watch the kernel drops is freed elsewhere */
+    for (size_t i = 0; i < wm->moves.cap; i++) {
+        WatchfulMove *move = wm->moves.entries[i].value;
+        if (NULL != move && move->moved == watch) move->moved = NULL;
+    }
+    return;
+}
+
+static double moves_wait(WatchfulMonitor *wm) {
+    /* Returns the seconds until a pending move expires (-1 if none) */
+    if (0 == wm->moves.len) return -1;
+    double now = now_seconds();
+    double remaining = -1;
+    for (size_t i = 0; i < wm->moves.cap; i++) {
+        WatchfulMove *move = wm->moves.entries[i].value;
+        if (NULL == move) continue;
+        double left = (move->expires > now) ? move->expires - now : 0;
+        if (remaining < 0 || left < remaining) remaining = left;
+    }
+    return remaining;
+}
+
+static int moves_expire(WatchfulMonitor *wm, bool all) {
+    /* A rename whose second half never came moved out of the root */
+    if (0 == wm->moves.len) return 0;
+    int err = 0;
+    double now = now_seconds();
+    size_t i = 0;
+    while (i < wm->moves.cap) {
+        WatchfulMove *move = wm->moves.entries[i].value;
+        if (NULL == move || (!all && move->expires > now)) {
+            i++;
+            continue;
+        }
+
+        /* Removal shifts a later entry into this slot, so it is not skipped */
+        watchful_table_remove(&wm->moves, wm->moves.entries[i].key);
+        if (!err && NULL != move->old_path && (wm->events & WATCHFUL_EVENT_DELETED)) {
+            if (wm->delay > 0) {
+                err = watchful_debounce_add(wm, WATCHFUL_EVENT_DELETED, move->old_path, NULL);
+            } else {
+                char *path = watchful_arena_strdup(&wm->batch.arena, move->old_path);
+                err = (NULL == path) ? 1 : watchful_batch_add(wm, WATCHFUL_EVENT_DELETED, path, NULL);
+            }
+        }
+        move_free(wm, move);
+    }
+
+    return err;
+}
+
+/* Rescan Functions */
+
+static void *rescan_runner(void *arg) {
+    WatchfulMonitor *wm = arg;
+    WatchfulRescan *rescan = &wm->rescanning;
+
+    WatchfulSnapshot *scan = watchful_snapshot_create();
+    int err = (NULL == scan) ? 1 : 0;
+    if (!err) err = watchful_snapshot_scan(scan, wm);
+    if (!err) err = watchful_snapshot_diff(wm->snapshot, scan, rescan->since, &rescan->changes, &rescan->changes_len);
+    watchful_snapshot_destroy(scan);
+    rescan->err = err;
+
+    /* The changes are picked up by whichever thread processes the monitor */
+    __atomic_store_n(&rescan->is_done, true, __ATOMIC_SEQ_CST);
+    struct itimerspec now = { .it_value.tv_nsec = 1 };
+    timerfd_settime(wm->timer_fd, 0, &now, NULL);
+
+    return NULL;
+}
+
+static int rescan_start(WatchfulMonitor *wm) {
+    WatchfulRescan *rescan = &wm->rescanning;
+    if (!wm->rescan || NULL == wm->snapshot) return 0;
+
+    /* Events lost while a rescan runs need another one after it */
+    if (rescan->is_running) {
+        rescan->again = true;
+        return 0;
+    }
+
+    rescan->since = watchful_snapshot_begin(wm->snapshot);
+    rescan->is_done = false;
+    rescan->again = false;
+    rescan->err = 0;
+    rescan->changes = NULL;
+    rescan->changes_len = 0;
+
+    int err = pthread_create(&rescan->thread, NULL, rescan_runner, wm);
+    if (err) return 1;
+    rescan->is_running = true;
+
+    return 0;
+}
+
+static int rescan_change(WatchfulMonitor *wm, WatchfulEvent *change) {
+    /* Directories created or deleted while events were lost are only found
+     * by the rescan so their watches are updated here */
+    size_t path_len = strlen(change->path);
+    if (path_len && change->path[path_len - 1] == '/') {
+        if (change->type == WATCHFUL_EVENT_CREATED) {
+            size_t dir_len = path_len - 1;
+            while (dir_len && change->path[dir_len - 1] != '/') dir_len--;
+            WatchfulWatch *parent = watch_for_dir(wm, change->path, dir_len);
+            if (NULL != parent) {
+                change->path[path_len - 1] = '\0';
+                int err = add_watches_to_root(wm, parent, change->path + dir_len);
+                change->path[path_len - 1] = '/';
+                if (err) return 1;
             }
+        } else if (change->type == WATCHFUL_EVENT_DELETED) {
+            WatchfulWatch *watch = watch_for_dir(wm, change->path, path_len);
+            if (NULL != watch && watch != wm->root) remove_watches_from_root(wm, watch);
+            degraded_forget(wm, change->path);
+        }
+    }
+
+    if (!(wm->events & change->type)) {
+        __atomic_fetch_add(&wm->stats.events_filtered, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (!watchful_monitor_includes_path(wm, change->path)) {
+        __atomic_fetch_add(&wm->stats.events_excluded, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (wm->delay > 0) return watchful_debounce_add(wm, change->type, change->path, NULL);
+
+    char *path = watchful_arena_strdup(&wm->batch.arena, change->path);
+    if (NULL == path) return 1;
+    return watchful_batch_add(wm, change->type, path, NULL);
+}
+
+static bool rescan_is_done(WatchfulMonitor *wm) {
+    return wm->rescanning.is_running && __atomic_load_n(&wm->rescanning.is_done, __ATOMIC_SEQ_CST);
+}
+
+static int rescan_finish(WatchfulMonitor *wm, bool wait) {
+    WatchfulRescan *rescan = &wm->rescanning;
+    if (!rescan->is_running) return 0;
+    if (!wait && !__atomic_load_n(&rescan->is_done, __ATOMIC_SEQ_CST)) return 0;
 
-            /* 7. Call callback with event data. */
-            event = malloc(sizeof(WatchfulEvent));
-            if (NULL == event) goto error;
-            event->type = event_type;
-            event->at = time(NULL);
-            event->path = path;
-            event->old_path = old_path;
-            wm->callback(event, wm->callback_info);
+    pthread_join(rescan->thread, NULL);
+    rescan->is_running = false;
+
+    int err = rescan->err;
+    for (size_t i = 0; i < rescan->changes_len; i++) {
+        if (!err && !wait) err = rescan_change(wm, &rescan->changes[i]);
+        free(rescan->changes[i].path);
+    }
+    free(rescan->changes);
+    rescan->changes = NULL;
+    rescan->changes_len = 0;
+
+    if (!err && !wait && rescan->again) err = rescan_start(wm);
+
+    return err;
+}
+
+/* Budget Functions */
+
+/* A monitor holds at most a budget of watches, which is never more than the
+ * kernel's limit for the user. A directory that cannot have a watch (the
+ * kernel can run out first, as the limit is shared) is degraded: it and its
+ * subtree are compared with a snapshot at the monitor's interval instead.
+ * Shallow directories are watched before deep ones and, at the same depth,
+ * recently active ones before the rest. The watches at each depth are kept
+ * in a list from the most to the least recently active for this. */
+
+static size_t budget_limit(WatchfulMonitor *wm) {
+    size_t limit = 0;
+    FILE *file = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+    if (NULL != file) {
+        unsigned long value = 0;
+        if (1 == fscanf(file, "%lu", &value)) limit = (size_t)value;
+        fclose(file);
+    }
+    if (wm->budget && (0 == limit || wm->budget < limit)) limit = wm->budget;
+    return limit;
+}
+
+static void budget_return(WatchfulMonitor *wm) {
+    /* Gives back a slot that was reserved for a watch never added */
+    pthread_mutex_lock(&wm->watches_lock);
+    wm->watches_len--;
+    pthread_mutex_unlock(&wm->watches_lock);
+    return;
+}
+
+static int levels_reserve(WatchfulMonitor *wm, size_t depth) {
+    if (depth < wm->levels_len) return 0;
+    size_t len = (0 == wm->levels_len) ? 16 : wm->levels_len;
+    while (len <= depth) len *= 2;
+
+    WatchfulLevel *levels = realloc(wm->levels, sizeof(WatchfulLevel) * len);
+    if (NULL == levels) return 1;
+    memset(levels + wm->levels_len, 0, sizeof(WatchfulLevel) * (len - wm->levels_len));
+    wm->levels = levels;
+    wm->levels_len = len;
+
+    return 0;
+}
+
+static void level_link(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    WatchfulLevel *level = &wm->levels[watch->depth];
+    watch->newer = NULL;
+    watch->older = level->newest;
+    if (NULL != level->newest) level->newest->newer = watch;
+    else level->oldest = watch;
+    level->newest = watch;
+    return;
+}
+
+static void level_unlink(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    WatchfulLevel *level = &wm->levels[watch->depth];
+    if (NULL != watch->newer) watch->newer->older = watch->older;
+    else level->newest = watch->older;
+    if (NULL != watch->older) watch->older->newer = watch->newer;
+    else level->oldest = watch->newer;
+    watch->newer = NULL;
+    watch->older = NULL;
+    return;
+}
+
+static void level_touch(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    if (wm->levels[watch->depth].newest == watch) return;
+    level_unlink(wm, watch);
+    level_link(wm, watch);
+    return;
+}
+
+static int level_move(WatchfulMonitor *wm, WatchfulWatch *watch, size_t depth) {
+    /* A directory moved to another depth takes its subtree with it, and one
+     * moved at the same depth leaves its subtree's levels as they are */
+    if (watch->depth == depth) return 0;
+    if (levels_reserve(wm, depth)) return 1;
+    level_unlink(wm, watch);
+    watch->depth = depth;
+    level_link(wm, watch);
+
+    for (WatchfulWatch *child = watch->child; NULL != child; child = child->next) {
+        if (level_move(wm, child, depth + 1)) return 1;
+    }
+
+    return 0;
+}
+
+static void degraded_free(WatchfulDegraded *degraded) {
+    free(degraded->path);
+    watchful_snapshot_destroy(degraded->snapshot);
+    return;
+}
+
+static int degraded_add(WatchfulMonitor *wm, const char *path, size_t depth) {
+    /* Crawl workers can degrade directories concurrently */
+    size_t path_len = strlen(path);
+    char *copy = malloc(sizeof(char) * (path_len + 1));
+    if (NULL == copy) return 1;
+    memcpy(copy, path, path_len + 1);
+
+    int err = 0;
+    pthread_mutex_lock(&wm->degraded_lock);
+    if (wm->degraded_len == wm->degraded_cap) {
+        size_t cap = (0 == wm->degraded_cap) ? 16 : wm->degraded_cap * 2;
+        WatchfulDegraded *degraded = realloc(wm->degraded, sizeof(WatchfulDegraded) * cap);
+        if (NULL == degraded) {
+            err = 1;
+        } else {
+            wm->degraded = degraded;
+            wm->degraded_cap = cap;
         }
+    }
+    if (!err) {
+        WatchfulDegraded *degraded = &wm->degraded[wm->degraded_len++];
+        degraded->path = copy;
+        degraded->depth = depth;
+        degraded->snapshot = NULL;
+    }
+    pthread_mutex_unlock(&wm->degraded_lock);
 
-        /* 8. Free memory. */
+    if (err) free(copy);
+    return err;
+}
+
+static bool degraded_forget(WatchfulMonitor *wm, const char *path) {
+    /* Forgets the degraded subtrees at or beneath the path (if any) */
+    if (0 == wm->degraded_len) return false;
+
+    bool is_found = false;
+    pthread_mutex_lock(&wm->degraded_lock);
+    size_t i = 0;
+    while (i < wm->degraded_len) {
+        if (!watchful_path_is_prefixed(wm->degraded[i].path, path)) {
+            i++;
+            continue;
+        }
+        degraded_free(&wm->degraded[i]);
+        wm->degraded[i] = wm->degraded[--wm->degraded_len];
+        is_found = true;
+    }
+    pthread_mutex_unlock(&wm->degraded_lock);
+
+    return is_found;
+}
+
+static void degraded_clear(WatchfulMonitor *wm) {
+    pthread_mutex_lock(&wm->degraded_lock);
+    for (size_t i = 0; i < wm->degraded_len; i++) degraded_free(&wm->degraded[i]);
+    free(wm->degraded);
+    wm->degraded = NULL;
+    wm->degraded_len = 0;
+    wm->degraded_cap = 0;
+    pthread_mutex_unlock(&wm->degraded_lock);
+    return;
+}
+
+static int degraded_scan(WatchfulMonitor *wm) {
+    /* A subtree is scanned once it is degraded; one that cannot be scanned
+     * has gone and its deletion is reported by its parent's watch */
+    int err = 0;
+    pthread_mutex_lock(&wm->degraded_lock);
+    size_t i = 0;
+    while (i < wm->degraded_len) {
+        WatchfulDegraded *degraded = &wm->degraded[i];
+        if (NULL != degraded->snapshot) {
+            i++;
+            continue;
+        }
+
+        size_t path_len = strlen(degraded->path);
+        degraded->snapshot = watchful_snapshot_create();
+        if (NULL != degraded->snapshot) degraded->snapshot->root = malloc(sizeof(char) * (path_len + 1));
+        if (NULL == degraded->snapshot || NULL == degraded->snapshot->root) {
+            err = 1;
+            break;
+        }
+        memcpy(degraded->snapshot->root, degraded->path, path_len + 1);
+
+        if (watchful_snapshot_scan(degraded->snapshot, wm)) {
+            degraded_free(degraded);
+            wm->degraded[i] = wm->degraded[--wm->degraded_len];
+            continue;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&wm->degraded_lock);
+
+    return err;
+}
+
+static double degraded_wait(WatchfulMonitor *wm) {
+    /* Returns the seconds until degraded subtrees are next scanned (-1 if none) */
+    if (0 == wm->degraded_len) return -1;
+    double left = wm->degraded_next - now_seconds();
+    return (left > 0) ? left : 0;
+}
+
+static int degraded_refresh(WatchfulMonitor *wm, const char *path) {
+    /* Compares the degraded subtrees (or just the one at the path) with
+     * their snapshots. The changes are collected first as handling them can
+     * change the list. */
+    WatchfulEvent *changes = NULL;
+    size_t changes_len = 0;
+    int err = 0;
+
+    pthread_mutex_lock(&wm->degraded_lock);
+    size_t i = 0;
+    while (!err && i < wm->degraded_len) {
+        WatchfulDegraded *degraded = &wm->degraded[i];
+        if (NULL == degraded->snapshot || (NULL != path && strcmp(degraded->path, path))) {
+            i++;
+            continue;
+        }
+
+        WatchfulEvent *found = NULL;
+        size_t found_len = 0;
+        if (watchful_snapshot_refresh(degraded->snapshot, wm, &found, &found_len)) {
+            degraded_free(degraded);
+            wm->degraded[i] = wm->degraded[--wm->degraded_len];
+            continue;
+        }
+
+        if (found_len) {
+            WatchfulEvent *grown = realloc(changes, sizeof(WatchfulEvent) * (changes_len + found_len));
+            if (NULL == grown) {
+                for (size_t j = 0; j < found_len; j++) free(found[j].path);
+                err = 1;
+            } else {
+                changes = grown;
+                memcpy(changes + changes_len, found, sizeof(WatchfulEvent) * found_len);
+                changes_len += found_len;
+            }
+        }
+        free(found);
+        i++;
+    }
+    pthread_mutex_unlock(&wm->degraded_lock);
+
+    for (size_t j = 0; j < changes_len; j++) {
+        if (!err) err = rescan_change(wm, &changes[j]);
+        free(changes[j].path);
+    }
+    free(changes);
+
+    return err;
+}
+
+static WatchfulWatch *budget_victim(WatchfulMonitor *wm, size_t depth) {
+    /* The least recently active of the deepest watches beneath the root,
+     * provided it is deeper than the depth */
+    for (size_t d = wm->levels_len; d > depth + 1; d--) {
+        for (WatchfulWatch *watch = wm->levels[d - 1].oldest; NULL != watch; watch = watch->newer) {
+            WatchfulWatch *top = watch;
+            while (NULL != top->parent) top = top->parent;
+            if (top == wm->root) return watch;
+        }
+    }
+    return NULL;
+}
+
+static int budget_evict(WatchfulMonitor *wm, WatchfulWatch *victim) {
+    /* Nothing beneath the victim is watched as it is one of the deepest */
+    char *path = watch_path_create(victim, NULL, true);
+    if (NULL == path) return 1;
+
+    size_t depth = victim->depth;
+    remove_watches_from_root(wm, victim);
+    degraded_forget(wm, path);
+    int err = degraded_add(wm, path, depth);
+    free(path);
+
+    return err;
+}
+
+static int budget_promote(WatchfulMonitor *wm, char *path) {
+    /* What changed since the last poll is reported and the directory is then
+     * crawled as if it were new, which degrades whatever beneath it there
+     * are no watches left for */
+    int err = degraded_refresh(wm, path);
+    if (err) return 1;
+    if (!degraded_forget(wm, path)) return 0;
+
+    size_t path_len = strlen(path);
+    size_t dir_len = path_len - 1;
+    while (dir_len && path[dir_len - 1] != '/') dir_len--;
+    WatchfulWatch *parent = watch_for_dir(wm, path, dir_len);
+    if (NULL == parent) return 0;
+
+    path[path_len - 1] = '\0';
+    return add_watches_to_root(wm, parent, path + dir_len);
+}
+
+static int budget_rebalance(WatchfulMonitor *wm) {
+    /* The shallowest degraded directory is watched again while there is room
+     * and otherwise takes the place of the least recently active of the
+     * deepest watched ones until none is deeper */
+    int err = 0;
+    wm->is_rebalancing = true;
+    while (!err && wm->degraded_len) {
+        size_t shallowest = 0;
+        for (size_t i = 1; i < wm->degraded_len; i++) {
+            if (wm->degraded[i].depth < wm->degraded[shallowest].depth) shallowest = i;
+        }
+
+        /* The kernel can still refuse, in which case it is left for later */
+        size_t watches_len = wm->watches_len;
+        bool has_room = 0 == wm->watches_max || watches_len < wm->watches_max;
+        WatchfulWatch *victim = has_room ? NULL : budget_victim(wm, wm->degraded[shallowest].depth);
+        if (!has_room && NULL == victim) break;
+
+        /* The path is copied as evicting the victim changes the list */
+        size_t path_len = strlen(wm->degraded[shallowest].path);
+        char *path = malloc(sizeof(char) * (path_len + 1));
+        if (NULL == path) {
+            err = 1;
+            break;
+        }
+        memcpy(path, wm->degraded[shallowest].path, path_len + 1);
+
+        if (NULL != victim) err = budget_evict(wm, victim);
+        if (!err) err = budget_promote(wm, path);
         free(path);
+        if (has_room && wm->watches_len == watches_len) break;
+    }
+    wm->is_rebalancing = false;
+
+    return err;
+}
+
+static int budget_settle(WatchfulMonitor *wm) {
+    /* Run once a crawl is over, as the crawl holds on to the watches it adds */
+    if (0 == wm->degraded_len || wm->is_rebalancing) return 0;
+    int err = budget_rebalance(wm);
+    if (!err) err = degraded_scan(wm);
+    return err;
+}
+
+static int degraded_poll(WatchfulMonitor *wm) {
+    if (0 == wm->degraded_len) return 0;
+    double now = now_seconds();
+    if (now < wm->degraded_next) return 0;
+    wm->degraded_next = now + wm->interval;
+
+    /* Watches given up since the last poll are then used for the subtrees */
+    int err = degraded_refresh(wm, NULL);
+    if (!err) err = budget_settle(wm);
+
+    return err;
+}
+
+static int overflowed(WatchfulMonitor *wm) {
+    /* Consumers are told at once; what was missed follows the rescan */
+    if (NULL == wm->root) return 0;
+    char *path = watch_path_in_arena(wm->root, NULL, true, &wm->batch.arena);
+    if (NULL == path) return 1;
+    int err = watchful_batch_add(wm, WATCHFUL_EVENT_OVERFLOW, path, NULL);
+    if (err) return 1;
+    return rescan_start(wm);
+}
+
+static int handle_one(WatchfulMonitor *wm, const struct inotify_event *notify_event) {
+    WatchfulArena *arena = &wm->batch.arena;
+    char *path = NULL;
+    WatchfulMove *move = NULL;
+
+    __atomic_fetch_add(&wm->stats.events_read, 1, __ATOMIC_RELAXED);
+
+    /* 0. Rescan if the kernel had to drop events. */
+    if (notify_event->mask & IN_Q_OVERFLOW) {
+        __atomic_fetch_add(&wm->stats.overflows, 1, __ATOMIC_RELAXED);
+        if (overflowed(wm)) goto error;
+        return 0;
+    }
+
+    /* 1. Get watch for watch descriptor. */
+    WatchfulWatch *watch = watch_for_wd(wm, notify_event->wd);
+    if (NULL == watch) return 0;
+
+    /* 2. Forget watches the kernel has dropped. */
+    WatchfulWatch *top = watch;
+    while (NULL != top->parent) top = top->parent;
+    if (notify_event->mask & IN_IGNORED) {
+        if (top != wm->root) __atomic_fetch_sub(&wm->stats.watches_dead, watch->watches, __ATOMIC_RELAXED);
+        if (NULL == watch->parent && watch != wm->root) move_forget_watch(wm, watch);
+        remove_watches_from_root(wm, watch);
+        return 0;
+    }
+
+    /* 3. Skip directories waiting for the second half of a rename. */
+    if (top != wm->root) return 0;
+    level_touch(wm, watch);
+
+    /* 4. Watch the subdirectories of a lazy directory now it is active. */
+    if (watch->is_lazy && watch_expand(wm, watch)) goto error;
+
+    /* 5. Set event_type for this event. */
+    int event_type = translate_event(notify_event);
+    if (!event_type) return 0;
+
+    /* 6. Create absolute path for file. */
+    bool is_dir = (notify_event->mask & IN_ISDIR) != 0;
+    WatchfulArenaMark mark = watchful_arena_mark(arena);
+    path = (notify_event->len) ?
+        watch_path_in_arena(watch, notify_event->name, is_dir, arena) :
+        watch_path_in_arena(watch, NULL, true, arena);
+    if (path == NULL) goto error;
+
+    /* 7. Check if file path is excluded (or not included, which hides it
+     * without affecting the watches). */
+    bool is_excluded = (notify_event->len) ?
+        watch_excludes(wm, watch, path) :
+        watchful_monitor_excludes_path(wm, path);
+    bool is_hidden = is_excluded || !watchful_monitor_includes_path(wm, path);
+
+    /* 8. Hold the first half of a rename until the second arrives. */
+    int err = 0;
+    if ((notify_event->mask & IN_MOVED_FROM) && notify_event->cookie) {
+        WatchfulWatch *moved = NULL;
+        if (is_dir && notify_event->len) {
+            /* Degraded subtrees beneath are found again by crawling it */
+            moved = watch_child(watch, notify_event->name);
+            if (NULL != moved && degraded_forget(wm, path)) {
+                remove_watches_from_root(wm, moved);
+                moved = NULL;
+            }
+            if (NULL != moved) {
+                watch_detach(moved);
+                __atomic_fetch_add(&wm->stats.watches_dead, moved->watches, __ATOMIC_RELAXED);
+            }
+        }
+        err = move_start(wm, notify_event->cookie, is_hidden ? NULL : path, moved);
+        watchful_arena_rewind(arena, mark);
         path = NULL;
-        free(old_path);
-        old_path = NULL;
-        free(event);
-        event = NULL;
+        if (err) goto error;
+        return 0;
     }
 
-    free(path);
-    free(old_path);
-    free(event);
+    /* 9. Pair the second half of a rename with the first (if the first
+     * was seen beneath the root at all). */
+    if ((notify_event->mask & IN_MOVED_TO) && notify_event->cookie) {
+        move = move_finish(wm, notify_event->cookie);
+        bool is_paired = NULL != move && NULL != move->old_path;
+        event_type = is_paired ? WATCHFUL_EVENT_RENAMED : WATCHFUL_EVENT_CREATED;
+    }
+
+    /* 10. Update the tree of watches as appropriate. */
+    if (is_dir && notify_event->len) {
+        if (notify_event->mask & IN_CREATE) {
+            if (!is_excluded) err = add_watches_to_root(wm, watch, notify_event->name);
+        } else if (notify_event->mask & IN_DELETE) {
+            WatchfulWatch *child = watch_child(watch, notify_event->name);
+            if (NULL != child) remove_watches_from_root(wm, child);
+            degraded_forget(wm, path);
+        } else if (notify_event->mask & IN_MOVED_TO) {
+            /* Kernel watches follow the inode, so keep the subtree unless
+             * excludes could apply beneath either location */
+            WatchfulWatch *moved = (NULL == move) ? NULL : move->moved;
+            bool is_level = NULL != moved && (0 == wm->crawl.max_depth || moved->depth == watch->depth + 1);
+            if (NULL != moved && !is_excluded && is_level && watch_is_unscoped(moved) && watch_is_unscoped(watch)) {
+                err = watch_rename(wm, moved, watch, notify_event->name);
+                if (!err) move->moved = NULL;
+                if (!err) __atomic_fetch_sub(&wm->stats.watches_dead, moved->watches, __ATOMIC_RELAXED);
+                if (!err) err = level_move(wm, moved, watch->depth + 1);
+            } else {
+                /* The old watches go first as the new ones reuse them */
+                if (NULL != move) move->moved = NULL;
+                if (NULL != moved) {
+                    __atomic_fetch_sub(&wm->stats.watches_dead, moved->watches, __ATOMIC_RELAXED);
+                    remove_watches_from_root(wm, moved);
+                }
+                if (!is_excluded) err = add_watches_to_root(wm, watch, notify_event->name);
+            }
+        }
+        if (err) goto error;
+    }
+
+    /* 11. A rename to a hidden path deletes the old one. */
+    if (event_type == WATCHFUL_EVENT_RENAMED && is_hidden) {
+        watchful_arena_rewind(arena, mark);
+        path = watchful_arena_strdup(arena, move->old_path);
+        if (NULL == path) goto error;
+        event_type = WATCHFUL_EVENT_DELETED;
+        is_hidden = false;
+    }
+
+    /* 12. If event type or file path is excluded, skip. */
+    if (!(wm->events & event_type) || is_hidden) {
+        uint64_t *dropped = is_hidden ? &wm->stats.events_excluded : &wm->stats.events_filtered;
+        __atomic_fetch_add(dropped, 1, __ATOMIC_RELAXED);
+        watchful_arena_rewind(arena, mark);
+        path = NULL;
+        if (NULL != move) move_free(wm, move);
+        move = NULL;
+        return 0;
+    }
+
+    /* 13. Add event to the batch (or hold it until the path is quiet). */
+    char *old_path = NULL;
+    if (event_type == WATCHFUL_EVENT_RENAMED && wm->delay > 0) {
+        old_path = move->old_path;
+    } else if (event_type == WATCHFUL_EVENT_RENAMED) {
+        old_path = watchful_arena_strdup(arena, move->old_path);
+        if (NULL == old_path) goto error;
+    }
+    err = (wm->delay > 0) ?
+        watchful_debounce_add(wm, event_type, path, old_path) :
+        watchful_batch_add(wm, event_type, path, old_path);
+    path = NULL;
+    if (NULL != move) move_free(wm, move);
+    move = NULL;
+    if (err) goto error;
 
     return 0;
 
 error:
-    free(path);
-    free(old_path);
-    free(event);
+    if (NULL != move) move_free(wm, move);
 
     return 1;
 }
 
-static void *loop_runner(void *arg) {
-    int error = 0;
-    WatchfulMonitor *wm = arg;
+static int handle_event(WatchfulMonitor *wm) {
+    const struct inotify_event *notify_event;
 
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
-    error = pthread_sigmask(SIG_BLOCK, &mask, NULL);
-    if (error) return NULL;
+    /* Read until the queue is empty */
+    ssize_t size;
+    while ((size = read(wm->fd, wm->buf, wm->read_len)) > 0) {
+        __atomic_fetch_add(&wm->stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&wm->stats.bytes_read, (uint64_t)size, __ATOMIC_RELAXED);
+        for (char *ptr = wm->buf; ptr < wm->buf + size; ptr += sizeof(struct inotify_event) + notify_event->len) {
+            notify_event = (const struct inotify_event *)ptr;
+            if (handle_one(wm, notify_event)) return 1;
+        }
+    }
+    if (size == -1 && errno != EAGAIN && errno != EINTR) return 1;
+
+    /* 14. Flush the batch unless it may wait for more events. */
+    if (watchful_batch_is_due(wm)) return watchful_batch_flush(wm);
+
+    return 0;
+}
+
+static int settle(WatchfulMonitor *wm, double *wait) {
+    /* Deadlines that fall between events are met whenever the monitor is
+     * processed and the wait until the next one is given back */
+    int err = moves_expire(wm, false);
+    if (!err) err = rescan_finish(wm, false);
+    if (!err) err = degraded_poll(wm);
+    if (!err) err = watchful_debounce_release(wm, false);
+    if (!err && watchful_batch_is_due(wm)) err = watchful_batch_flush(wm);
+
+    double due = rescan_is_done(wm) ? 0 : moves_wait(wm);
+    double polled = degraded_wait(wm);
+    if (polled >= 0 && (due < 0 || polled < due)) due = polled;
+    *wait = watchful_loop_wait(wm, due);
+
+    return err;
+}
+
+static int process(void *info) {
+    WatchfulMonitor *wm = info;
+    int err = 0;
 
-    int sfd = signalfd(-1, &mask, 0);
-    if (sfd == -1) return NULL;
+    uint64_t expirations;
+    ssize_t size = read(wm->timer_fd, &expirations, sizeof(expirations));
+    (void)size;
+
+    /* Let more events queue up so that each read returns more */
+    int queued = 0;
+    if (wm->read_wait > 0 && 0 == ioctl(wm->fd, FIONREAD, &queued) && queued > 0) {
+        struct timespec pause = {
+            .tv_sec = (time_t)wm->read_wait,
+            .tv_nsec = (long)((wm->read_wait - (double)(time_t)wm->read_wait) * 1e9),
+        };
+        nanosleep(&pause, NULL);
+    }
 
-    pthread_mutex_lock(&start_mutex);
-    start_waiting = false;
-    pthread_cond_signal(&start_cond);
-    pthread_mutex_unlock(&start_mutex);
+    wm->is_processing = true;
+    double wait = -1;
+    err = handle_event(wm);
+    if (!err) err = settle(wm, &wait);
+    if (!err) err = watchful_loop_set(wm->timer_fd, wait);
+    wm->is_processing = false;
 
-    while (1) {
-        int nfds = ((wm->fd < sfd) ? sfd : wm->fd) + 1;
+    return err;
+}
+
+static int process_external(WatchfulMonitor *wm) {
+    return process(wm);
+}
 
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(wm->fd, &readfds);
-        FD_SET(sfd, &readfds);
+/* Registry Functions */
 
-        select(nfds, &readfds, NULL, NULL, NULL);
-        if (FD_ISSET(sfd, &readfds)) break;
+/* A registry processes all of its monitors on one loop handler: events are
+ * read once and given to each monitor sharing the watch, and one timer is set
+ * for the soonest deadline of any of them. Processing holds the registry's
+ * process lock, which starting and stopping take to change its monitors (it
+ * is recursive so that a callback can do either). */
 
-        error = handle_event(wm);
-        if (error) return NULL;
+static int registry_read(WatchfulRegistry *registry) {
+    const struct inotify_event *notify_event;
+    int err = 0;
+
+    ssize_t size;
+    while ((size = read(registry->fd, registry->buf, registry->read_len)) > 0) {
+        /* Each read is counted by every monitor it was read for */
+        for (size_t i = 0; i < registry->attached.len; i++) {
+            WatchfulMonitor *wm = registry->attached.monitors[i];
+            __atomic_fetch_add(&wm->stats.reads, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&wm->stats.bytes_read, (uint64_t)size, __ATOMIC_RELAXED);
+        }
+
+        for (char *ptr = registry->buf; ptr < registry->buf + size; ptr += sizeof(struct inotify_event) + notify_event->len) {
+            notify_event = (const struct inotify_event *)ptr;
+
+            /* Monitors can change the share (or stop) as they handle it */
+            int copied = 0;
+            if (notify_event->mask & IN_Q_OVERFLOW) {
+                copied = list_copy(&registry->scratch, &registry->attached);
+            } else {
+                pthread_mutex_lock(&registry->lock);
+                WatchfulMonitorList *share = watchful_table_get(&registry->shares, (uint64_t)notify_event->wd);
+                registry->scratch.len = 0;
+                if (NULL != share) copied = list_copy(&registry->scratch, share);
+                pthread_mutex_unlock(&registry->lock);
+            }
+            if (copied) {
+                err = 1;
+                continue;
+            }
+
+            for (size_t i = 0; i < registry->scratch.len; i++) {
+                WatchfulMonitor *wm = registry->scratch.monitors[i];
+                if (!list_has(&registry->attached, wm)) continue;
+                if (handle_one(wm, notify_event)) err = 1;
+            }
+        }
+    }
+    if (size == -1 && errno != EAGAIN && errno != EINTR) err = 1;
+
+    return err;
+}
+
+static int registry_process(void *info) {
+    WatchfulRegistry *registry = info;
+    int err = 0;
+
+    uint64_t expirations;
+    ssize_t size = read(registry->timer_fd, &expirations, sizeof(expirations));
+    (void)size;
+
+    pthread_mutex_lock(&registry->process_lock);
+    registry->is_processing = true;
+
+    err = registry_read(registry);
+
+    double soonest = -1;
+    if (list_copy(&registry->scratch, &registry->attached)) err = 1;
+    for (size_t i = 0; i < registry->scratch.len; i++) {
+        WatchfulMonitor *wm = registry->scratch.monitors[i];
+        if (!list_has(&registry->attached, wm)) continue;
+        double wait = -1;
+        if (settle(wm, &wait)) err = 1;
+        if (wait >= 0 && (soonest < 0 || wait < soonest)) soonest = wait;
     }
+    if (watchful_loop_set(registry->timer_fd, soonest)) err = 1;
+
+    registry->is_processing = false;
+    pthread_mutex_unlock(&registry->process_lock);
 
-    close(sfd);
+    return err;
+}
 
+static WatchfulWatch *registry_source(WatchfulMonitor *wm) {
+    /* A monitor whose tree holds this root in full (no excludes apply beneath
+     * it and its crawl was not limited) has already crawled it; the caller
+     * holds the process lock */
+    WatchfulRegistry *registry = wm->registry;
+    size_t path_len = strlen(wm->path);
+    for (size_t i = 0; i < registry->attached.len; i++) {
+        WatchfulMonitor *other = registry->attached.monitors[i];
+        if (other->crawl.max_depth || other->crawl.one_filesystem || other->crawl.is_lazy) continue;
+        WatchfulWatch *source = watch_for_dir(other, wm->path, path_len);
+        if (NULL != source && watch_is_unscoped(source)) return source;
+    }
     return NULL;
 }
 
-static int start_loop(WatchfulMonitor *wm) {
-    int error = 0;
+static int registry_attach(WatchfulMonitor *wm) {
+    WatchfulRegistry *registry = wm->registry;
+    pthread_mutex_lock(&registry->process_lock);
+    int err = list_add(&registry->attached, wm);
+    if (!err) wm->timer_fd = registry->timer_fd;
+    pthread_mutex_unlock(&registry->process_lock);
+    return err;
+}
 
-    pthread_attr_t attr;
-    error = pthread_attr_init(&attr);
-    if (error) return 1;
+static void registry_detach(WatchfulMonitor *wm) {
+    WatchfulRegistry *registry = wm->registry;
+    pthread_mutex_lock(&registry->process_lock);
 
-    start_waiting = true;
-    pthread_mutex_init(&start_mutex, NULL);
-    pthread_cond_init(&start_cond, NULL);
+    /* As with a monitor of its own, a snapshot that is saved must include
+     * the events already queued (unless this is a callback) */
+    if (NULL != wm->snapshot_path && !registry->is_processing) {
+        registry->is_processing = true;
+        registry_read(registry);
+        registry->is_processing = false;
 
-    error = pthread_create(&wm->thread, &attr, loop_runner, wm);
-    if (error) return 1;
+        /* The other monitors meet their deadlines on the next pass */
+        watchful_loop_set(registry->timer_fd, 0);
+    }
+
+    list_remove(&registry->attached, wm);
+    pthread_mutex_unlock(&registry->process_lock);
+    return;
+}
+
+static int end_loop(WatchfulMonitor *wm) {
+    if (NULL != wm->registry) {
+        registry_detach(wm);
+    } else {
+        watchful_loop_detach(wm);
+    }
 
-    pthread_mutex_lock(&start_mutex);
-    while (start_waiting) pthread_cond_wait(&start_cond, &start_mutex);
-    pthread_mutex_unlock(&start_mutex);
+    /* A rescan still running is waited for but its changes are dropped */
+    rescan_finish(wm, true);
 
-    pthread_mutex_destroy(&start_mutex);
-    pthread_cond_destroy(&start_cond);
+    /* A registry's timer is only borrowed */
+    if (NULL == wm->registry) close(wm->timer_fd);
+    wm->timer_fd = -1;
+
+    if (NULL == wm->registry) {
+        /* A snapshot that is saved must include the events already queued
+         * (but the queue cannot be read again from inside a callback) */
+        if (NULL != wm->snapshot_path && !wm->is_processing) handle_event(wm);
+    }
+
+    /* Renames still waiting for their second half are taken to be deletions */
+    moves_expire(wm, true);
+
+    /* Events still held are delivered on the stopping thread */
+    watchful_debounce_release(wm, true);
+    watchful_batch_flush(wm);
 
-    pthread_attr_destroy(&attr);
     return 0;
 }
 
 static int remove_watch(WatchfulMonitor *wm, WatchfulWatch *watch) {
     if (watch->wd == -1) return 1;
-    inotify_rm_watch(wm->fd, watch->wd);
+
+    /* A shared watch is only let go by the watch that holds it */
+    bool is_held = watch_for_wd(wm, watch->wd) == watch;
+    if (is_held) watchful_table_remove(&wm->wds, (uint64_t)watch->wd);
+    if (is_held || NULL == wm->registry) kernel_unwatch(wm, watch->wd);
     watch->wd = -1;
     return 0;
 }
 
-static int remove_watches_from_root(WatchfulMonitor *wm, const char *root) {
-    for (size_t i = 0; i < wm->watches_len; i++) {
-        if (watchful_path_is_prefixed(wm->watches[i]->path, root)) {
-            remove_watch(wm, wm->watches[i]);
-        }
+static void free_watches(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    WatchfulWatch *child = watch->child;
+    while (NULL != child) {
+        WatchfulWatch *next = child->next;
+        free_watches(wm, child);
+        child = next;
+    }
+
+    remove_watch(wm, watch);
+    level_unlink(wm, watch);
+    wm->watches_len--;
+    __atomic_fetch_sub(&wm->stats.watches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&wm->stats.watches_memory, sizeof(WatchfulWatch) + strlen(watch->name) + 1, __ATOMIC_RELAXED);
+
+    free(watch->name);
+    free(watch);
+
+    return;
+}
+
+static int remove_watches_from_root(WatchfulMonitor *wm, WatchfulWatch *root) {
+    /* The subtree is detached first so the counts above change once */
+    if (root == wm->root) {
+        wm->root = NULL;
+    } else {
+        watch_detach(root);
     }
+    free_watches(wm, root);
+
     return 0;
 }
 
 static int remove_watches(WatchfulMonitor *wm) {
     /* if (NULL == wm) return 1; */
 
-    for (size_t i = 0; i < wm->watches_len; i++) {
-        remove_watch(wm, wm->watches[i]);
-        free(wm->watches[i]->path);
-        free(wm->watches[i]);
-    }
-
-    free(wm->watches);
+    if (NULL != wm->root) remove_watches_from_root(wm, wm->root);
+    watchful_table_deinit(&wm->wds);
+    pthread_mutex_destroy(&wm->watches_lock);
+    free(wm->levels);
+    wm->levels = NULL;
+    wm->levels_len = 0;
+    degraded_clear(wm);
 
     return 0;
 }
 
-static int add_watch(WatchfulMonitor *wm, char *path) {
+static int add_watch(WatchfulMonitor *wm, WatchfulWatch *parent, const char *name, const char *dir_path, int wd, WatchfulWatch **added) {
+    char *path = NULL;
+    bool is_reserved = false;
+    *added = NULL;
+
     WatchfulWatch *watch = malloc(sizeof(WatchfulWatch));
     if (NULL == watch) return 1;
 
+    watch->wd = -1;
+    watch->scope = NULL;
+    watch->depth = (NULL == parent) ? 0 : parent->depth + 1;
+    watch->watches = 1;
+    watch->is_lazy = wm->crawl.is_lazy && !watch_is_deepest(wm, watch->depth);
+    watch->parent = NULL;
+    watch->child = NULL;
+    watch->prev = NULL;
+    watch->next = NULL;
+    watch->newer = NULL;
+    watch->older = NULL;
+
+    size_t name_len = strlen(name);
+    watch->name = malloc(sizeof(char) * (name_len + 1));
+    if (NULL == watch->name) goto error;
+    memcpy(watch->name, name, name_len + 1);
+
+    /* The crawl already has the path so it only needs building for events */
+    if (NULL == dir_path && NULL != parent) {
+        path = watch_path_create(parent, name, true);
+        if (NULL == path) goto error;
+        dir_path = path;
+    } else if (NULL == dir_path) {
+        dir_path = name;
+    }
+
+    /* Work out once which excludes could apply to entries beneath this */
+    if (wm->excludes->len) {
+        const WatchfulScope *parent_scope = (NULL == parent) ? NULL : parent->scope;
+        watch->scope = watchful_matcher_scope(wm->excludes->matcher, parent_scope, dir_path);
+        if (NULL == watch->scope) goto error;
+    }
+
+    /* The tree is maintained from these events even if they are not reported */
     int inotify_events = IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE;
     if (!(wm->events & WATCHFUL_EVENT_MODIFIED)) {
         inotify_events = inotify_events ^ IN_ATTRIB;
         inotify_events = inotify_events ^ IN_MODIFY;
     }
-    if (!(wm->events & WATCHFUL_EVENT_CREATED))
-        inotify_events = inotify_events ^ IN_CREATE;
-    if (!(wm->events & WATCHFUL_EVENT_DELETED))
-        inotify_events = inotify_events ^ IN_DELETE;
-    if (!(wm->events & WATCHFUL_EVENT_RENAMED)) {
-        inotify_events = inotify_events ^ IN_MOVED_TO;
-        inotify_events = inotify_events ^ IN_MOVED_FROM;
+
+    /* Past the budget (or the kernel's limit) the directory is degraded; the
+     * slot is taken before the kernel is asked so that crawl workers racing
+     * for the last one cannot all have it */
+    pthread_mutex_lock(&wm->watches_lock);
+    bool is_spent = wm->watches_max && wm->watches_len >= wm->watches_max;
+    if (!is_spent) wm->watches_len++;
+    is_reserved = !is_spent;
+    pthread_mutex_unlock(&wm->watches_lock);
+
+    if (!is_spent) watch->wd = kernel_watch(wm, dir_path, inotify_events, wd);
+    if (is_spent || (watch->wd == -1 && errno == ENOSPC)) {
+        if (is_reserved) budget_return(wm);
+        int err = degraded_add(wm, dir_path, watch->depth);
+        free(path);
+        free(watch->name);
+        free(watch);
+        return err;
     }
 
-    watch->wd = inotify_add_watch(wm->fd, path, inotify_events);
+    /* A directory can be gone (e.g. renamed) before its creation is handled */
+    bool is_gone = NULL != parent && watch->wd == -1 && (errno == ENOENT || errno == ENOTDIR);
+    if (is_gone) {
+        budget_return(wm);
+        free(path);
+        free(watch->name);
+        free(watch);
+        return 0;
+    }
     if (watch->wd == -1) goto error;
-    watch->path = path;
 
-    size_t len = wm->watches_len + 1;
-    WatchfulWatch **new_watches = realloc(wm->watches, sizeof(WatchfulWatch *) * len);
-    if (NULL == new_watches) goto error;
-    wm->watches = new_watches;
-    wm->watches[wm->watches_len] = watch;
-    wm->watches_len = len;
+    free(path);
+    path = NULL;
+
+    /* Crawl workers add watches concurrently */
+    pthread_mutex_lock(&wm->watches_lock);
+
+    /* The same directory can be found twice (e.g. crawl racing a creation) */
+    if (NULL != watch_for_wd(wm, watch->wd)) {
+        wm->watches_len--;
+        pthread_mutex_unlock(&wm->watches_lock);
+        free(watch->name);
+        free(watch);
+        return 0;
+    }
+
+    int err = levels_reserve(wm, watch->depth);
+    if (!err) err = watchful_table_put(&wm->wds, (uint64_t)watch->wd, watch);
+    if (err) {
+        pthread_mutex_unlock(&wm->watches_lock);
+        kernel_unwatch(wm, watch->wd);
+        goto error;
+    }
+
+    level_link(wm, watch);
+    if (NULL != parent) watch_attach(parent, watch);
+    __atomic_fetch_add(&wm->stats.watches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&wm->stats.watches_memory, sizeof(WatchfulWatch) + name_len + 1, __ATOMIC_RELAXED);
+    *added = watch;
+
+    pthread_mutex_unlock(&wm->watches_lock);
 
     return 0;
 
 error:
+    if (is_reserved) budget_return(wm);
+    free(path);
+    free(watch->name);
     free(watch);
     return 1;
 }
 
-static int add_watches_to_root(WatchfulMonitor *wm, const char *root) {
-    int err = 0;
-    char *path = NULL;
-    char **paths = NULL;
-    DIR *dir = NULL;
+static int add_watches_visit(void *info, const WatchfulCrawlEntry *entry, void **ctx) {
+    WatchfulMonitor *wm = info;
+    WatchfulWatch *parent = entry->parent;
 
-    /* This assumes that the path is a directory */
-    path = watchful_path_create(root, NULL, true);
-    if (NULL == path) goto error;
+    if (watch_excludes(wm, parent, entry->path)) return 0;
 
-    err = add_watch(wm, path);
-    if (err) goto error;
+    WatchfulWatch *watch = NULL;
+    int err = add_watch(wm, parent, entry->name, entry->path, -1, &watch);
+    if (err) return 1;
 
-    size_t paths_len = 1;
-    size_t paths_max = 1;
-    paths = malloc(sizeof(char *) * paths_max);
-    if (NULL == paths) goto error;
+    /* Directories already watched are not crawled again */
+    *ctx = watch;
 
-    paths[0] = path;
-    path = NULL;
+    return 0;
+}
+
+static int add_watches_to_root(WatchfulMonitor *wm, WatchfulWatch *parent, const char *name) {
+    char *path = NULL;
+
+    /* Directories below the deepest level are not watched */
+    if (NULL != parent && watch_is_deepest(wm, parent->depth)) return 0;
+
+    /* This assumes that the path is a directory */
+    WatchfulWatch *root = NULL;
+    int err = add_watch(wm, parent, name, NULL, -1, &root);
+    if (err) return 1;
+    if (NULL == root) return budget_settle(wm);
+    if (NULL == parent) wm->root = root;
+
+    /* A lazy directory is crawled once it sees activity */
+    if (root->is_lazy || watch_is_deepest(wm, root->depth)) return budget_settle(wm);
+
+    path = watch_path_create(root, NULL, true);
+    if (NULL == path) return 1;
+
+    /* Only the initial crawl uses the pool; directories created while
+     * watching are usually small and crawled on the event thread */
+    WatchfulCrawl crawl = {
+        .threads = 1,
+        .max_depth = wm->crawl.max_depth ? wm->crawl.max_depth - root->depth : 0,
+        .one_filesystem = wm->crawl.one_filesystem,
+        .dev = wm->crawl.dev,
+    };
+    WatchfulCrawl *stats = &crawl;
+    if (NULL == parent) stats = &wm->crawl;
+
+    err = watchful_crawl_run(stats, path, root, add_watches_visit, wm);
+    free(path);
+    if (err) return 1;
 
-    for (size_t i = 0; i < paths_len; i++) {
-        dir = opendir(paths[i]);
-        if (NULL == dir) continue;
+    return budget_settle(wm);
+}
 
-        struct dirent *entry;
-        while ((entry = readdir(dir))) {
-            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+static int watch_expand(WatchfulMonitor *wm, WatchfulWatch *watch) {
+    /* Only the subdirectories themselves are added and they are lazy too */
+    watch->is_lazy = false;
 
-            path = watchful_path_create(entry->d_name, paths[i], false);
-            if (NULL == path) goto error;
+    char *path = watch_path_create(watch, NULL, true);
+    if (NULL == path) return 1;
 
-            bool is_dir = watchful_path_is_dir(path);
+    WatchfulCrawl crawl = {
+        .threads = 1,
+        .max_depth = 1,
+        .one_filesystem = wm->crawl.one_filesystem,
+        .dev = wm->crawl.dev,
+    };
+    int err = watchful_crawl_run(&crawl, path, watch, add_watches_visit, wm);
+    free(path);
+    if (err) return 1;
 
-            if (!is_dir) {
-                free(path);
-                path = NULL;
-                continue;
-            }
+    return budget_settle(wm);
+}
 
-            path = watchful_path_add_sep(path);
-            if (NULL == path) goto error;
+static int copy_watches(WatchfulMonitor *wm, WatchfulWatch *watch, const WatchfulWatch *source) {
+    /* The source's watches are shared as they are, less this monitor's own
+     * excludes and limits, so nothing needs to be read from the disk */
+    if (watch->is_lazy || watch_is_deepest(wm, watch->depth)) return 0;
 
-            if (watchful_monitor_excludes_path(wm, path)) {
-                free(path);
-                path = NULL;
-            } else {
-                err = add_watch(wm, path);
-                if (err) goto error;
-
-                if (paths_len == paths_max) {
-                    char **new_paths = realloc(paths, sizeof(char *) * (paths_max * 2));
-                    if (NULL == new_paths) goto error;
-                    paths_max = paths_max * 2;
-                    paths = new_paths;
-                    new_paths = NULL;
-                }
+    for (const WatchfulWatch *child = source->child; NULL != child; child = child->next) {
+        char *path = watch_path_create(watch, child->name, true);
+        if (NULL == path) return 1;
 
-                paths[paths_len] = path;
-                path = NULL;
-                paths_len++;
-            }
-        }
+        WatchfulWatch *added = NULL;
+        int err = 0;
+        if (!watch_excludes(wm, watch, path) && watch_is_reached(wm, path)) err = add_watch(wm, watch, child->name, path, child->wd, &added);
+        free(path);
+        if (err) return 1;
 
-        closedir(dir);
-        dir = NULL;
-        paths[i] = NULL;
+        if (NULL != added && copy_watches(wm, added, child)) return 1;
     }
 
-    free(paths);
-
     return 0;
+}
 
-error:
-    closedir(dir);
-
-    free(path);
+static int add_watches_shared(WatchfulMonitor *wm, bool *is_copied) {
+    /* The process lock keeps the source from changing while it is copied */
+    WatchfulRegistry *registry = wm->registry;
+    pthread_mutex_lock(&registry->process_lock);
 
-    if (NULL != paths) {
-        for (size_t i = 0; i < paths_len; i++) {
-            if (NULL != paths[i]) free(paths[i]);
-        }
-        free(paths);
+    int err = 0;
+    const WatchfulWatch *source = registry_source(wm);
+    *is_copied = NULL != source;
+    if (*is_copied) {
+        WatchfulWatch *root = NULL;
+        err = add_watch(wm, NULL, wm->path, NULL, source->wd, &root);
+        wm->root = root;
+        if (!err && NULL != root) err = copy_watches(wm, root, source);
+        if (!err) err = budget_settle(wm);
     }
 
-    return 1;
+    pthread_mutex_unlock(&registry->process_lock);
+    return err;
 }
 
 static int add_watches(WatchfulMonitor *wm) {
     int err = 0;
 
     wm->watches_len = 0;
-    wm->watches = NULL;
+    wm->root = NULL;
+    wm->levels = NULL;
+    wm->levels_len = 0;
+    wm->is_rebalancing = false;
+    wm->watches_max = budget_limit(wm);
+    wm->degraded_next = now_seconds() + wm->interval;
+    __atomic_store_n(&wm->stats.watches, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&wm->stats.watches_dead, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&wm->stats.watches_memory, 0, __ATOMIC_RELAXED);
+    pthread_mutex_init(&wm->watches_lock, NULL);
+
+    err = watchful_table_init(&wm->wds, 0);
+    if (err) goto error;
 
-    err = add_watches_to_root(wm, wm->path);
+    /* The root's filesystem is the one the crawl keeps to */
+    if (wm->crawl.one_filesystem) {
+        struct stat st;
+        err = stat(wm->path, &st);
+        if (err) goto error;
+        wm->crawl.dev = st.st_dev;
+    }
+
+    /* A monitor in a registry crawls only what no other monitor has */
+    bool is_copied = false;
+    if (NULL != wm->registry) err = add_watches_shared(wm, &is_copied);
+    if (err) goto error;
+
+    if (!is_copied) err = add_watches_to_root(wm, NULL, wm->path);
     if (err) goto error;
 
     return 0;
@@ -373,23 +1584,123 @@ static int add_watches(WatchfulMonitor *wm) {
 error:
     remove_watches(wm);
 
-    close(wm->fd);
+    if (wm->fd != -1) close(wm->fd);
     wm->fd = -1;
 
     return 1;
 }
 
+static int restored(WatchfulMonitor *wm, WatchfulEvent *changes, size_t changes_len) {
+    /* What changed while the monitor was stopped is delivered before it
+     * starts; the watches were set up from the tree as it is now */
+    int err = 0;
+    for (size_t i = 0; i < changes_len; i++) {
+        if (!err && (wm->events & changes[i].type) && watchful_monitor_includes_path(wm, changes[i].path)) {
+            char *path = watchful_arena_strdup(&wm->batch.arena, changes[i].path);
+            err = (NULL == path) ? 1 : watchful_batch_add(wm, changes[i].type, path, NULL);
+        }
+        free(changes[i].path);
+    }
+    free(changes);
+    if (!err) err = watchful_batch_flush(wm);
+
+    return err;
+}
+
+static int take_snapshot(WatchfulMonitor *wm) {
+    wm->rescanning.is_running = false;
+    wm->rescanning.changes = NULL;
+    wm->rescanning.changes_len = 0;
+    wm->snapshot = NULL;
+    wm->is_processing = false;
+    if (!wm->rescan && NULL == wm->snapshot_path) return 0;
+
+    wm->snapshot = watchful_snapshot_create();
+    if (NULL == wm->snapshot) return 1;
+
+    int err = 0;
+    if (NULL != wm->snapshot_path) {
+        WatchfulEvent *changes = NULL;
+        size_t changes_len = 0;
+        err = watchful_snapshot_restore(wm->snapshot, wm, wm->snapshot_path, &changes, &changes_len);
+        if (!err) return restored(wm, changes, changes_len);
+
+        /* Without a usable file the tree is scanned from scratch */
+        watchful_snapshot_destroy(wm->snapshot);
+        wm->snapshot = watchful_snapshot_create();
+        if (NULL == wm->snapshot) return 1;
+    }
+
+    err = watchful_snapshot_scan(wm->snapshot, wm);
+    if (err) {
+        watchful_snapshot_destroy(wm->snapshot);
+        wm->snapshot = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
 static int setup(WatchfulMonitor *wm) {
     int error = 0;
 
-    wm->fd = inotify_init();
-    if (wm->fd == -1) return 1;
+    /* A monitor in a registry reads events through the registry instead */
+    wm->fd = -1;
+    wm->buf = NULL;
+    if (NULL != wm->registry && wm->is_external) return 1;
+
+    if (NULL == wm->registry) {
+        wm->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (wm->fd == -1) return 1;
+
+        wm->buf = malloc(sizeof(char) * wm->read_len);
+        if (NULL == wm->buf) {
+            close(wm->fd);
+            wm->fd = -1;
+            return 1;
+        }
+    }
 
     error = add_watches(wm);
-    if (error) return 1;
+    if (error) {
+        free(wm->buf);
+        wm->buf = NULL;
+        return 1;
+    }
 
-    error = start_loop(wm);
-    if (error) return 1;
+    error = watchful_table_init(&wm->moves, 0);
+    if (error) {
+        remove_watches(wm);
+        free(wm->buf);
+        wm->buf = NULL;
+        close(wm->fd);
+        wm->fd = -1;
+        return 1;
+    }
+
+    error = take_snapshot(wm);
+    if (error) {
+        watchful_table_deinit(&wm->moves);
+        remove_watches(wm);
+        free(wm->buf);
+        wm->buf = NULL;
+        close(wm->fd);
+        wm->fd = -1;
+        return 1;
+    }
+
+    error = (NULL != wm->registry) ? registry_attach(wm) : watchful_loop_attach(wm, process);
+    if (error) {
+        watchful_snapshot_destroy(wm->snapshot);
+        wm->snapshot = NULL;
+        watchful_table_deinit(&wm->moves);
+        remove_watches(wm);
+        free(wm->buf);
+        wm->buf = NULL;
+        close(wm->fd);
+        wm->fd = -1;
+        return 1;
+    }
 
     return 0;
 }
@@ -397,28 +1708,116 @@ static int setup(WatchfulMonitor *wm) {
 static int teardown(WatchfulMonitor *wm) {
     int error = 0;
 
-    if (!pthread_equal(wm->thread, pthread_self())) {
-        error = pthread_kill(wm->thread, SIGUSR1);
-        if (error) return 1;
-        error = pthread_join(wm->thread, NULL);
-        if (error) return 1;
-        wm->thread = pthread_self();
+    /* Anything changed from here on is treated as possibly missed */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t stamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    error = end_loop(wm);
+    if (error) return 1;
+
+    if (NULL != wm->snapshot_path && NULL != wm->snapshot) {
+        watchful_snapshot_save(wm->snapshot, wm->path, wm->snapshot_path, stamp);
     }
+    watchful_snapshot_destroy(wm->snapshot);
+    wm->snapshot = NULL;
+
+    watchful_table_deinit(&wm->moves);
 
     error = remove_watches(wm);
     if (error) return 1;
 
-    error = close(wm->fd);
-    if (error) return 1;
-    wm->fd = -1;
+    free(wm->buf);
+    wm->buf = NULL;
+
+    if (wm->fd != -1) {
+        error = close(wm->fd);
+        if (error) return 1;
+        wm->fd = -1;
+    }
 
     return 0;
 }
 
+WatchfulRegistry *watchful_registry_create(WatchfulLoop *loop) {
+    WatchfulRegistry *registry = calloc(1, sizeof(WatchfulRegistry));
+    if (NULL == registry) return NULL;
+
+    registry->fd = -1;
+    registry->timer_fd = -1;
+    registry->read_len = WATCHFUL_READ_LEN;
+    pthread_mutex_init(&registry->lock, NULL);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&registry->process_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    int err = watchful_table_init(&registry->shares, 0);
+    if (err) goto error;
+
+    registry->buf = malloc(sizeof(char) * registry->read_len);
+    if (NULL == registry->buf) goto error;
+
+    registry->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (registry->fd == -1) goto error;
+
+    registry->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (registry->timer_fd == -1) goto error;
+
+    registry->owns_loop = NULL == loop;
+    registry->loop = registry->owns_loop ? watchful_loop_create(1) : loop;
+    if (NULL == registry->loop) goto error;
+
+    registry->handler.process = registry_process;
+    registry->handler.info = registry;
+    registry->handler.fds[0] = registry->fd;
+    registry->handler.fds[1] = registry->timer_fd;
+    registry->handler.fds_len = 2;
+    err = watchful_loop_add(registry->loop, &registry->handler);
+    if (err) goto error;
+    registry->is_added = true;
+
+    return registry;
+
+error:
+    watchful_registry_destroy(registry);
+    return NULL;
+}
+
+void watchful_registry_destroy(WatchfulRegistry *registry) {
+    /* Its monitors are stopped before a registry is destroyed */
+    if (NULL == registry) return;
+
+    if (registry->is_added) watchful_loop_remove(registry->loop, &registry->handler);
+    if (registry->owns_loop) watchful_loop_destroy(registry->loop);
+
+    for (size_t i = 0; i < registry->shares.cap; i++) {
+        WatchfulMonitorList *share = registry->shares.entries[i].value;
+        if (NULL == share) continue;
+        free(share->monitors);
+        free(share);
+    }
+    watchful_table_deinit(&registry->shares);
+    free(registry->attached.monitors);
+    free(registry->scratch.monitors);
+
+    if (registry->timer_fd != -1) close(registry->timer_fd);
+    if (registry->fd != -1) close(registry->fd);
+    free(registry->buf);
+    pthread_mutex_destroy(&registry->lock);
+    pthread_mutex_destroy(&registry->process_lock);
+    free(registry);
+
+    return;
+}
+
 WatchfulBackend watchful_inotify = {
     .name = "inotify",
     .setup = setup,
     .teardown = teardown,
+    .process = process_external,
 };
 
 #endif
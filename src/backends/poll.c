@@ -0,0 +1,158 @@
+#include "../watchful.h"
+
+#ifndef LINUX
+
+WatchfulBackend watchful_poll = {
+    .name = "poll",
+    .setup = NULL,
+    .teardown = NULL,
+    .process = NULL,
+};
+
+#else
+
+/* Filesystems that deliver no notifications (network and FUSE mounts among
+ * them) are watched by comparing the tree with a snapshot at an interval.
+ * The snapshot is refreshed in parallel and directories whose times have not
+ * changed are not read again, so each poll costs about one stat per entry.
+ * The interval is kept by a timer that stands in for the fd the other
+ * backends read events from. Renames are seen as a deletion and a creation. */
+
+/* Poll Functions */
+
+static int deliver(WatchfulMonitor *wm, WatchfulEvent *changes, size_t changes_len) {
+    int err = 0;
+    for (size_t i = 0; i < changes_len; i++) {
+        if (!err && (wm->events & changes[i].type) && watchful_monitor_includes_path(wm, changes[i].path)) {
+            char *path = watchful_arena_strdup(&wm->batch.arena, changes[i].path);
+            if (NULL == path) err = 1;
+            else if (wm->delay > 0) err = watchful_debounce_add(wm, changes[i].type, path, NULL);
+            else err = watchful_batch_add(wm, changes[i].type, path, NULL);
+        }
+        free(changes[i].path);
+    }
+    free(changes);
+
+    return err;
+}
+
+static int poll_tree(WatchfulMonitor *wm) {
+    uint64_t expirations = 0;
+    ssize_t size = read(wm->fd, &expirations, sizeof(expirations));
+    if (size != sizeof(expirations) || 0 == expirations) return 0;
+
+    WatchfulEvent *changes = NULL;
+    size_t changes_len = 0;
+    int err = watchful_snapshot_refresh(wm->index, wm, &changes, &changes_len);
+    if (err) return 1;
+
+    return deliver(wm, changes, changes_len);
+}
+
+static int process(void *info) {
+    WatchfulMonitor *wm = info;
+    int err = 0;
+
+    uint64_t expirations;
+    ssize_t size = read(wm->timer_fd, &expirations, sizeof(expirations));
+    (void)size;
+
+    err = poll_tree(wm);
+    if (!err) err = watchful_debounce_release(wm, false);
+    if (!err && watchful_batch_is_due(wm)) err = watchful_batch_flush(wm);
+    if (!err) err = watchful_loop_arm(wm, -1);
+
+    return err;
+}
+
+static int process_external(WatchfulMonitor *wm) {
+    return process(wm);
+}
+
+/* Backend Functions */
+
+static int take_index(WatchfulMonitor *wm) {
+    /* A saved snapshot tells what changed while the monitor was stopped */
+    wm->index = watchful_snapshot_create();
+    if (NULL == wm->index) return 1;
+
+    if (NULL != wm->snapshot_path) {
+        WatchfulEvent *changes = NULL;
+        size_t changes_len = 0;
+        int err = watchful_snapshot_restore(wm->index, wm, wm->snapshot_path, &changes, &changes_len);
+        if (!err) {
+            err = deliver(wm, changes, changes_len);
+            if (!err) err = watchful_debounce_release(wm, true);
+            if (!err) err = watchful_batch_flush(wm);
+            return err;
+        }
+
+        watchful_snapshot_destroy(wm->index);
+        wm->index = watchful_snapshot_create();
+        if (NULL == wm->index) return 1;
+    }
+
+    return watchful_snapshot_scan(wm->index, wm);
+}
+
+static int setup(WatchfulMonitor *wm) {
+    int error = 0;
+
+    wm->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wm->fd == -1) return 1;
+
+    error = take_index(wm);
+    if (error) goto error;
+
+    struct itimerspec interval = {0};
+    interval.it_interval.tv_sec = (time_t)wm->interval;
+    interval.it_interval.tv_nsec = (long)((wm->interval - (double)interval.it_interval.tv_sec) * 1e9);
+    interval.it_value = interval.it_interval;
+    error = timerfd_settime(wm->fd, 0, &interval, NULL);
+    if (error) goto error;
+
+    error = watchful_loop_attach(wm, process);
+    if (error) goto error;
+
+    return 0;
+
+error:
+    watchful_snapshot_destroy(wm->index);
+    wm->index = NULL;
+    close(wm->fd);
+    wm->fd = -1;
+    return 1;
+}
+
+static int teardown(WatchfulMonitor *wm) {
+    watchful_loop_detach(wm);
+
+    close(wm->timer_fd);
+    wm->timer_fd = -1;
+
+    /* Events still held are delivered on the stopping thread */
+    watchful_debounce_release(wm, true);
+    watchful_batch_flush(wm);
+
+    /* Changes since the last poll began are found on the next restore */
+    if (NULL != wm->snapshot_path) {
+        watchful_snapshot_save(wm->index, wm->path, wm->snapshot_path, wm->index->stamp);
+    }
+    watchful_snapshot_destroy(wm->index);
+    wm->index = NULL;
+
+    int error = close(wm->fd);
+    if (error) return 1;
+    wm->fd = -1;
+
+    return 0;
+}
+
+WatchfulBackend watchful_poll = {
+    .name = "poll",
+    .setup = setup,
+    .teardown = teardown,
+    .process = process_external,
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "watchful.h"
+
+/* Events are collected in a batch owned by the monitor and handed over
+ * together: at the end of each read, when the batch is full or when the
+ * oldest event has waited for the latency. Monitors without a batch callback
+ * have each event passed to the single event callback instead, and monitors
+ * with a queue have the events pushed onto it. The paths of events are
+ * allocated from the batch's arena, which is reset on flushing. */
+
+/* Helper Functions */
+
+static double elapsed(WatchfulTime *start, WatchfulTime *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int deliver(WatchfulMonitor *wm) {
+    WatchfulBatch *batch = &wm->batch;
+    int err = 0;
+
+    __atomic_fetch_add(&wm->stats.events_delivered, batch->len, __ATOMIC_RELAXED);
+
+    if (NULL != wm->queue) {
+        for (size_t i = 0; i < batch->len && !err; i++) err = watchful_queue_push(wm->queue, &batch->events[i]);
+    } else if (NULL != batch->callback) {
+        batch->callback(batch->events, batch->len, wm->callback_info);
+    } else if (NULL != wm->callback) {
+        for (size_t i = 0; i < batch->len; i++) wm->callback(&batch->events[i], wm->callback_info);
+    }
+
+    /* Subscribers are given their share whichever way the monitor delivers */
+    for (size_t i = 0; i < batch->len && wm->subscriptions.len; i++) {
+        watchful_subscriptions_dispatch(&wm->subscriptions, &batch->events[i]);
+    }
+
+    return err;
+}
+
+/* Batch Functions */
+
+void watchful_batch_init(WatchfulBatch *batch) {
+    batch->callback = NULL;
+    batch->max = WATCHFUL_BATCH_MAX;
+    batch->latency = 0;
+    batch->events = NULL;
+    batch->len = 0;
+    batch->cap = 0;
+    batch->first.tv_sec = 0;
+    batch->first.tv_nsec = 0;
+    watchful_arena_init(&batch->arena, 0);
+    batch->coalesce = false;
+    batch->latest.len = 0;
+    batch->latest.cap = 0;
+    batch->latest.entries = NULL;
+    batch->allocations = 0;
+    return;
+}
+
+void watchful_batch_deinit(WatchfulBatch *batch) {
+    free(batch->events);
+    batch->events = NULL;
+    batch->len = 0;
+    batch->cap = 0;
+    watchful_arena_deinit(&batch->arena);
+    watchful_table_deinit(&batch->latest);
+    return;
+}
+
+int watchful_batch_add(WatchfulMonitor *wm, int type, char *path, char *old_path) {
+    /* The paths must have been allocated from the batch's arena */
+    WatchfulBatch *batch = &wm->batch;
+
+    if (batch->len == batch->cap) {
+        size_t cap = (0 == batch->cap) ? 16 : batch->cap * 2;
+        WatchfulEvent *events = realloc(batch->events, sizeof(WatchfulEvent) * cap);
+        if (NULL == events) return 1;
+        batch->events = events;
+        batch->cap = cap;
+        batch->allocations++;
+    }
+
+    if (0 == batch->len) clock_gettime(CLOCK_MONOTONIC, &batch->first);
+
+    WatchfulEvent *event = &batch->events[batch->len++];
+    event->type = type;
+    event->at = time(NULL);
+    event->path = path;
+    event->old_path = old_path;
+
+    if (batch->max && batch->len >= batch->max) return watchful_batch_flush(wm);
+
+    return 0;
+}
+
+int watchful_batch_flush(WatchfulMonitor *wm) {
+    WatchfulBatch *batch = &wm->batch;
+    if (0 == batch->len) {
+        watchful_arena_reset(&batch->arena);
+        return 0;
+    }
+
+    /* Events are reduced to their net effect on each path if asked */
+    int err = 0;
+    if (batch->coalesce) {
+        size_t cap = batch->latest.cap;
+        err = watchful_coalesce(&batch->latest, batch->events, &batch->len);
+        if (batch->latest.cap != cap) batch->allocations++;
+    }
+
+    /* The snapshot follows what has been delivered */
+    if (!err && batch->len && NULL != wm->snapshot) watchful_snapshot_apply(wm->snapshot, batch->events, batch->len);
+
+    if (!err && batch->len) err = deliver(wm);
+
+    batch->len = 0;
+    watchful_arena_reset(&batch->arena);
+
+    return err;
+}
+
+bool watchful_batch_is_due(WatchfulMonitor *wm) {
+    /* An empty batch is always due so that its arena can be reset */
+    return watchful_batch_wait(wm) <= 0;
+}
+
+double watchful_batch_wait(WatchfulMonitor *wm) {
+    /* Returns the seconds until the batch must be flushed (-1 if empty) */
+    WatchfulBatch *batch = &wm->batch;
+    if (0 == batch->len) return -1;
+    if (batch->latency <= 0) return 0;
+
+    WatchfulTime now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double remaining = batch->latency - elapsed(&batch->first, &now);
+
+    return (remaining > 0) ? remaining : 0;
+}
+
+size_t watchful_batch_allocations(WatchfulMonitor *wm) {
+    /* Heap allocations made for events since the monitor was initialised:
+     * the batch, its arena and coalescing table, and debounce entries only
+     * grow, so once they fit the busiest read this stays the same. Not
+     * counted are the first half of a rename, which is held on the heap
+     * (with its old path) until its pair arrives, and the watch made for
+     * each new directory. */
+    return wm->batch.allocations + wm->batch.arena.allocations + wm->debounce.allocations;
+}
@@ -0,0 +1,123 @@
+#include "watchful.h"
+
+/* Coalescing reduces the events in a batch to their net effect on each path.
+ * The table maps the hash of a path to the latest event still kept for it.
+ * Events that cancel out or are absorbed by an earlier one are dropped. */
+
+/* Helper Functions */
+
+static WatchfulEvent *latest_for(WatchfulTable *latest, const char *path) {
+    /* Paths whose hashes collide are simply not coalesced */
+    WatchfulEvent *event = watchful_table_get(latest, watchful_path_hash(path));
+    if (NULL == event || strcmp(event->path, path)) return NULL;
+    return event;
+}
+
+static void forget(WatchfulTable *latest, const char *path) {
+    if (NULL != latest_for(latest, path)) watchful_table_remove(latest, watchful_path_hash(path));
+    return;
+}
+
+static int remember(WatchfulTable *latest, WatchfulEvent *event) {
+    return watchful_table_put(latest, watchful_path_hash(event->path), event);
+}
+
+static int coalesce_event(WatchfulTable *latest, WatchfulEvent *event) {
+    WatchfulEvent *prev = NULL;
+
+    switch (event->type) {
+        case WATCHFUL_EVENT_CREATED:
+            /* Deleted then created is a replacement */
+            prev = latest_for(latest, event->path);
+            if (NULL != prev && prev->type == WATCHFUL_EVENT_DELETED) {
+                prev->type = 0;
+                event->type = WATCHFUL_EVENT_MODIFIED;
+            }
+            break;
+
+        case WATCHFUL_EVENT_MODIFIED:
+            /* Modifications add nothing to an event that is already kept */
+            prev = latest_for(latest, event->path);
+            if (NULL != prev && prev->type != WATCHFUL_EVENT_DELETED) {
+                prev->at = event->at;
+                event->type = 0;
+                return 0;
+            }
+            break;
+
+        case WATCHFUL_EVENT_DELETED:
+            prev = latest_for(latest, event->path);
+            if (NULL == prev) break;
+            if (prev->type == WATCHFUL_EVENT_CREATED) {
+                /* Created then deleted leaves nothing */
+                prev->type = 0;
+                event->type = 0;
+                forget(latest, event->path);
+                return 0;
+            } else if (prev->type == WATCHFUL_EVENT_MODIFIED) {
+                prev->type = 0;
+            } else if (prev->type == WATCHFUL_EVENT_RENAMED) {
+                /* Renamed then deleted is the old path being deleted */
+                prev->type = 0;
+                forget(latest, event->path);
+                event->path = prev->old_path;
+            }
+            break;
+
+        case WATCHFUL_EVENT_RENAMED:
+            /* Whatever was made at the new path was replaced by the rename */
+            prev = latest_for(latest, event->path);
+            if (NULL != prev && (prev->type == WATCHFUL_EVENT_CREATED || prev->type == WATCHFUL_EVENT_MODIFIED)) {
+                prev->type = 0;
+            }
+
+            prev = latest_for(latest, event->old_path);
+            if (NULL == prev) break;
+            forget(latest, event->old_path);
+            if (prev->type == WATCHFUL_EVENT_CREATED) {
+                /* Created then renamed is created under the new name */
+                prev->type = 0;
+                event->type = WATCHFUL_EVENT_CREATED;
+                event->old_path = NULL;
+            } else if (prev->type == WATCHFUL_EVENT_RENAMED) {
+                /* Renamed twice is one rename, or none if it was renamed back */
+                prev->type = 0;
+                if (!strcmp(prev->old_path, event->path)) {
+                    event->type = 0;
+                    return 0;
+                }
+                event->old_path = prev->old_path;
+            }
+            break;
+
+        default:
+            return 0;
+    }
+
+    return remember(latest, event);
+}
+
+/* Coalesce Functions */
+
+int watchful_coalesce(WatchfulTable *latest, WatchfulEvent *events, size_t *len) {
+    /* The table is sized up front so that remembering events cannot fail */
+    if (latest->cap < *len * 2) {
+        watchful_table_deinit(latest);
+        int err = watchful_table_init(latest, *len);
+        if (err) return 1;
+    } else {
+        watchful_table_clear(latest);
+    }
+
+    for (size_t i = 0; i < *len; i++) coalesce_event(latest, &events[i]);
+
+    /* Events that were dropped are left with no type */
+    size_t kept = 0;
+    for (size_t i = 0; i < *len; i++) {
+        if (0 == events[i].type) continue;
+        events[kept++] = events[i];
+    }
+    *len = kept;
+
+    return 0;
+}
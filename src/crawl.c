@@ -0,0 +1,408 @@
+#include "watchful.h"
+
+/* The crawl walks a tree of directories with a pool of workers. Each worker
+ * owns a deque of directories to read: it takes work from the back of its own
+ * deque and, when that is empty, steals from the front of another's. Entry
+ * types come from readdir() (stat is only needed if the file system does not
+ * report them) and subdirectories are opened relative to their parent. Only
+ * directories are visited unless the crawl asks for files as well. A crawl
+ * can stop at a depth below the root (zero for none) and, like find -xdev,
+ * skip directories on a device other than the one it was given. */
+
+#define CRAWL_MAX_THREADS 8
+
+typedef struct CrawlDir {
+    DIR *dir;
+    int refs;
+} CrawlDir;
+
+typedef struct CrawlItem {
+    CrawlDir *parent;
+    char *path;
+    size_t name_offset;
+    size_t depth;
+    void *ctx;
+} CrawlItem;
+
+typedef struct CrawlDeque {
+    pthread_mutex_t lock;
+    CrawlItem *items;
+    size_t head;
+    size_t tail;
+    size_t max;
+} CrawlDeque;
+
+typedef struct CrawlPool {
+    WatchfulCrawl *crawl;
+    WatchfulCrawlVisit visit;
+    void *info;
+    size_t threads;
+    CrawlDeque *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;
+    size_t pushes;
+    size_t sleeping;
+    bool failed;
+    size_t dirs;
+    size_t entries;
+} CrawlPool;
+
+typedef struct CrawlWorker {
+    CrawlPool *pool;
+    size_t id;
+} CrawlWorker;
+
+/* Helper Functions */
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void dir_release(CrawlDir *dir) {
+    if (NULL == dir) return;
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    closedir(dir->dir);
+    free(dir);
+    return;
+}
+
+static int deque_push(CrawlDeque *deque, CrawlItem *item) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->max) {
+        /* Reclaim the space left at the front by thieves before growing */
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, sizeof(CrawlItem) * (deque->tail - deque->head));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->max) {
+            size_t max = (0 == deque->max) ? 64 : deque->max * 2;
+            CrawlItem *items = realloc(deque->items, sizeof(CrawlItem) * max);
+            if (NULL == items) {
+                pthread_mutex_unlock(&deque->lock);
+                return 1;
+            }
+            deque->items = items;
+            deque->max = max;
+        }
+    }
+    deque->items[deque->tail++] = *item;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static bool deque_pop(CrawlDeque *deque, CrawlItem *item) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_steal(CrawlDeque *deque, CrawlItem *item) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void pool_fail(CrawlPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->failed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+static bool pool_take(CrawlPool *pool, size_t id, CrawlItem *item) {
+    while (1) {
+        /* A push made after this count is read cannot be slept through */
+        size_t pushes = __atomic_load_n(&pool->pushes, __ATOMIC_ACQUIRE);
+        if (deque_pop(&pool->deques[id], item)) return true;
+        for (size_t i = 1; i < pool->threads; i++) {
+            if (deque_steal(&pool->deques[(id + i) % pool->threads], item)) return true;
+        }
+
+        /* Nothing to take: either the crawl is over or others are busy */
+        pthread_mutex_lock(&pool->lock);
+        while (pushes == pool->pushes && 0 != pool->pending && !pool->failed) {
+            pool->sleeping++;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            pool->sleeping--;
+        }
+        bool is_over = 0 == pool->pending || pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+        if (is_over) return false;
+    }
+}
+
+static void pool_adding(CrawlPool *pool) {
+    /* Counted before it is pushed so that a thief finishing it first cannot
+     * make the crawl look over */
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+static void pool_added(CrawlPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->pushes, 1, __ATOMIC_RELEASE);
+    if (pool->sleeping) pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+static void pool_done(CrawlPool *pool, size_t dirs, size_t entries) {
+    pthread_mutex_lock(&pool->lock);
+    pool->pending--;
+    pool->dirs += dirs;
+    pool->entries += entries;
+    if (0 == pool->pending) pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+static bool entry_is_dir(int dir_fd, struct dirent *entry) {
+    /* Symbolic links are followed, as they always have been */
+    if (entry->d_type == DT_DIR) return true;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) return false;
+    struct stat st;
+    int err = fstatat(dir_fd, entry->d_name, &st, 0);
+    if (err == -1) return false;
+    return S_ISDIR(st.st_mode);
+}
+
+static bool entry_is_on(int dir_fd, struct dirent *entry, dev_t dev) {
+    struct stat st;
+    int err = fstatat(dir_fd, entry->d_name, &st, 0);
+    if (err == -1) return false;
+    return st.st_dev == dev;
+}
+
+static int crawl_dir(CrawlPool *pool, size_t id, CrawlItem *item) {
+    size_t entries = 0;
+    size_t path_len = strlen(item->path);
+    CrawlDir *self = NULL;
+    int err = 0;
+
+    int fd = -1;
+    if (NULL != item->parent) {
+        fd = openat(dirfd(item->parent->dir), item->path + item->name_offset, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd == -1) fd = open(item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir_release(item->parent);
+    item->parent = NULL;
+    if (fd == -1) goto done;
+
+    self = malloc(sizeof(CrawlDir));
+    if (NULL == self) {
+        close(fd);
+        err = 1;
+        goto done;
+    }
+    self->refs = 1;
+    self->dir = fdopendir(fd);
+    if (NULL == self->dir) {
+        close(fd);
+        free(self);
+        self = NULL;
+        goto done;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(self->dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        entries++;
+
+        bool is_dir = entry_is_dir(fd, entry);
+        if (!is_dir && !pool->crawl->visit_files) continue;
+        if (is_dir && pool->crawl->one_filesystem && !entry_is_on(fd, entry, pool->crawl->dev)) continue;
+
+        size_t name_len = strlen(entry->d_name);
+        size_t sep_len = is_dir ? 1 : 0;
+        char *path = malloc(sizeof(char) * (path_len + name_len + sep_len + 1));
+        if (NULL == path) {
+            err = 1;
+            break;
+        }
+        memcpy(path, item->path, path_len);
+        memcpy(path + path_len, entry->d_name, name_len);
+        if (sep_len) path[path_len + name_len] = '/';
+        path[path_len + name_len + sep_len] = '\0';
+
+        WatchfulCrawlEntry visited = {
+            .path = path,
+            .name = entry->d_name,
+            .name_len = name_len,
+            .depth = item->depth + 1,
+            .is_dir = is_dir,
+            .dir_fd = fd,
+            .parent = item->ctx,
+        };
+        void *ctx = NULL;
+        err = pool->visit(pool->info, &visited, &ctx);
+        bool is_last = pool->crawl->max_depth && visited.depth >= pool->crawl->max_depth;
+        if (err || NULL == ctx || !is_dir || is_last) {
+            free(path);
+            if (err) break;
+            continue;
+        }
+
+        CrawlItem child = {
+            .parent = self,
+            .path = path,
+            .name_offset = path_len,
+            .depth = visited.depth,
+            .ctx = ctx,
+        };
+        __atomic_add_fetch(&self->refs, 1, __ATOMIC_ACQ_REL);
+        pool_adding(pool);
+        err = deque_push(&pool->deques[id], &child);
+        if (err) {
+            __atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL);
+            free(path);
+            pool_done(pool, 0, 0);
+            break;
+        }
+        pool_added(pool);
+    }
+
+done:
+    dir_release(self);
+    free(item->path);
+    item->path = NULL;
+    pool_done(pool, 1, entries);
+
+    return err;
+}
+
+static void *crawl_worker(void *arg) {
+    CrawlWorker *worker = arg;
+    CrawlPool *pool = worker->pool;
+
+    CrawlItem item;
+    while (pool_take(pool, worker->id, &item)) {
+        if (__atomic_load_n(&pool->failed, __ATOMIC_ACQUIRE)) {
+            dir_release(item.parent);
+            free(item.path);
+            pool_done(pool, 0, 0);
+            continue;
+        }
+        int err = crawl_dir(pool, worker->id, &item);
+        if (err) pool_fail(pool);
+    }
+
+    return NULL;
+}
+
+/* Crawl Functions */
+
+size_t watchful_crawl_threads(size_t threads) {
+    if (threads) return threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return (cpus > CRAWL_MAX_THREADS) ? CRAWL_MAX_THREADS : (size_t)cpus;
+}
+
+int watchful_crawl_run(WatchfulCrawl *crawl, const char *root, void *root_ctx, WatchfulCrawlVisit visit, void *info) {
+    int err = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    CrawlPool pool = {
+        .crawl = crawl,
+        .visit = visit,
+        .info = info,
+        .threads = watchful_crawl_threads(crawl->threads),
+        .pending = 1,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t *threads = NULL;
+    CrawlWorker *workers = NULL;
+    size_t started = 0;
+
+    pool.deques = calloc(pool.threads, sizeof(CrawlDeque));
+    workers = malloc(sizeof(CrawlWorker) * pool.threads);
+    threads = malloc(sizeof(pthread_t) * pool.threads);
+    if (NULL == pool.deques || NULL == workers || NULL == threads) goto error;
+    for (size_t i = 0; i < pool.threads; i++) pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    size_t root_len = strlen(root);
+    bool has_sep = root_len && root[root_len - 1] == '/';
+    CrawlItem item = {
+        .path = malloc(sizeof(char) * (root_len + 2)),
+        .ctx = root_ctx,
+    };
+    if (NULL == item.path) goto error;
+    memcpy(item.path, root, root_len);
+    if (!has_sep) item.path[root_len++] = '/';
+    item.path[root_len] = '\0';
+    err = deque_push(&pool.deques[0], &item);
+    if (err) {
+        free(item.path);
+        goto error;
+    }
+
+    /* The calling thread is worker zero */
+    for (size_t i = 0; i < pool.threads; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+    for (size_t i = 1; i < pool.threads; i++) {
+        err = pthread_create(&threads[i], NULL, crawl_worker, &workers[i]);
+        if (err) break;
+        started++;
+    }
+    crawl_worker(&workers[0]);
+    for (size_t i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+
+    if (pool.failed) goto error;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    crawl->duration = elapsed(&start, &end);
+    crawl->dirs = pool.dirs;
+    crawl->entries = pool.entries;
+
+    for (size_t i = 0; i < pool.threads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    return 0;
+
+error:
+    if (NULL != pool.deques) {
+        for (size_t i = 0; i < pool.threads; i++) {
+            CrawlItem left;
+            while (deque_pop(&pool.deques[i], &left)) {
+                dir_release(left.parent);
+                free(left.path);
+            }
+            pthread_mutex_destroy(&pool.deques[i].lock);
+            free(pool.deques[i].items);
+        }
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    return 1;
+}
@@ -0,0 +1,240 @@
+#include "watchful.h"
+
+/* Events are held back per path until the path has been quiet for the delay.
+ * Pending paths are found through a table keyed by a hash of the path and
+ * are kept in a timer wheel by the tick at which they become due. Entries
+ * and their buffers are reused once released. */
+
+#define DEBOUNCE_TICKS_PER_DELAY 8
+#define DEBOUNCE_MIN_TICK 0.001
+
+/* Helper Functions */
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static WatchfulDebounceEntry *entry_find(WatchfulDebounce *debounce, uint64_t hash, const char *path) {
+    WatchfulDebounceEntry *entry = watchful_table_get(&debounce->paths, hash);
+    while (NULL != entry && strcmp(entry->path, path)) entry = entry->collision;
+    return entry;
+}
+
+static void wheel_link(WatchfulDebounce *debounce, WatchfulDebounceEntry *entry) {
+    /* Slots keep the order events arrived in: the head's prev is the tail */
+    WatchfulDebounceEntry **slot = &debounce->wheel[entry->deadline % WATCHFUL_DEBOUNCE_SLOTS];
+    entry->next = NULL;
+    if (NULL == *slot) {
+        entry->prev = entry;
+        *slot = entry;
+    } else {
+        WatchfulDebounceEntry *tail = (*slot)->prev;
+        tail->next = entry;
+        entry->prev = tail;
+        (*slot)->prev = entry;
+    }
+    return;
+}
+
+static void wheel_unlink(WatchfulDebounce *debounce, WatchfulDebounceEntry *entry) {
+    WatchfulDebounceEntry **slot = &debounce->wheel[entry->deadline % WATCHFUL_DEBOUNCE_SLOTS];
+    if (*slot == entry) {
+        *slot = entry->next;
+        if (NULL != *slot) (*slot)->prev = entry->prev;
+    } else {
+        entry->prev->next = entry->next;
+        if (NULL != entry->next) entry->next->prev = entry->prev;
+        else (*slot)->prev = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+    return;
+}
+
+static int entry_set(WatchfulDebounce *debounce, WatchfulDebounceEntry *entry, const char *path, const char *old_path) {
+    size_t path_len = strlen(path) + 1;
+    size_t old_path_len = (NULL == old_path) ? 0 : strlen(old_path) + 1;
+
+    if (entry->buf_len < path_len + old_path_len) {
+        char *buf = realloc(entry->buf, sizeof(char) * (path_len + old_path_len));
+        if (NULL == buf) return 1;
+        entry->buf = buf;
+        entry->buf_len = path_len + old_path_len;
+        debounce->allocations++;
+    }
+
+    memcpy(entry->buf, path, path_len);
+    if (NULL != old_path) memcpy(entry->buf + path_len, old_path, old_path_len);
+    entry->path = entry->buf;
+    entry->old_path = (NULL == old_path) ? NULL : entry->buf + path_len;
+
+    return 0;
+}
+
+static int entry_release(WatchfulMonitor *wm, WatchfulDebounceEntry *entry) {
+    WatchfulDebounce *debounce = &wm->debounce;
+
+    wheel_unlink(debounce, entry);
+
+    WatchfulDebounceEntry *first = watchful_table_get(&debounce->paths, entry->hash);
+    if (first == entry) {
+        if (NULL == entry->collision) watchful_table_remove(&debounce->paths, entry->hash);
+        else watchful_table_put(&debounce->paths, entry->hash, entry->collision);
+    } else {
+        while (first->collision != entry) first = first->collision;
+        first->collision = entry->collision;
+    }
+    entry->collision = debounce->free;
+    debounce->free = entry;
+    debounce->len--;
+
+    /* The event is copied into the batch, which may flush it straight away */
+    WatchfulArena *arena = &wm->batch.arena;
+    char *path = watchful_arena_strdup(arena, entry->path);
+    if (NULL == path) return 1;
+    char *old_path = NULL;
+    if (NULL != entry->old_path) {
+        old_path = watchful_arena_strdup(arena, entry->old_path);
+        if (NULL == old_path) return 1;
+    }
+
+    return watchful_batch_add(wm, entry->type, path, old_path);
+}
+
+/* Debounce Functions */
+
+int watchful_debounce_init(WatchfulDebounce *debounce, double delay) {
+    debounce->delay = delay;
+    debounce->tick = delay / DEBOUNCE_TICKS_PER_DELAY;
+    if (debounce->tick < DEBOUNCE_MIN_TICK) debounce->tick = DEBOUNCE_MIN_TICK;
+    debounce->current = 0;
+    debounce->free = NULL;
+    debounce->len = 0;
+    debounce->allocations = 0;
+    for (size_t i = 0; i < WATCHFUL_DEBOUNCE_SLOTS; i++) debounce->wheel[i] = NULL;
+    return watchful_table_init(&debounce->paths, 0);
+}
+
+void watchful_debounce_deinit(WatchfulDebounce *debounce) {
+    for (size_t i = 0; i < WATCHFUL_DEBOUNCE_SLOTS; i++) {
+        WatchfulDebounceEntry *entry = debounce->wheel[i];
+        while (NULL != entry) {
+            WatchfulDebounceEntry *next = entry->next;
+            free(entry->buf);
+            free(entry);
+            entry = next;
+        }
+        debounce->wheel[i] = NULL;
+    }
+    while (NULL != debounce->free) {
+        WatchfulDebounceEntry *next = debounce->free->collision;
+        free(debounce->free->buf);
+        free(debounce->free);
+        debounce->free = next;
+    }
+    watchful_table_deinit(&debounce->paths);
+    debounce->len = 0;
+    return;
+}
+
+int watchful_debounce_add(WatchfulMonitor *wm, int type, const char *path, const char *old_path) {
+    WatchfulDebounce *debounce = &wm->debounce;
+
+    double now = now_seconds();
+    if (0 == debounce->len) debounce->current = (uint64_t)(now / debounce->tick);
+    uint64_t deadline = (uint64_t)((now + debounce->delay) / debounce->tick) + 1;
+
+    uint64_t hash = watchful_path_hash(path);
+    WatchfulDebounceEntry *entry = entry_find(debounce, hash, path);
+    if (NULL != entry) {
+        /* A later modification does not hide how the path came to be */
+        bool keeps_type = type == WATCHFUL_EVENT_MODIFIED &&
+            (entry->type == WATCHFUL_EVENT_CREATED || entry->type == WATCHFUL_EVENT_RENAMED);
+        if (!keeps_type) {
+            int err = entry_set(debounce, entry, path, old_path);
+            if (err) return 1;
+            entry->type = type;
+        }
+        entry->at = time(NULL);
+        wheel_unlink(debounce, entry);
+        entry->deadline = deadline;
+        wheel_link(debounce, entry);
+        return 0;
+    }
+
+    entry = debounce->free;
+    if (NULL != entry) {
+        debounce->free = entry->collision;
+    } else {
+        entry = calloc(1, sizeof(WatchfulDebounceEntry));
+        if (NULL == entry) return 1;
+        debounce->allocations++;
+    }
+
+    int err = entry_set(debounce, entry, path, old_path);
+    if (err) goto error;
+
+    entry->hash = hash;
+    entry->type = type;
+    entry->at = time(NULL);
+    entry->collision = watchful_table_get(&debounce->paths, hash);
+    err = watchful_table_put(&debounce->paths, hash, entry);
+    if (err) goto error;
+    entry->deadline = deadline;
+    wheel_link(debounce, entry);
+    debounce->len++;
+
+    return 0;
+
+error:
+    entry->collision = debounce->free;
+    debounce->free = entry;
+    return 1;
+}
+
+int watchful_debounce_release(WatchfulMonitor *wm, bool all) {
+    /* Passes the events that are due (or all of them) to the batch */
+    WatchfulDebounce *debounce = &wm->debounce;
+    if (0 == debounce->len) return 0;
+
+    uint64_t now = (uint64_t)(now_seconds() / debounce->tick);
+    uint64_t last = now;
+    if (all) last = debounce->current + WATCHFUL_DEBOUNCE_SLOTS - 1;
+    if (last - debounce->current >= WATCHFUL_DEBOUNCE_SLOTS) last = debounce->current + WATCHFUL_DEBOUNCE_SLOTS - 1;
+
+    for (uint64_t tick = debounce->current; tick <= last && debounce->len; tick++) {
+        WatchfulDebounceEntry *entry = debounce->wheel[tick % WATCHFUL_DEBOUNCE_SLOTS];
+        while (NULL != entry) {
+            WatchfulDebounceEntry *next = entry->next;
+            if (all || entry->deadline <= now) {
+                int err = entry_release(wm, entry);
+                if (err) return 1;
+            }
+            entry = next;
+        }
+    }
+    if (now > debounce->current) debounce->current = now;
+
+    return 0;
+}
+
+double watchful_debounce_wait(WatchfulMonitor *wm) {
+    /* Returns the seconds until the next path is due (-1 if none are) */
+    WatchfulDebounce *debounce = &wm->debounce;
+    if (0 == debounce->len) return -1;
+
+    for (uint64_t tick = debounce->current; tick < debounce->current + WATCHFUL_DEBOUNCE_SLOTS; tick++) {
+        WatchfulDebounceEntry *entry = debounce->wheel[tick % WATCHFUL_DEBOUNCE_SLOTS];
+        if (NULL == entry) continue;
+        uint64_t deadline = entry->deadline;
+        for (; NULL != entry; entry = entry->next) {
+            if (entry->deadline < deadline) deadline = entry->deadline;
+        }
+        double remaining = (double)deadline * debounce->tick - now_seconds();
+        return (remaining > 0) ? remaining : 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include "watchful.h"
+
+/* Includes limit the events reported to paths that match one of a set of
+ * patterns. A pattern without a '/' (or one that starts with "**" and then
+ * has no other '/') is matched against the name of the file or directory
+ * wherever it is; any other pattern is anchored at the monitored path unless
+ * it is absolute. The usual shapes, a plain name and "*" followed by a plain
+ * suffix, are looked up in hash sets keyed by that text so they cost a hash
+ * of the name however many there are. Only the rest go to a matcher and so
+ * to wildmatch(). */
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x100000001B3ULL
+
+/* Helper Functions */
+
+static bool is_plain(const char *text) {
+    for (const char *c = text; *c; c++) {
+        if (*c == '*' || *c == '?' || *c == '[' || *c == '\\' || *c == '/') return false;
+    }
+    return true;
+}
+
+static uint64_t literal_hash(const char *text, size_t len) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static bool literal_has(const WatchfulTable *table, const char *text, size_t len) {
+    WatchfulLiteral *literal = watchful_table_get(table, literal_hash(text, len));
+    for (; NULL != literal; literal = literal->next) {
+        if (literal->len == len && !memcmp(literal->text, text, len)) return true;
+    }
+    return false;
+}
+
+static int literal_add(WatchfulTable *table, const char *text) {
+    size_t len = strlen(text);
+    if (literal_has(table, text, len)) return 0;
+
+    WatchfulLiteral *literal = malloc(sizeof(WatchfulLiteral) + len + 1);
+    if (NULL == literal) return 1;
+    literal->len = len;
+    memcpy(literal->text, text, len + 1);
+
+    /* Texts with the same hash are chained */
+    uint64_t hash = literal_hash(text, len);
+    literal->next = watchful_table_get(table, hash);
+    if (watchful_table_put(table, hash, literal)) {
+        free(literal);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void literals_free(WatchfulTable *table) {
+    for (size_t i = 0; i < table->cap; i++) {
+        WatchfulLiteral *literal = table->entries[i].value;
+        while (NULL != literal) {
+            WatchfulLiteral *next = literal->next;
+            free(literal);
+            literal = next;
+        }
+    }
+    watchful_table_deinit(table);
+    return;
+}
+
+static int suffix_len_add(WatchfulIncludes *includes, size_t len) {
+    /* Kept in ascending order so a lookup stops at the length of the name */
+    size_t i = 0;
+    while (i < includes->suffix_lens_len && includes->suffix_lens[i] < len) i++;
+    if (i < includes->suffix_lens_len && includes->suffix_lens[i] == len) return 0;
+
+    size_t *lens = realloc(includes->suffix_lens, sizeof(size_t) * (includes->suffix_lens_len + 1));
+    if (NULL == lens) return 1;
+    memmove(lens + i + 1, lens + i, sizeof(size_t) * (includes->suffix_lens_len - i));
+    lens[i] = len;
+    includes->suffix_lens = lens;
+    includes->suffix_lens_len++;
+
+    return 0;
+}
+
+static int path_add(WatchfulIncludes *includes, const char *root, const char *middle, const char *pattern, const char *tail) {
+    size_t root_len = (pattern[0] == '/') ? 0 : strlen(root);
+    while (root_len && root[root_len - 1] == '/') root_len--;
+    size_t middle_len = strlen(middle);
+    size_t pattern_len = strlen(pattern);
+    size_t tail_len = strlen(tail);
+
+    char *path = malloc(sizeof(char) * (root_len + 1 + middle_len + pattern_len + tail_len + 1));
+    if (NULL == path) return 1;
+
+    size_t len = 0;
+    memcpy(path, root, root_len);
+    len += root_len;
+    if (pattern[0] != '/') path[len++] = '/';
+    memcpy(path + len, middle, middle_len);
+    len += middle_len;
+    memcpy(path + len, pattern, pattern_len);
+    len += pattern_len;
+    memcpy(path + len, tail, tail_len);
+    len += tail_len;
+    path[len] = '\0';
+
+    includes->paths[includes->paths_len++] = path;
+
+    return 0;
+}
+
+static int pattern_add(WatchfulIncludes *includes, const char *root, const char *pattern) {
+    const char *name = pattern;
+    if (!strncmp(name, "**/", 3)) name += 3;
+    if (NULL != strchr(name, '/')) return path_add(includes, root, "", pattern, "");
+
+    if (is_plain(name)) return literal_add(&includes->names, name);
+    if (name[0] == '*' && name[1] != '\0' && is_plain(name + 1)) {
+        if (literal_add(&includes->suffixes, name + 1)) return 1;
+        return suffix_len_add(includes, strlen(name + 1));
+    }
+
+    /* Directories are reported with a trailing separator */
+    if (path_add(includes, root, "**/", name, "")) return 1;
+    return path_add(includes, root, "**/", name, "/");
+}
+
+/* Include Functions */
+
+WatchfulIncludes *watchful_includes_create(const char *root, size_t patterns_len, const char **patterns) {
+    WatchfulIncludes *includes = malloc(sizeof(WatchfulIncludes));
+    if (NULL == includes) return NULL;
+
+    includes->len = patterns_len;
+    includes->names.len = 0;
+    includes->names.cap = 0;
+    includes->names.entries = NULL;
+    includes->suffixes.len = 0;
+    includes->suffixes.cap = 0;
+    includes->suffixes.entries = NULL;
+    includes->suffix_lens = NULL;
+    includes->suffix_lens_len = 0;
+    includes->paths_len = 0;
+    includes->matcher = NULL;
+
+    /* A general pattern matched by name becomes two paths at most */
+    includes->paths = calloc(patterns_len * 2 + 1, sizeof(char *));
+    if (NULL == includes->paths) goto error;
+
+    for (size_t i = 0; i < patterns_len; i++) {
+        if (pattern_add(includes, root, patterns[i])) goto error;
+    }
+
+    if (includes->paths_len) {
+        includes->matcher = watchful_matcher_create(includes->paths_len, includes->paths);
+        if (NULL == includes->matcher) goto error;
+    }
+
+    return includes;
+
+error:
+    watchful_includes_destroy(includes);
+    return NULL;
+}
+
+void watchful_includes_destroy(WatchfulIncludes *includes) {
+    if (NULL == includes) return;
+
+    watchful_matcher_destroy(includes->matcher);
+    if (NULL != includes->paths) {
+        for (size_t i = 0; i < includes->paths_len; i++) free(includes->paths[i]);
+        free(includes->paths);
+    }
+    free(includes->suffix_lens);
+    literals_free(&includes->names);
+    literals_free(&includes->suffixes);
+    free(includes);
+
+    return;
+}
+
+bool watchful_includes_matches(const WatchfulIncludes *includes, const char *path) {
+    size_t path_len = strlen(path);
+    size_t end = (path_len && path[path_len - 1] == '/') ? path_len - 1 : path_len;
+    size_t start = end;
+    while (start && path[start - 1] != '/') start--;
+    const char *name = path + start;
+    size_t name_len = end - start;
+
+    if (includes->names.len && literal_has(&includes->names, name, name_len)) return true;
+
+    for (size_t i = 0; i < includes->suffix_lens_len; i++) {
+        size_t suffix_len = includes->suffix_lens[i];
+        if (suffix_len > name_len) break;
+        if (literal_has(&includes->suffixes, name + name_len - suffix_len, suffix_len)) return true;
+    }
+
+    if (NULL == includes->matcher) return false;
+    return watchful_matcher_matches(includes->matcher, path);
+}
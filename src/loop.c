@@ -0,0 +1,317 @@
+#include "watchful.h"
+
+#ifndef LINUX
+
+WatchfulLoop *watchful_loop_create(size_t threads) {
+    (void)threads;
+    return NULL;
+}
+
+void watchful_loop_destroy(WatchfulLoop *loop) {
+    (void)loop;
+    return;
+}
+
+#else
+
+/* A loop serves any number of handlers from one epoll instance with a small
+ * pool of threads. Each handler is processed by one thread at a time and
+ * processing must be safe to repeat, as a wakeup can be seen by more than one
+ * thread. A thread that finds the handler being processed leaves a note for
+ * the thread processing it rather than waiting. Handlers are looked up in a
+ * table when their events arrive so that a handler removed while its events
+ * were in flight is skipped. */
+
+#define LOOP_EVENTS 64
+
+static __thread WatchfulLoopHandler *processing = NULL;
+
+/* Helper Functions */
+
+static WatchfulLoopHandler *handler_acquire(WatchfulLoop *loop, void *ptr) {
+    pthread_mutex_lock(&loop->lock);
+    WatchfulLoopHandler *handler = watchful_table_get(&loop->handlers, (uint64_t)(uintptr_t)ptr);
+    if (NULL != handler) handler->busy++;
+    pthread_mutex_unlock(&loop->lock);
+    return handler;
+}
+
+static void handler_release(WatchfulLoop *loop, WatchfulLoopHandler *handler) {
+    pthread_mutex_lock(&loop->lock);
+    handler->busy--;
+    if (0 == handler->busy) pthread_cond_broadcast(&loop->cond);
+    pthread_mutex_unlock(&loop->lock);
+    return;
+}
+
+static void handler_process(WatchfulLoopHandler *handler) {
+    __atomic_store_n(&handler->again, true, __ATOMIC_SEQ_CST);
+    while (0 == pthread_mutex_trylock(&handler->lock)) {
+        processing = handler;
+        while (__atomic_exchange_n(&handler->again, false, __ATOMIC_SEQ_CST)) {
+            if (__atomic_load_n(&handler->removed, __ATOMIC_SEQ_CST)) break;
+            handler->process(handler->info);
+        }
+        processing = NULL;
+        pthread_mutex_unlock(&handler->lock);
+        if (!__atomic_load_n(&handler->again, __ATOMIC_SEQ_CST)) break;
+    }
+    return;
+}
+
+static void loop_free(WatchfulLoop *loop) {
+    free(loop->threads);
+    if (loop->efd != -1) close(loop->efd);
+    if (loop->epfd != -1) close(loop->epfd);
+    watchful_table_deinit(&loop->handlers);
+    pthread_mutex_destroy(&loop->lock);
+    pthread_cond_destroy(&loop->cond);
+    free(loop);
+    return;
+}
+
+static void *loop_runner(void *arg) {
+    WatchfulLoop *loop = arg;
+    struct epoll_event events[LOOP_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(loop->epfd, events, LOOP_EVENTS, -1);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready == -1) break;
+
+        for (int i = 0; i < ready; i++) {
+            /* The shutdown eventfd is never read so every thread sees it */
+            if (NULL == events[i].data.ptr) {
+                if (loop->is_orphaned) {
+                    pthread_detach(pthread_self());
+                    loop_free(loop);
+                }
+                return NULL;
+            }
+
+            WatchfulLoopHandler *handler = handler_acquire(loop, events[i].data.ptr);
+            if (NULL == handler) continue;
+
+            handler_process(handler);
+            handler_release(loop, handler);
+        }
+    }
+
+    return NULL;
+}
+
+/* Loop Functions */
+
+WatchfulLoop *watchful_loop_create(size_t threads) {
+    WatchfulLoop *loop = calloc(1, sizeof(WatchfulLoop));
+    if (NULL == loop) return NULL;
+
+    loop->epfd = -1;
+    loop->efd = -1;
+    loop->threads_len = 0;
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_cond_init(&loop->cond, NULL);
+
+    int err = watchful_table_init(&loop->handlers, 0);
+    if (err) goto error;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) goto error;
+
+    loop->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->efd == -1) goto error;
+
+    struct epoll_event shutdown = { .events = EPOLLIN, .data.ptr = NULL };
+    err = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->efd, &shutdown);
+    if (err) goto error;
+
+    if (0 == threads) threads = 1;
+    loop->threads = malloc(sizeof(pthread_t) * threads);
+    if (NULL == loop->threads) goto error;
+
+    for (size_t i = 0; i < threads; i++) {
+        err = pthread_create(&loop->threads[i], NULL, loop_runner, loop);
+        if (err) goto error;
+        loop->threads_len++;
+    }
+
+    return loop;
+
+error:
+    watchful_loop_destroy(loop);
+    return NULL;
+}
+
+void watchful_loop_destroy(WatchfulLoop *loop) {
+    if (NULL == loop) return;
+
+    if (loop->efd != -1) {
+        uint64_t one = 1;
+        ssize_t written = write(loop->efd, &one, sizeof(one));
+        (void)written;
+    }
+
+    /* A loop destroyed from one of its own threads is freed by that thread
+     * once it gets back to waiting */
+    bool is_own = false;
+    for (size_t i = 0; i < loop->threads_len; i++) {
+        if (pthread_equal(loop->threads[i], pthread_self())) {
+            is_own = true;
+            continue;
+        }
+        pthread_join(loop->threads[i], NULL);
+    }
+    if (is_own) {
+        loop->is_orphaned = true;
+        return;
+    }
+
+    loop_free(loop);
+
+    return;
+}
+
+int watchful_loop_add(WatchfulLoop *loop, WatchfulLoopHandler *handler) {
+    /* Handlers drain their descriptors so they are edge triggered */
+    pthread_mutex_init(&handler->lock, NULL);
+    handler->busy = 0;
+    handler->again = false;
+    handler->removed = false;
+
+    pthread_mutex_lock(&loop->lock);
+    int err = watchful_table_put(&loop->handlers, (uint64_t)(uintptr_t)handler, handler);
+    pthread_mutex_unlock(&loop->lock);
+    if (err) goto error;
+
+    size_t added = 0;
+    for (; added < handler->fds_len; added++) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = handler };
+        err = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, handler->fds[added], &event);
+        if (err) break;
+    }
+    if (added < handler->fds_len) {
+        watchful_loop_remove(loop, handler);
+        return 1;
+    }
+
+    return 0;
+
+error:
+    pthread_mutex_destroy(&handler->lock);
+    return 1;
+}
+
+void watchful_loop_remove(WatchfulLoop *loop, WatchfulLoopHandler *handler) {
+    pthread_mutex_lock(&loop->lock);
+    __atomic_store_n(&handler->removed, true, __ATOMIC_SEQ_CST);
+    watchful_table_remove(&loop->handlers, (uint64_t)(uintptr_t)handler);
+    for (size_t i = 0; i < handler->fds_len; i++) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fds[i], NULL);
+
+    /* A handler removed while it is processed (e.g. from its own callback)
+     * only waits for other threads */
+    size_t self = (processing == handler) ? 1 : 0;
+    while (handler->busy > self) pthread_cond_wait(&loop->cond, &loop->lock);
+    pthread_mutex_unlock(&loop->lock);
+
+    if (0 == self) pthread_mutex_destroy(&handler->lock);
+
+    return;
+}
+
+/* Monitor Functions */
+
+int watchful_loop_attach(WatchfulMonitor *wm, int (*process)(void *info)) {
+    /* The monitor's fd and a timer for its deadlines are served either by a
+     * loop or, for an external monitor, through one descriptor the embedder
+     * waits on before calling process on its own thread */
+    int err = 0;
+
+    wm->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wm->timer_fd == -1) return 1;
+
+    wm->owns_loop = false;
+    if (wm->is_external) {
+        wm->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (wm->poll_fd == -1) goto error;
+
+        int fds[2] = { wm->fd, wm->timer_fd };
+        for (size_t i = 0; i < 2; i++) {
+            struct epoll_event event = { .events = EPOLLIN, .data.fd = fds[i] };
+            err = epoll_ctl(wm->poll_fd, EPOLL_CTL_ADD, fds[i], &event);
+            if (err) goto error;
+        }
+
+        return 0;
+    }
+
+    wm->owns_loop = NULL == wm->loop;
+    if (wm->owns_loop) {
+        wm->loop = watchful_loop_create(1);
+        if (NULL == wm->loop) goto error;
+    }
+
+    wm->handler.process = process;
+    wm->handler.info = wm;
+    wm->handler.fds[0] = wm->fd;
+    wm->handler.fds[1] = wm->timer_fd;
+    wm->handler.fds_len = 2;
+    err = watchful_loop_add(wm->loop, &wm->handler);
+    if (err) goto error;
+
+    return 0;
+
+error:
+    if (wm->poll_fd != -1) close(wm->poll_fd);
+    wm->poll_fd = -1;
+    if (wm->owns_loop) {
+        watchful_loop_destroy(wm->loop);
+        wm->loop = NULL;
+        wm->owns_loop = false;
+    }
+    close(wm->timer_fd);
+    wm->timer_fd = -1;
+    return 1;
+}
+
+void watchful_loop_detach(WatchfulMonitor *wm) {
+    /* The timer is left open for the backend to close */
+    if (wm->is_external) {
+        close(wm->poll_fd);
+        wm->poll_fd = -1;
+    } else {
+        watchful_loop_remove(wm->loop, &wm->handler);
+    }
+    if (wm->owns_loop) {
+        watchful_loop_destroy(wm->loop);
+        wm->loop = NULL;
+        wm->owns_loop = false;
+    }
+    return;
+}
+
+int watchful_loop_arm(WatchfulMonitor *wm, double wait) {
+    return watchful_loop_set(wm->timer_fd, watchful_loop_wait(wm, wait));
+}
+
+double watchful_loop_wait(WatchfulMonitor *wm, double wait) {
+    /* The timer wakes the loop to flush a batch, release held events or meet
+     * a deadline of the backend's own (none if negative) */
+    double remaining = watchful_batch_wait(wm);
+    double held = watchful_debounce_wait(wm);
+    if (held >= 0 && (remaining < 0 || held < remaining)) remaining = held;
+    if (wait >= 0 && (remaining < 0 || wait < remaining)) remaining = wait;
+    return remaining;
+}
+
+int watchful_loop_set(int timer_fd, double wait) {
+    struct itimerspec timer = {0};
+    if (wait >= 0) {
+        timer.it_value.tv_sec = (time_t)wait;
+        timer.it_value.tv_nsec = (long)((wait - (double)timer.it_value.tv_sec) * 1e9);
+        if (0 == timer.it_value.tv_sec && 0 == timer.it_value.tv_nsec) timer.it_value.tv_nsec = 1;
+    }
+
+    return timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+#endif
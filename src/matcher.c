@@ -0,0 +1,471 @@
+#include "watchful.h"
+
+/* A matcher answers whether any of a set of wildmatch patterns matches a
+ * path. Every pattern is reduced to literal text the path must contain: a
+ * prefix, a suffix and a key. The keys of all patterns are compiled into one
+ * Aho-Corasick automaton so that a single pass over the path finds the
+ * patterns worth checking. wildmatch() has the final word on those, so the
+ * result is always the same as trying each pattern in turn. */
+
+#define NO_STATE -1
+
+/* Helper Functions */
+
+static bool is_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static const char *bracket_end(const char *pattern) {
+    /* Mirrors rangematch() closely enough to find the closing bracket; give
+     * up on anything unusual as that only makes the filter less selective */
+    const char *p = pattern + 1;
+    if (*p == '!' || *p == '^') p++;
+    /* The first character is part of the set even if it is ']' */
+    bool is_first = true;
+    while (is_first || *p != ']') {
+        if (*p == '\0' || *p == '\\' || (*p == '[' && p[1] == ':')) return NULL;
+        is_first = false;
+        p++;
+    }
+    return p;
+}
+
+static void pattern_analyse(WatchfulPattern *info, const char *pattern) {
+    size_t len = strlen(pattern);
+
+    info->pattern = pattern;
+    info->prefix_len = 0;
+    info->suffix = NULL;
+    info->suffix_len = 0;
+    info->key = NULL;
+    info->key_len = 0;
+    info->next = NO_STATE;
+
+    while (info->prefix_len < len && !is_special(pattern[info->prefix_len])) info->prefix_len++;
+
+    if (info->prefix_len == len) return;
+
+    /* Walk the literal runs; a '/' straight after ** may be skipped by the
+     * matcher so it is never counted as text the path has to contain */
+    const char *p = pattern + info->prefix_len;
+    const char *run = NULL;
+    size_t run_len = 0;
+    bool after_wildstar = false;
+    bool is_opaque = false;
+    while (*p != '\0') {
+        if (*p == '*') {
+            after_wildstar = (p[1] == '*');
+            while (*p == '*') p++;
+            run = NULL;
+            continue;
+        } else if (*p == '?' || *p == '\\') {
+            if (*p == '\\') is_opaque = true;
+            after_wildstar = false;
+            p++;
+            run = NULL;
+            if (is_opaque) break;
+            continue;
+        } else if (*p == '[') {
+            const char *end = bracket_end(p);
+            if (NULL == end) {
+                is_opaque = true;
+                break;
+            }
+            after_wildstar = false;
+            p = end + 1;
+            run = NULL;
+            continue;
+        }
+
+        if (NULL == run) {
+            if (after_wildstar && *p == '/') {
+                after_wildstar = false;
+                p++;
+                continue;
+            }
+            run = p;
+            run_len = 0;
+        }
+        while (*p != '\0' && !is_special(*p)) {
+            p++;
+            run_len++;
+        }
+        if (run_len > info->key_len) {
+            info->key = run;
+            info->key_len = run_len;
+        }
+        if (*p == '\0') {
+            info->suffix = run;
+            info->suffix_len = run_len;
+        }
+        after_wildstar = false;
+    }
+
+    /* Anything after an unparsed escape or bracket is not reliable */
+    if (is_opaque) {
+        info->suffix = NULL;
+        info->suffix_len = 0;
+    }
+}
+
+static int pattern_stem(WatchfulPattern *info) {
+    /* Matching the stem of a pattern ending in '/' followed by ** means that
+     * everything beneath also matches */
+    size_t len = strlen(info->pattern);
+
+    info->is_segmented = (NULL == strchr(info->pattern, '\\'));
+    for (const char *p = strchr(info->pattern, '['); info->is_segmented && NULL != p; p = strchr(p + 1, '[')) {
+        const char *end = bracket_end(p);
+        if (NULL == end || memchr(p, '/', end - p)) info->is_segmented = false;
+        else p = end;
+    }
+
+    info->stem = NULL;
+    if (len < 3 || strcmp(info->pattern + len - 3, "/**")) return 0;
+    if (len > 3 && info->pattern[len - 4] == '*') return 0;
+
+    info->stem = malloc(sizeof(char) * (len - 1));
+    if (NULL == info->stem) return 1;
+    memcpy(info->stem, info->pattern, len - 2);
+    info->stem[len - 2] = '\0';
+
+    return 0;
+}
+
+static void key_choose(WatchfulMatcher *matcher) {
+    /* Patterns share the absolute path of the working directory, so a prefix
+     * only helps by however much it extends beyond what they all start with */
+    size_t common_len = matcher->patterns[0].prefix_len;
+    for (size_t i = 1; i < matcher->patterns_len; i++) {
+        const char *pattern = matcher->patterns[i].pattern;
+        size_t len = 0;
+        while (len < common_len && len < matcher->patterns[i].prefix_len && pattern[len] == matcher->patterns[0].pattern[len]) len++;
+        common_len = len;
+    }
+
+    for (size_t i = 0; i < matcher->patterns_len; i++) {
+        WatchfulPattern *info = &matcher->patterns[i];
+        size_t weight = info->prefix_len - ((common_len < info->prefix_len) ? common_len : info->prefix_len);
+        if (info->prefix_len && (NULL == info->key || weight > info->key_len)) {
+            info->key = info->pattern;
+            info->key_len = info->prefix_len;
+        }
+    }
+}
+
+static int32_t state_add(WatchfulMatcher *matcher) {
+    if (matcher->states_len == matcher->states_max) {
+        size_t max = (0 == matcher->states_max) ? 64 : matcher->states_max * 2;
+        int32_t *delta = realloc(matcher->delta, sizeof(int32_t) * max * matcher->classes_len);
+        if (NULL == delta) return NO_STATE;
+        matcher->delta = delta;
+        int32_t *fail = realloc(matcher->fail, sizeof(int32_t) * max);
+        if (NULL == fail) return NO_STATE;
+        matcher->fail = fail;
+        int32_t *dict = realloc(matcher->dict, sizeof(int32_t) * max);
+        if (NULL == dict) return NO_STATE;
+        matcher->dict = dict;
+        int32_t *out = realloc(matcher->out, sizeof(int32_t) * max);
+        if (NULL == out) return NO_STATE;
+        matcher->out = out;
+        matcher->states_max = max;
+    }
+
+    int32_t state = (int32_t)matcher->states_len++;
+    for (size_t c = 0; c < matcher->classes_len; c++) {
+        matcher->delta[state * matcher->classes_len + c] = NO_STATE;
+    }
+    matcher->fail[state] = 0;
+    matcher->dict[state] = NO_STATE;
+    matcher->out[state] = NO_STATE;
+
+    return state;
+}
+
+static int automaton_build(WatchfulMatcher *matcher) {
+    /* Byte classes keep the transition table small */
+    memset(matcher->classes, 0, sizeof(matcher->classes));
+    matcher->classes_len = 1;
+    for (size_t i = 0; i < matcher->patterns_len; i++) {
+        const WatchfulPattern *info = &matcher->patterns[i];
+        for (size_t j = 0; j < info->key_len; j++) {
+            unsigned char c = (unsigned char)info->key[j];
+            if (0 == matcher->classes[c]) matcher->classes[c] = (uint8_t)matcher->classes_len++;
+        }
+    }
+
+    if (state_add(matcher) == NO_STATE) return 1;
+
+    /* Trie of keys */
+    for (size_t i = 0; i < matcher->patterns_len; i++) {
+        WatchfulPattern *info = &matcher->patterns[i];
+        if (0 == info->key_len) {
+            info->next = matcher->always;
+            matcher->always = (int32_t)i;
+            continue;
+        }
+        int32_t state = 0;
+        for (size_t j = 0; j < info->key_len; j++) {
+            size_t c = matcher->classes[(unsigned char)info->key[j]];
+            int32_t next = matcher->delta[state * matcher->classes_len + c];
+            if (next == NO_STATE) {
+                next = state_add(matcher);
+                if (next == NO_STATE) return 1;
+                matcher->delta[state * matcher->classes_len + c] = next;
+            }
+            state = next;
+        }
+        info->next = matcher->out[state];
+        matcher->out[state] = (int32_t)i;
+    }
+
+    /* Failure links, breadth first, turning the trie into a DFA */
+    int32_t *queue = malloc(sizeof(int32_t) * matcher->states_len);
+    if (NULL == queue) return 1;
+    size_t head = 0;
+    size_t tail = 0;
+
+    for (size_t c = 0; c < matcher->classes_len; c++) {
+        int32_t next = matcher->delta[c];
+        if (next == NO_STATE) {
+            matcher->delta[c] = 0;
+        } else {
+            matcher->fail[next] = 0;
+            queue[tail++] = next;
+        }
+    }
+
+    while (head < tail) {
+        int32_t state = queue[head++];
+        int32_t fail = matcher->fail[state];
+        matcher->dict[state] = (matcher->out[fail] != NO_STATE) ? fail : matcher->dict[fail];
+        for (size_t c = 0; c < matcher->classes_len; c++) {
+            int32_t *next = &matcher->delta[state * matcher->classes_len + c];
+            int32_t fallback = matcher->delta[fail * matcher->classes_len + c];
+            if (*next == NO_STATE) {
+                *next = fallback;
+            } else {
+                matcher->fail[*next] = fallback;
+                queue[tail++] = *next;
+            }
+        }
+    }
+
+    free(queue);
+
+    return 0;
+}
+
+static bool pattern_matches(const WatchfulPattern *info, const char *path, size_t path_len) {
+    if (path_len < info->prefix_len) return false;
+    if (strncmp(info->pattern, path, info->prefix_len)) return false;
+    if (path_len < info->suffix_len) return false;
+    if (info->suffix_len && memcmp(info->suffix, path + path_len - info->suffix_len, info->suffix_len)) return false;
+    return wildmatch(info->pattern, path, WM_WILDSTAR) == WM_MATCH;
+}
+
+static int pattern_scope(const WatchfulPattern *info, const char *dir, size_t dir_len) {
+    /* Only an absolute pattern can be walked alongside the directory */
+    if (info->pattern[0] != '/') return WATCHFUL_SCOPE_SOME;
+
+    /* Everything beneath the directory starts with it */
+    size_t len = (info->prefix_len < dir_len) ? info->prefix_len : dir_len;
+    if (strncmp(info->pattern, dir, len)) return WATCHFUL_SCOPE_NONE;
+
+    if (NULL != info->stem && wildmatch(info->stem, dir, WM_WILDSTAR) == WM_MATCH) return WATCHFUL_SCOPE_ALL;
+
+    if (!info->is_segmented || dir[0] != '/') return WATCHFUL_SCOPE_SOME;
+
+    /* Without a slash a wildcard stays within one path segment, so the
+     * segments of the directory can be checked one at a time */
+    char pattern_seg[strlen(info->pattern) + 1];
+    char dir_seg[dir_len + 1];
+    const char *p = info->pattern + 1;
+    const char *d = dir + 1;
+    while (*d != '\0') {
+        const char *d_end = strchr(d, '/');
+        if (NULL == d_end) d_end = dir + dir_len;
+        size_t p_len = 0;
+        while (p[p_len] != '\0' && p[p_len] != '/') {
+            if (p[p_len] == '[') {
+                p_len = bracket_end(p + p_len) - p;
+            }
+            p_len++;
+        }
+        memcpy(pattern_seg, p, p_len);
+        pattern_seg[p_len] = '\0';
+        if (NULL != strstr(pattern_seg, "**")) return WATCHFUL_SCOPE_SOME;
+
+        /* The pattern ends before anything beneath the directory could */
+        if (p[p_len] == '\0') return WATCHFUL_SCOPE_NONE;
+
+        memcpy(dir_seg, d, d_end - d);
+        dir_seg[d_end - d] = '\0';
+        if (wildmatch(pattern_seg, dir_seg, WM_WILDSTAR) != WM_MATCH) return WATCHFUL_SCOPE_NONE;
+
+        p += p_len + 1;
+        d = (*d_end == '\0') ? d_end : d_end + 1;
+    }
+
+    return WATCHFUL_SCOPE_SOME;
+}
+
+static uint64_t scope_hash(const uint64_t *patterns, size_t words_len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < words_len; i++) hash = (hash ^ patterns[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static const WatchfulScope *scope_intern(WatchfulMatcher *matcher, int state, const uint64_t *patterns) {
+    size_t words_len = (matcher->patterns_len + 63) / 64;
+    uint64_t hash = scope_hash(patterns, words_len) ^ (uint64_t)state;
+
+    pthread_mutex_lock(&matcher->scopes_lock);
+
+    WatchfulScope *head = watchful_table_get(&matcher->scopes, hash);
+    for (WatchfulScope *scope = head; NULL != scope; scope = scope->next) {
+        if (scope->state == state && !memcmp(scope->patterns, patterns, sizeof(uint64_t) * words_len)) {
+            pthread_mutex_unlock(&matcher->scopes_lock);
+            return scope;
+        }
+    }
+
+    WatchfulScope *scope = malloc(sizeof(WatchfulScope) + sizeof(uint64_t) * words_len);
+    if (NULL == scope) goto error;
+    scope->state = state;
+    scope->next = head;
+    memcpy(scope->patterns, patterns, sizeof(uint64_t) * words_len);
+
+    int err = watchful_table_put(&matcher->scopes, hash, scope);
+    if (err) goto error;
+
+    pthread_mutex_unlock(&matcher->scopes_lock);
+    return scope;
+
+error:
+    pthread_mutex_unlock(&matcher->scopes_lock);
+    free(scope);
+    return NULL;
+}
+
+/* Matcher Functions */
+
+WatchfulMatcher *watchful_matcher_create(size_t patterns_len, char **patterns) {
+    WatchfulMatcher *matcher = calloc(1, sizeof(WatchfulMatcher));
+    if (NULL == matcher) return NULL;
+
+    matcher->always = NO_STATE;
+    matcher->patterns_len = patterns_len;
+    pthread_mutex_init(&matcher->scopes_lock, NULL);
+
+    int err = watchful_table_init(&matcher->scopes, 0);
+    if (err) goto error;
+
+    if (patterns_len) {
+        matcher->patterns = calloc(patterns_len, sizeof(WatchfulPattern));
+        if (NULL == matcher->patterns) goto error;
+        for (size_t i = 0; i < patterns_len; i++) {
+            pattern_analyse(&matcher->patterns[i], patterns[i]);
+            err = pattern_stem(&matcher->patterns[i]);
+            if (err) goto error;
+        }
+        key_choose(matcher);
+    }
+
+    err = automaton_build(matcher);
+    if (err) goto error;
+
+    return matcher;
+
+error:
+    watchful_matcher_destroy(matcher);
+    return NULL;
+}
+
+void watchful_matcher_destroy(WatchfulMatcher *matcher) {
+    if (NULL == matcher) return;
+    for (size_t i = 0; i < matcher->scopes.cap; i++) {
+        WatchfulScope *scope = matcher->scopes.entries[i].value;
+        while (NULL != scope) {
+            WatchfulScope *next = scope->next;
+            free(scope);
+            scope = next;
+        }
+    }
+    watchful_table_deinit(&matcher->scopes);
+    pthread_mutex_destroy(&matcher->scopes_lock);
+    if (NULL != matcher->patterns) {
+        for (size_t i = 0; i < matcher->patterns_len; i++) free(matcher->patterns[i].stem);
+    }
+    free(matcher->patterns);
+    free(matcher->delta);
+    free(matcher->fail);
+    free(matcher->dict);
+    free(matcher->out);
+    free(matcher);
+    return;
+}
+
+const WatchfulScope *watchful_matcher_scope(WatchfulMatcher *matcher, const WatchfulScope *parent, const char *dir) {
+    size_t words_len = (matcher->patterns_len + 63) / 64;
+    uint64_t patterns[words_len + 1];
+    memset(patterns, 0, sizeof(patterns));
+
+    if (NULL != parent && parent->state != WATCHFUL_SCOPE_SOME) return parent;
+
+    size_t dir_len = strlen(dir);
+    int state = WATCHFUL_SCOPE_NONE;
+    for (size_t i = 0; i < matcher->patterns_len; i++) {
+        if (NULL != parent && !(parent->patterns[i / 64] & (1ULL << (i % 64)))) continue;
+        int pattern_state = pattern_scope(&matcher->patterns[i], dir, dir_len);
+        if (pattern_state == WATCHFUL_SCOPE_ALL) {
+            memset(patterns, 0, sizeof(patterns));
+            state = WATCHFUL_SCOPE_ALL;
+            break;
+        } else if (pattern_state == WATCHFUL_SCOPE_SOME) {
+            patterns[i / 64] |= 1ULL << (i % 64);
+            state = WATCHFUL_SCOPE_SOME;
+        }
+    }
+
+    return scope_intern(matcher, state, patterns);
+}
+
+bool watchful_matcher_matches(const WatchfulMatcher *matcher, const char *path) {
+    return watchful_matcher_matches_in(matcher, NULL, path);
+}
+
+bool watchful_matcher_matches_in(const WatchfulMatcher *matcher, const WatchfulScope *scope, const char *path) {
+    if (0 == matcher->patterns_len) return false;
+    if (NULL != scope && scope->state == WATCHFUL_SCOPE_NONE) return false;
+    if (NULL != scope && scope->state == WATCHFUL_SCOPE_ALL) return true;
+
+    size_t path_len = strlen(path);
+
+    /* Each pattern is tried at most once however often its key occurs, and
+     * patterns outside the scope are never tried */
+    size_t words_len = (matcher->patterns_len + 63) / 64;
+    uint64_t tried[words_len];
+    for (size_t i = 0; i < words_len; i++) tried[i] = (NULL == scope) ? 0 : ~scope->patterns[i];
+
+    for (int32_t i = matcher->always; i != NO_STATE; i = matcher->patterns[i].next) {
+        if (tried[i / 64] & (1ULL << (i % 64))) continue;
+        if (pattern_matches(&matcher->patterns[i], path, path_len)) return true;
+    }
+
+    int32_t state = 0;
+    for (size_t pos = 0; pos < path_len; pos++) {
+        size_t c = matcher->classes[(unsigned char)path[pos]];
+        state = matcher->delta[state * matcher->classes_len + c];
+        int32_t hit = (matcher->out[state] != NO_STATE) ? state : matcher->dict[state];
+        for (; hit != NO_STATE; hit = matcher->dict[hit]) {
+            for (int32_t i = matcher->out[hit]; i != NO_STATE; i = matcher->patterns[i].next) {
+                if (tried[i / 64] & (1ULL << (i % 64))) continue;
+                tried[i / 64] |= 1ULL << (i % 64);
+                if (pattern_matches(&matcher->patterns[i], path, path_len)) return true;
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,244 @@
+#include "watchful.h"
+
+/* The queue is a bounded ring with one producer (the thread reading events)
+ * and one consumer. Events are claimed by moving the tail and then moved out
+ * of the ring by swapping their buffers for ones the consumer holds, after
+ * which the done index frees their slots. The producer never writes to a slot
+ * until it is free, and a slot is never kept by an event the consumer is still
+ * reading, so dropping the oldest event only waits for a claim to finish.
+ * Both sides only take the lock when they have to sleep. */
+
+/* Helper Functions */
+
+static void deadline_after(struct timespec *deadline, double timeout) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    time_t seconds = (time_t)timeout;
+    deadline->tv_sec += seconds;
+    deadline->tv_nsec += (long)((timeout - (double)seconds) * 1e9);
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return;
+}
+
+static void wake(WatchfulQueue *queue) {
+    if (0 == __atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST)) return;
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return;
+}
+
+static bool is_empty(WatchfulQueue *queue) {
+    return __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+}
+
+static bool is_full(WatchfulQueue *queue) {
+    return queue->head - __atomic_load_n(&queue->done, __ATOMIC_SEQ_CST) >= queue->cap;
+}
+
+static bool wait_until(WatchfulQueue *queue, bool (*blocked)(WatchfulQueue *), double timeout, struct timespec *deadline) {
+    /* Returns false if the wait timed out or the queue was closed */
+    bool ready = true;
+    pthread_mutex_lock(&queue->lock);
+    __atomic_add_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    while (blocked(queue)) {
+        if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST) || 0 == timeout) {
+            ready = false;
+            break;
+        }
+        if (timeout < 0) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        } else if (ETIMEDOUT == pthread_cond_timedwait(&queue->cond, &queue->lock, deadline)) {
+            ready = !blocked(queue);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+    return ready;
+}
+
+static int write_slot(WatchfulQueue *queue, size_t slot, int type, time_t at, const char *path, const char *old_path) {
+    size_t path_len = strlen(path) + 1;
+    size_t old_path_len = (NULL == old_path) ? 0 : strlen(old_path) + 1;
+
+    if (queue->bufs_len[slot] < path_len + old_path_len) {
+        char *buf = realloc(queue->bufs[slot], sizeof(char) * (path_len + old_path_len));
+        if (NULL == buf) return 1;
+        queue->bufs[slot] = buf;
+        queue->bufs_len[slot] = path_len + old_path_len;
+    }
+
+    WatchfulEvent *event = &queue->events[slot];
+    event->type = type;
+    event->at = at;
+    event->path = memcpy(queue->bufs[slot], path, path_len);
+    event->old_path = (NULL == old_path) ? NULL : memcpy(queue->bufs[slot] + path_len, old_path, old_path_len);
+
+    return 0;
+}
+
+static size_t claim(WatchfulQueue *queue, size_t max) {
+    size_t tail, head;
+    do {
+        tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+        if (tail == head) return 0;
+        if (head - tail > max) head = tail + max;
+    } while (!__atomic_compare_exchange_n(&queue->tail, &tail, head, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    /* The events keep pointing into their buffers as those change hands */
+    for (size_t i = tail; i < head; i++) {
+        size_t slot = i & (queue->cap - 1);
+        char *buf = queue->held_bufs[i - tail];
+        size_t buf_len = queue->held_bufs_len[i - tail];
+        queue->held[i - tail] = queue->events[slot];
+        queue->held_bufs[i - tail] = queue->bufs[slot];
+        queue->held_bufs_len[i - tail] = queue->bufs_len[slot];
+        queue->bufs[slot] = buf;
+        queue->bufs_len[slot] = buf_len;
+    }
+
+    __atomic_store_n(&queue->done, head, __ATOMIC_SEQ_CST);
+    wake(queue);
+
+    return head - tail;
+}
+
+/* Queue Functions */
+
+WatchfulQueue *watchful_queue_create(size_t cap, int policy, const char *path) {
+    WatchfulQueue *queue = calloc(1, sizeof(WatchfulQueue));
+    if (NULL == queue) return NULL;
+
+    size_t pow2 = 2;
+    while (pow2 < cap) pow2 *= 2;
+
+    queue->cap = pow2;
+    queue->policy = policy;
+    queue->path = path;
+
+    queue->events = calloc(queue->cap, sizeof(WatchfulEvent));
+    if (NULL == queue->events) goto error;
+    queue->bufs = calloc(queue->cap, sizeof(char *));
+    if (NULL == queue->bufs) goto error;
+    queue->bufs_len = calloc(queue->cap, sizeof(size_t));
+    if (NULL == queue->bufs_len) goto error;
+    queue->held = calloc(queue->cap, sizeof(WatchfulEvent));
+    if (NULL == queue->held) goto error;
+    queue->held_bufs = calloc(queue->cap, sizeof(char *));
+    if (NULL == queue->held_bufs) goto error;
+    queue->held_bufs_len = calloc(queue->cap, sizeof(size_t));
+    if (NULL == queue->held_bufs_len) goto error;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+
+    return queue;
+
+error:
+    free(queue->events);
+    free(queue->bufs);
+    free(queue->bufs_len);
+    free(queue->held);
+    free(queue->held_bufs);
+    free(queue->held_bufs_len);
+    free(queue);
+    return NULL;
+}
+
+void watchful_queue_destroy(WatchfulQueue *queue) {
+    if (NULL == queue) return;
+    for (size_t i = 0; i < queue->cap; i++) {
+        free(queue->bufs[i]);
+        free(queue->held_bufs[i]);
+    }
+    free(queue->events);
+    free(queue->bufs);
+    free(queue->bufs_len);
+    free(queue->held);
+    free(queue->held_bufs);
+    free(queue->held_bufs_len);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+    return;
+}
+
+void watchful_queue_open(WatchfulQueue *queue) {
+    __atomic_store_n(&queue->closed, false, __ATOMIC_SEQ_CST);
+    return;
+}
+
+void watchful_queue_close(WatchfulQueue *queue) {
+    /* Wakes both sides so a blocked producer cannot hold up stopping */
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&queue->closed, true, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return;
+}
+
+int watchful_queue_push(WatchfulQueue *queue, const WatchfulEvent *event) {
+    /* With the overflow policy the last free slot is kept for the marker */
+    size_t reserved = (queue->policy == WATCHFUL_QUEUE_OVERFLOW) ? 1 : 0;
+
+    while (queue->head - __atomic_load_n(&queue->done, __ATOMIC_SEQ_CST) + reserved >= queue->cap) {
+        if (queue->policy == WATCHFUL_QUEUE_BLOCK) {
+            if (wait_until(queue, is_full, -1, NULL)) continue;
+        } else if (queue->policy == WATCHFUL_QUEUE_DROP_OLDEST) {
+            /* The ring is full of events the consumer has not claimed, or
+             * it is moving some out and the oldest left is dropped after */
+            size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+            size_t done = __atomic_load_n(&queue->done, __ATOMIC_SEQ_CST);
+            if (tail == done && __atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                __atomic_compare_exchange_n(&queue->done, &done, tail + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+            }
+            continue;
+        } else if (!queue->overflowed) {
+            /* The consumer learns of dropped events before any that follow */
+            size_t slot = queue->head & (queue->cap - 1);
+            int err = write_slot(queue, slot, WATCHFUL_EVENT_OVERFLOW, event->at, queue->path, NULL);
+            if (err) return 1;
+            __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_SEQ_CST);
+            queue->overflowed = true;
+            wake(queue);
+        }
+        __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    size_t slot = queue->head & (queue->cap - 1);
+    int err = write_slot(queue, slot, event->type, event->at, event->path, event->old_path);
+    if (err) return 1;
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_SEQ_CST);
+    queue->overflowed = false;
+    wake(queue);
+
+    return 0;
+}
+
+const WatchfulEvent *watchful_queue_poll(WatchfulQueue *queue, double timeout) {
+    /* The event returned stays valid until the next poll or drain */
+    struct timespec deadline;
+    if (timeout > 0) deadline_after(&deadline, timeout);
+
+    while (1) {
+        if (claim(queue, 1)) return &queue->held[0];
+        if (!wait_until(queue, is_empty, timeout, &deadline)) return NULL;
+    }
+}
+
+size_t watchful_queue_drain(WatchfulQueue *queue, WatchfulBatchCallback cb, void *info, double timeout) {
+    struct timespec deadline;
+    if (timeout > 0) deadline_after(&deadline, timeout);
+    if (is_empty(queue) && !wait_until(queue, is_empty, timeout, &deadline)) return 0;
+
+    size_t len = claim(queue, queue->cap);
+    if (len) cb(queue->held, len, info);
+
+    return len;
+}
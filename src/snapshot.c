@@ -0,0 +1,1157 @@
+#include "watchful.h"
+
+/* A snapshot records the inode, size and modification time of each entry
+ * beneath a monitor's path. It is kept up to date from the events that are
+ * delivered so that, when events have been lost, a fresh scan of the tree can
+ * be compared with it to work out what was missed. Entries are kept in a
+ * table keyed by the hash of their path; entries whose hashes collide are
+ * chained. Each entry records the generation in which it was last changed by
+ * an event so that a comparison can leave alone entries that changed while
+ * the scan was running. */
+
+typedef struct SnapshotScan {
+    WatchfulSnapshot *snapshot;
+    WatchfulMonitor *wm;
+} SnapshotScan;
+
+/* Helper Functions */
+
+static int64_t mtime_of(struct stat *st) {
+#if defined(MACOS)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static const char *root_of(WatchfulSnapshot *snapshot, WatchfulMonitor *wm) {
+    /* A snapshot can cover a subtree rather than the whole of the monitor */
+    return (NULL == snapshot->root) ? wm->path : snapshot->root;
+}
+
+static int64_t stamp_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static WatchfulSnapshotEntry *entry_create(const char *path, struct stat *st) {
+    size_t path_len = strlen(path);
+    WatchfulSnapshotEntry *entry = malloc(sizeof(WatchfulSnapshotEntry) + path_len + 1);
+    if (NULL == entry) return NULL;
+    memcpy(entry->path, path, path_len + 1);
+    entry->hash = watchful_path_hash(path);
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = mtime_of(st);
+    entry->is_dir = S_ISDIR(st->st_mode);
+    entry->gen = 0;
+    entry->scanned = 0;
+    entry->next = NULL;
+    return entry;
+}
+
+static WatchfulSnapshotEntry *entry_find(WatchfulSnapshot *snapshot, const char *path) {
+    WatchfulSnapshotEntry *entry = watchful_table_get(&snapshot->entries, watchful_path_hash(path));
+    while (NULL != entry && strcmp(entry->path, path)) entry = entry->next;
+    return entry;
+}
+
+static int entry_insert(WatchfulSnapshot *snapshot, WatchfulSnapshotEntry *entry) {
+    WatchfulSnapshotEntry *head = watchful_table_get(&snapshot->entries, entry->hash);
+    entry->next = head;
+    int err = watchful_table_put(&snapshot->entries, entry->hash, entry);
+    if (err) {
+        entry->next = NULL;
+        return 1;
+    }
+    snapshot->len++;
+    return 0;
+}
+
+static WatchfulSnapshotEntry *entry_unlink(WatchfulSnapshot *snapshot, WatchfulSnapshotEntry *entry) {
+    WatchfulSnapshotEntry *head = watchful_table_get(&snapshot->entries, entry->hash);
+    if (head == entry) {
+        if (NULL == entry->next) watchful_table_remove(&snapshot->entries, entry->hash);
+        else watchful_table_put(&snapshot->entries, entry->hash, entry->next);
+    } else {
+        WatchfulSnapshotEntry *prev = head;
+        while (NULL != prev && prev->next != entry) prev = prev->next;
+        if (NULL == prev) return NULL;
+        prev->next = entry->next;
+    }
+    entry->next = NULL;
+    snapshot->len--;
+    return entry;
+}
+
+static bool entry_differs(WatchfulSnapshotEntry *entry, WatchfulSnapshotEntry *scanned) {
+    /* A directory's times change with its contents so only its inode counts */
+    if (entry->ino != scanned->ino || entry->is_dir != scanned->is_dir) return true;
+    if (entry->is_dir) return false;
+    return entry->size != scanned->size || entry->mtime != scanned->mtime;
+}
+
+static size_t entries_with_prefix(WatchfulSnapshot *snapshot, const char *prefix, WatchfulSnapshotEntry ***found) {
+    /* Entries are gathered first as unlinking them reorders the table */
+    size_t len = 0;
+    size_t max = 0;
+    *found = NULL;
+    for (size_t i = 0; i < snapshot->entries.cap; i++) {
+        for (WatchfulSnapshotEntry *entry = snapshot->entries.entries[i].value; NULL != entry; entry = entry->next) {
+            if (!watchful_path_is_prefixed(entry->path, prefix)) continue;
+            if (len == max) {
+                max = (0 == max) ? 16 : max * 2;
+                WatchfulSnapshotEntry **grown = realloc(*found, sizeof(WatchfulSnapshotEntry *) * max);
+                if (NULL == grown) return len;
+                *found = grown;
+            }
+            (*found)[len++] = entry;
+        }
+    }
+    return len;
+}
+
+static void forget(WatchfulSnapshot *snapshot, const char *path) {
+    WatchfulSnapshotEntry *entry = entry_find(snapshot, path);
+    if (NULL != entry) free(entry_unlink(snapshot, entry));
+
+    /* A deleted directory takes everything beneath it */
+    size_t path_len = strlen(path);
+    if (0 == path_len || path[path_len - 1] != '/') return;
+    WatchfulSnapshotEntry **found = NULL;
+    size_t found_len = entries_with_prefix(snapshot, path, &found);
+    for (size_t i = 0; i < found_len; i++) free(entry_unlink(snapshot, found[i]));
+    free(found);
+    return;
+}
+
+static void refresh(WatchfulSnapshot *snapshot, const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        forget(snapshot, path);
+        return;
+    }
+
+    WatchfulSnapshotEntry *entry = entry_find(snapshot, path);
+    if (NULL == entry) {
+        entry = entry_create(path, &st);
+        if (NULL == entry) return;
+        if (entry_insert(snapshot, entry)) {
+            free(entry);
+            return;
+        }
+    } else {
+        entry->ino = st.st_ino;
+        entry->size = st.st_size;
+        entry->mtime = mtime_of(&st);
+        entry->is_dir = S_ISDIR(st.st_mode);
+    }
+    entry->gen = snapshot->gen;
+    return;
+}
+
+static void touch_parent(WatchfulSnapshot *snapshot, const char *path) {
+    /* Entries coming and going change their directory's time */
+    size_t len = strlen(path);
+    if (len && path[len - 1] == '/') len--;
+    while (len && path[len - 1] != '/') len--;
+    if (0 == len || len >= PATH_MAX) return;
+
+    char dir[PATH_MAX];
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    WatchfulSnapshotEntry *entry = entry_find(snapshot, dir);
+    if (NULL != entry) refresh(snapshot, dir);
+    return;
+}
+
+static void move(WatchfulSnapshot *snapshot, const char *old_path, const char *path) {
+    /* Entries beneath a renamed directory are moved with it */
+    size_t old_len = strlen(old_path);
+    size_t path_len = strlen(path);
+    WatchfulSnapshotEntry **found = NULL;
+    size_t found_len = entries_with_prefix(snapshot, old_path, &found);
+    for (size_t i = 0; i < found_len; i++) {
+        WatchfulSnapshotEntry *entry = entry_unlink(snapshot, found[i]);
+        if (NULL == entry) continue;
+        if (strcmp(entry->path, old_path) && old_path[old_len - 1] != '/') {
+            /* A file's path only prefixes its siblings by accident */
+            entry_insert(snapshot, entry);
+            continue;
+        }
+        size_t rest_len = strlen(entry->path) - old_len;
+        WatchfulSnapshotEntry *moved = malloc(sizeof(WatchfulSnapshotEntry) + path_len + rest_len + 1);
+        if (NULL == moved) {
+            free(entry);
+            continue;
+        }
+        *moved = *entry;
+        memcpy(moved->path, path, path_len);
+        memcpy(moved->path + path_len, entry->path + old_len, rest_len + 1);
+        moved->hash = watchful_path_hash(moved->path);
+        moved->gen = snapshot->gen;
+        free(entry);
+        if (entry_insert(snapshot, moved)) free(moved);
+    }
+    free(found);
+    refresh(snapshot, path);
+    return;
+}
+
+static WatchfulSnapshotEntry *entry_for_crawled(const WatchfulCrawlEntry *crawled, struct stat *st) {
+    /* Symbolic links are recorded as links, so a link to a directory loses
+     * the separator the crawl gave it */
+    if (!S_ISLNK(st->st_mode) || !crawled->is_dir) return entry_create(crawled->path, st);
+
+    size_t path_len = strlen(crawled->path) - 1;
+    if (path_len >= PATH_MAX) return NULL;
+    char path[PATH_MAX];
+    memcpy(path, crawled->path, path_len);
+    path[path_len] = '\0';
+    return entry_create(path, st);
+}
+
+static int scan_visit(void *info, const WatchfulCrawlEntry *crawled, void **ctx) {
+    SnapshotScan *scan = info;
+    if (watchful_monitor_excludes_path(scan->wm, crawled->path)) return 0;
+
+    struct stat st;
+    if (fstatat(crawled->dir_fd, crawled->name, &st, AT_SYMLINK_NOFOLLOW) == -1) return 0;
+
+    WatchfulSnapshotEntry *entry = entry_for_crawled(crawled, &st);
+    if (NULL == entry) return 1;
+    bool is_dir = entry->is_dir;
+
+    pthread_mutex_lock(&scan->snapshot->lock);
+    int err = entry_insert(scan->snapshot, entry);
+    pthread_mutex_unlock(&scan->snapshot->lock);
+    if (err) {
+        free(entry);
+        return 1;
+    }
+
+    /* Any non-NULL context has the crawl descend (links are not followed
+     * so that the snapshot cannot loop) */
+    if (is_dir) *ctx = scan;
+
+    return 0;
+}
+
+static int change_add(WatchfulEvent **changes, size_t *len, size_t *max, int type, const char *path) {
+    if (*len == *max) {
+        size_t grown_max = (0 == *max) ? 16 : *max * 2;
+        WatchfulEvent *grown = realloc(*changes, sizeof(WatchfulEvent) * grown_max);
+        if (NULL == grown) return 1;
+        *changes = grown;
+        *max = grown_max;
+    }
+
+    size_t path_len = strlen(path);
+    char *copy = malloc(sizeof(char) * (path_len + 1));
+    if (NULL == copy) return 1;
+    memcpy(copy, path, path_len + 1);
+
+    WatchfulEvent *change = &(*changes)[(*len)++];
+    change->type = type;
+    change->at = time(NULL);
+    change->path = copy;
+    change->old_path = NULL;
+
+    return 0;
+}
+
+static int change_order(const void *a, const void *b) {
+    /* Deletions come first and parents come before their children */
+    const WatchfulEvent *x = a;
+    const WatchfulEvent *y = b;
+    int x_first = x->type == WATCHFUL_EVENT_DELETED;
+    int y_first = y->type == WATCHFUL_EVENT_DELETED;
+    if (x_first != y_first) return y_first - x_first;
+    return strcmp(x->path, y->path);
+}
+
+static void entries_free(WatchfulSnapshot *snapshot) {
+    for (size_t i = 0; i < snapshot->entries.cap; i++) {
+        WatchfulSnapshotEntry *entry = snapshot->entries.entries[i].value;
+        while (NULL != entry) {
+            WatchfulSnapshotEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    return;
+}
+
+/* Snapshot Functions */
+
+WatchfulSnapshot *watchful_snapshot_create(void) {
+    WatchfulSnapshot *snapshot = malloc(sizeof(WatchfulSnapshot));
+    if (NULL == snapshot) return NULL;
+
+    int err = watchful_table_init(&snapshot->entries, 0);
+    if (err) {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->len = 0;
+    snapshot->gen = 0;
+    snapshot->stamp = 0;
+    snapshot->root = NULL;
+    pthread_mutex_init(&snapshot->lock, NULL);
+
+    return snapshot;
+}
+
+void watchful_snapshot_destroy(WatchfulSnapshot *snapshot) {
+    if (NULL == snapshot) return;
+
+    entries_free(snapshot);
+    watchful_table_deinit(&snapshot->entries);
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot->root);
+    free(snapshot);
+
+    return;
+}
+
+int watchful_snapshot_scan(WatchfulSnapshot *snapshot, WatchfulMonitor *wm) {
+    /* The scan stats every entry so it uses the crawl's pool of threads */
+    WatchfulCrawl crawl = {
+        .threads = wm->crawl.threads,
+        .visit_files = true,
+    };
+    SnapshotScan scan = {
+        .snapshot = snapshot,
+        .wm = wm,
+    };
+
+    snapshot->stamp = stamp_now();
+
+    /* The root is kept too as its time tells whether it has changed */
+    const char *root_path = root_of(snapshot, wm);
+    struct stat st;
+    if (stat(root_path, &st) == -1) return 1;
+    WatchfulSnapshotEntry *root = entry_create(root_path, &st);
+    if (NULL == root) return 1;
+    if (entry_insert(snapshot, root)) {
+        free(root);
+        return 1;
+    }
+
+    return watchful_crawl_run(&crawl, root_path, &scan, scan_visit, &scan);
+}
+
+uint64_t watchful_snapshot_begin(WatchfulSnapshot *snapshot) {
+    /* Entries changed by events from now on are newer than any scan */
+    pthread_mutex_lock(&snapshot->lock);
+    uint64_t since = ++snapshot->gen;
+    pthread_mutex_unlock(&snapshot->lock);
+    return since;
+}
+
+void watchful_snapshot_apply(WatchfulSnapshot *snapshot, const WatchfulEvent *events, size_t len) {
+    pthread_mutex_lock(&snapshot->lock);
+    for (size_t i = 0; i < len; i++) {
+        const WatchfulEvent *event = &events[i];
+        switch (event->type) {
+            case WATCHFUL_EVENT_CREATED:
+                refresh(snapshot, event->path);
+                touch_parent(snapshot, event->path);
+                break;
+            case WATCHFUL_EVENT_MODIFIED:
+                refresh(snapshot, event->path);
+                break;
+            case WATCHFUL_EVENT_DELETED:
+                forget(snapshot, event->path);
+                touch_parent(snapshot, event->path);
+                break;
+            case WATCHFUL_EVENT_RENAMED:
+                if (NULL == event->old_path) refresh(snapshot, event->path);
+                else move(snapshot, event->old_path, event->path);
+                if (NULL != event->old_path) touch_parent(snapshot, event->old_path);
+                touch_parent(snapshot, event->path);
+                break;
+            default:
+                break;
+        }
+    }
+    pthread_mutex_unlock(&snapshot->lock);
+    return;
+}
+
+int watchful_snapshot_diff(WatchfulSnapshot *snapshot, WatchfulSnapshot *scan, uint64_t since, WatchfulEvent **changes, size_t *changes_len) {
+    /* The scan is merged into the snapshot and the differences are returned
+     * as events whose paths the caller frees */
+    int err = 0;
+    size_t max = 0;
+    *changes = NULL;
+    *changes_len = 0;
+
+    pthread_mutex_lock(&snapshot->lock);
+
+    for (size_t i = 0; i < scan->entries.cap && !err; i++) {
+        WatchfulSnapshotEntry *scanned = scan->entries.entries[i].value;
+        while (NULL != scanned && !err) {
+            WatchfulSnapshotEntry *next = scanned->next;
+            WatchfulSnapshotEntry *entry = entry_find(snapshot, scanned->path);
+            struct stat st;
+            if (NULL == entry && lstat(scanned->path, &st) == -1) {
+                /* Deleted since it was scanned (and its event delivered) */
+                free(scanned);
+            } else if (NULL == entry) {
+                /* The entry is handed over to the snapshot */
+                scanned->gen = 0;
+                scanned->scanned = since;
+                scanned->next = NULL;
+                err = entry_insert(snapshot, scanned);
+                if (err) free(scanned);
+                if (!err) err = change_add(changes, changes_len, &max, WATCHFUL_EVENT_CREATED, scanned->path);
+            } else {
+                entry->scanned = since;
+                if (entry->gen < since && entry_differs(entry, scanned)) {
+                    entry->ino = scanned->ino;
+                    entry->size = scanned->size;
+                    entry->mtime = scanned->mtime;
+                    entry->is_dir = scanned->is_dir;
+                    err = change_add(changes, changes_len, &max, WATCHFUL_EVENT_MODIFIED, entry->path);
+                }
+                free(scanned);
+            }
+            scanned = next;
+        }
+        scan->entries.entries[i].value = NULL;
+        while (NULL != scanned) {
+            WatchfulSnapshotEntry *next = scanned->next;
+            free(scanned);
+            scanned = next;
+        }
+    }
+    watchful_table_clear(&scan->entries);
+    scan->len = 0;
+
+    /* Entries the scan did not find (and no event has touched) are gone */
+    WatchfulSnapshotEntry **gone = NULL;
+    size_t gone_len = 0;
+    size_t gone_max = 0;
+    for (size_t i = 0; i < snapshot->entries.cap && !err; i++) {
+        for (WatchfulSnapshotEntry *entry = snapshot->entries.entries[i].value; NULL != entry; entry = entry->next) {
+            if (entry->scanned == since || entry->gen >= since) continue;
+            if (gone_len == gone_max) {
+                gone_max = (0 == gone_max) ? 16 : gone_max * 2;
+                WatchfulSnapshotEntry **grown = realloc(gone, sizeof(WatchfulSnapshotEntry *) * gone_max);
+                if (NULL == grown) {
+                    err = 1;
+                    break;
+                }
+                gone = grown;
+            }
+            gone[gone_len++] = entry;
+        }
+    }
+    for (size_t i = 0; i < gone_len && !err; i++) {
+        err = change_add(changes, changes_len, &max, WATCHFUL_EVENT_DELETED, gone[i]->path);
+        free(entry_unlink(snapshot, gone[i]));
+    }
+    free(gone);
+
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (err) {
+        for (size_t i = 0; i < *changes_len; i++) free((*changes)[i].path);
+        free(*changes);
+        *changes = NULL;
+        *changes_len = 0;
+        return 1;
+    }
+
+    if (*changes_len) qsort(*changes, *changes_len, sizeof(WatchfulEvent), change_order);
+
+    return 0;
+}
+
+/* Persistence */
+
+/* A snapshot is saved as a header followed by fixed-size records and then
+ * the names of the entries. The records are ordered by depth and then by
+ * directory so that the children of each directory are contiguous and sorted
+ * by name. The root comes first and has its absolute path as its name. On
+ * restore, a directory whose inode and time are unchanged still has the same
+ * names in it, so only the entries already recorded for it are checked. The
+ * directories are shared out between threads. Entries whose times are close
+ * to when the snapshot was saved may have changed without their time
+ * changing, so they are always checked. */
+
+#define SNAPSHOT_MAGIC "WFSNAP01"
+#define SNAPSHOT_RACY 1000000000
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    int64_t stamp;
+    uint64_t records_len;
+    uint64_t names_len;
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    uint64_t name;
+    uint32_t parent;
+    uint32_t children;
+    uint32_t children_len;
+    uint32_t is_dir;
+} SnapshotRecord;
+
+typedef struct SnapshotOrder {
+    WatchfulSnapshotEntry *entry;
+    size_t depth;
+    size_t parent_len;
+    size_t name_len;
+} SnapshotOrder;
+
+typedef struct SnapshotFile {
+    void *map;
+    size_t size;
+    const SnapshotHeader *header;
+    const SnapshotRecord *records;
+    const char *names;
+} SnapshotFile;
+
+typedef struct SnapshotRestore {
+    WatchfulSnapshot *snapshot;
+    WatchfulMonitor *wm;
+    const char *root;
+    SnapshotFile file;
+    int64_t racy;
+    bool reports_racy;
+    uint64_t next;
+} SnapshotRestore;
+
+typedef struct SnapshotWorker {
+    SnapshotRestore *restore;
+    WatchfulEvent *changes;
+    size_t changes_len;
+    size_t changes_max;
+    int err;
+} SnapshotWorker;
+
+static int order_compare(const void *a, const void *b) {
+    /* Depth first, then the directory and then the name (without its
+     * separator) so that siblings end up together and sorted by name */
+    const SnapshotOrder *x = a;
+    const SnapshotOrder *y = b;
+    if (x->depth != y->depth) return (x->depth < y->depth) ? -1 : 1;
+
+    size_t len = (x->parent_len < y->parent_len) ? x->parent_len : y->parent_len;
+    int cmp = memcmp(x->entry->path, y->entry->path, len);
+    if (cmp) return cmp;
+    if (x->parent_len != y->parent_len) return (x->parent_len < y->parent_len) ? -1 : 1;
+
+    len = (x->name_len < y->name_len) ? x->name_len : y->name_len;
+    cmp = memcmp(x->entry->path + x->parent_len, y->entry->path + y->parent_len, len);
+    if (cmp) return cmp;
+    if (x->name_len != y->name_len) return (x->name_len < y->name_len) ? -1 : 1;
+    return 0;
+}
+
+static void order_init(SnapshotOrder *order, WatchfulSnapshotEntry *entry) {
+    size_t len = strlen(entry->path);
+    size_t end = (len && entry->path[len - 1] == '/') ? len - 1 : len;
+    size_t parent_len = end;
+    while (parent_len && entry->path[parent_len - 1] != '/') parent_len--;
+
+    size_t depth = 0;
+    for (size_t i = 0; i < parent_len; i++) {
+        if (entry->path[i] == '/') depth++;
+    }
+
+    order->entry = entry;
+    order->depth = depth;
+    order->parent_len = parent_len;
+    order->name_len = end - parent_len;
+    return;
+}
+
+static void file_close(SnapshotFile *file) {
+    if (NULL != file->map) munmap(file->map, file->size);
+    file->map = NULL;
+    file->size = 0;
+    return;
+}
+
+static int file_open(SnapshotFile *file, const char *path, const char *root) {
+    file->map = NULL;
+    file->size = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 1;
+    }
+    file->size = (size_t)st.st_size;
+    file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        return 1;
+    }
+
+    /* Nothing in the file is trusted until it has been checked */
+    file->header = file->map;
+    file->records = (const SnapshotRecord *)(file->header + 1);
+    uint64_t records_len = file->header->records_len;
+    uint64_t names_len = file->header->names_len;
+    if (memcmp(file->header->magic, SNAPSHOT_MAGIC, 8)) goto error;
+    if (0 == records_len || 0 == names_len) goto error;
+    if (records_len > (file->size - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)) goto error;
+    if (sizeof(SnapshotHeader) + records_len * sizeof(SnapshotRecord) + names_len != file->size) goto error;
+    file->names = (const char *)(file->records + records_len);
+    if (file->names[names_len - 1] != '\0') goto error;
+
+    for (uint64_t i = 0; i < records_len; i++) {
+        const SnapshotRecord *record = &file->records[i];
+        if (record->name >= names_len) goto error;
+        if (i && record->parent >= i) goto error;
+        if (record->children_len && (record->children <= i || (uint64_t)record->children + record->children_len > records_len)) goto error;
+    }
+    if (!file->records[0].is_dir || strcmp(file->names + file->records[0].name, root)) goto error;
+
+    return 0;
+
+error:
+    file_close(file);
+    return 1;
+}
+
+static char *record_path(const SnapshotFile *file, uint32_t index) {
+    /* The path of a directory is built from the names of its ancestors */
+    size_t len = 0;
+    for (uint32_t i = index;; i = file->records[i].parent) {
+        len += strlen(file->names + file->records[i].name) + ((i && file->records[i].is_dir) ? 1 : 0);
+        if (0 == i) break;
+    }
+
+    char *path = malloc(sizeof(char) * (len + 1));
+    if (NULL == path) return NULL;
+    path[len] = '\0';
+
+    size_t pos = len;
+    for (uint32_t i = index;; i = file->records[i].parent) {
+        const char *name = file->names + file->records[i].name;
+        size_t name_len = strlen(name);
+        if (i && file->records[i].is_dir) path[--pos] = '/';
+        pos -= name_len;
+        memcpy(path + pos, name, name_len);
+        if (0 == i) break;
+    }
+
+    return path;
+}
+
+static char *child_path(const char *dir_path, const char *name, bool is_dir) {
+    size_t dir_len = strlen(dir_path);
+    size_t name_len = strlen(name);
+    char *path = malloc(sizeof(char) * (dir_len + name_len + 2));
+    if (NULL == path) return NULL;
+    memcpy(path, dir_path, dir_len);
+    memcpy(path + dir_len, name, name_len);
+    if (is_dir) path[dir_len + name_len++] = '/';
+    path[dir_len + name_len] = '\0';
+    return path;
+}
+
+static const SnapshotRecord *child_find(const SnapshotFile *file, const SnapshotRecord *dir, const char *name) {
+    size_t lo = dir->children;
+    size_t hi = (size_t)dir->children + dir->children_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(file->names + file->records[mid].name, name);
+        if (0 == cmp) return &file->records[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static int restore_add(SnapshotWorker *worker, const char *path, struct stat *st) {
+    WatchfulSnapshotEntry *entry = entry_create(path, st);
+    if (NULL == entry) return 1;
+
+    WatchfulSnapshot *snapshot = worker->restore->snapshot;
+    pthread_mutex_lock(&snapshot->lock);
+    int err = entry_insert(snapshot, entry);
+    pthread_mutex_unlock(&snapshot->lock);
+    if (err) free(entry);
+
+    return err;
+}
+
+static int restore_visit(void *info, const WatchfulCrawlEntry *crawled, void **ctx) {
+    /* Everything beneath a new directory is new */
+    SnapshotWorker *worker = info;
+    if (watchful_monitor_excludes_path(worker->restore->wm, crawled->path)) return 0;
+
+    struct stat st;
+    if (fstatat(crawled->dir_fd, crawled->name, &st, AT_SYMLINK_NOFOLLOW) == -1) return 0;
+    WatchfulSnapshotEntry *entry = entry_for_crawled(crawled, &st);
+    if (NULL == entry) return 1;
+    int err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_CREATED, entry->path);
+    if (!err && entry->is_dir) *ctx = worker;
+
+    WatchfulSnapshot *snapshot = worker->restore->snapshot;
+    pthread_mutex_lock(&snapshot->lock);
+    if (!err) err = entry_insert(snapshot, entry);
+    pthread_mutex_unlock(&snapshot->lock);
+    if (err) free(entry);
+
+    return err;
+}
+
+static int restore_created(SnapshotWorker *worker, int dir_fd, const char *dir_path, const char *name) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) return 0;
+
+    bool is_dir = S_ISDIR(st.st_mode);
+    char *path = child_path(dir_path, name, is_dir);
+    if (NULL == path) return 1;
+
+    int err = 0;
+    if (watchful_monitor_excludes_path(worker->restore->wm, path)) goto done;
+
+    err = restore_add(worker, path, &st);
+    if (!err) err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_CREATED, path);
+    if (!err && is_dir) {
+        WatchfulCrawl crawl = {
+            .threads = 1,
+            .visit_files = true,
+        };
+        err = watchful_crawl_run(&crawl, path, worker, restore_visit, worker);
+    }
+
+done:
+    free(path);
+    return err;
+}
+
+static int restore_child(SnapshotWorker *worker, int dir_fd, const char *dir_path, const SnapshotRecord *record) {
+    SnapshotRestore *restore = worker->restore;
+    const char *name = restore->file.names + record->name;
+
+    char *path = child_path(dir_path, name, record->is_dir);
+    if (NULL == path) return 1;
+
+    int err = 0;
+    if (watchful_monitor_excludes_path(restore->wm, path)) goto done;
+
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_DELETED, path);
+        goto done;
+    }
+
+    /* A file that became a directory (or the reverse), or a directory that
+     * was replaced by another, is a new entry */
+    bool is_dir = S_ISDIR(st.st_mode);
+    if (is_dir != (bool)record->is_dir || (is_dir && st.st_ino != record->ino)) {
+        err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_DELETED, path);
+        if (!err) err = restore_created(worker, dir_fd, dir_path, name);
+        goto done;
+    }
+
+    bool changed = !is_dir && (st.st_ino != record->ino || st.st_size != record->size || mtime_of(&st) != record->mtime);
+    if (!is_dir && restore->reports_racy) changed = changed || record->mtime >= restore->racy;
+    err = restore_add(worker, path, &st);
+    if (!err && changed) err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_MODIFIED, path);
+
+done:
+    free(path);
+    return err;
+}
+
+static bool restore_is_replaced(const SnapshotFile *file, uint32_t index, int fd, const struct stat *st) {
+    /* A directory is new if it or any directory above it (short of the root)
+     * is not the one in the snapshot, as its parent reported it created */
+    if (0 == index) return false;
+    if (st->st_ino != file->records[index].ino) return true;
+
+    char up[PATH_MAX];
+    size_t len = 0;
+    for (uint32_t i = file->records[index].parent; 0 != i; i = file->records[i].parent) {
+        if (len + 4 > sizeof(up)) break;
+        memcpy(up + len, "../", 4);
+        len += 3;
+        struct stat above;
+        if (fstatat(fd, up, &above, 0) == -1 || above.st_ino != file->records[i].ino) return true;
+    }
+
+    return false;
+}
+
+static int restore_dir(SnapshotWorker *worker, uint32_t index) {
+    SnapshotRestore *restore = worker->restore;
+    const SnapshotFile *file = &restore->file;
+    const SnapshotRecord *dir = &file->records[index];
+    int err = 0;
+    int fd = -1;
+    bool *seen = NULL;
+
+    char *dir_path = record_path(file, index);
+    if (NULL == dir_path) return 1;
+    if (index && watchful_monitor_excludes_path(restore->wm, dir_path)) goto done;
+
+    /* The directory itself was checked with its parent; if it has gone (or
+     * is no longer a directory, or was replaced), so has everything in it */
+    size_t dir_len = strlen(dir_path);
+    if (index) dir_path[dir_len - 1] = '\0';
+    fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (index ? O_NOFOLLOW : 0));
+    dir_path[dir_len - 1] = '/';
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == -1) goto done;
+    if (fd == -1 || restore_is_replaced(file, index, fd, &st)) {
+        for (uint32_t i = 0; i < dir->children_len && !err; i++) {
+            const SnapshotRecord *child = &file->records[dir->children + i];
+            char *path = child_path(dir_path, file->names + child->name, child->is_dir);
+            if (NULL == path) {
+                err = 1;
+                break;
+            }
+            if (!watchful_monitor_excludes_path(restore->wm, path)) {
+                err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_DELETED, path);
+            }
+            free(path);
+        }
+        goto done;
+    }
+
+    bool is_same = st.st_ino == dir->ino && mtime_of(&st) == dir->mtime && dir->mtime < restore->racy;
+    if (is_same) {
+        for (uint32_t i = 0; i < dir->children_len && !err; i++) {
+            err = restore_child(worker, fd, dir_path, &file->records[dir->children + i]);
+        }
+        goto done;
+    }
+
+    /* Names may have come and gone so the directory is read again */
+    seen = calloc(dir->children_len + 1, sizeof(bool));
+    int dup_fd = dup(fd);
+    DIR *dirp = (NULL == seen || dup_fd == -1) ? NULL : fdopendir(dup_fd);
+    if (NULL == dirp) {
+        if (dup_fd != -1) close(dup_fd);
+        err = 1;
+        goto done;
+    }
+    struct dirent *entry;
+    while (!err && (entry = readdir(dirp))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        const SnapshotRecord *child = child_find(file, dir, entry->d_name);
+        if (NULL == child) {
+            err = restore_created(worker, fd, dir_path, entry->d_name);
+        } else {
+            seen[child - (file->records + dir->children)] = true;
+            err = restore_child(worker, fd, dir_path, child);
+        }
+    }
+    closedir(dirp);
+    for (uint32_t i = 0; i < dir->children_len && !err; i++) {
+        if (seen[i]) continue;
+        const SnapshotRecord *child = &file->records[dir->children + i];
+        char *path = child_path(dir_path, file->names + child->name, child->is_dir);
+        if (NULL == path) {
+            err = 1;
+            break;
+        }
+        if (!watchful_monitor_excludes_path(restore->wm, path)) {
+            err = change_add(&worker->changes, &worker->changes_len, &worker->changes_max, WATCHFUL_EVENT_DELETED, path);
+        }
+        free(path);
+    }
+
+done:
+    free(seen);
+    if (fd != -1) close(fd);
+    free(dir_path);
+    return err;
+}
+
+static void *restore_worker(void *arg) {
+    SnapshotWorker *worker = arg;
+    SnapshotRestore *restore = worker->restore;
+    uint64_t records_len = restore->file.header->records_len;
+
+    while (!worker->err) {
+        uint64_t index = __atomic_fetch_add(&restore->next, 1, __ATOMIC_RELAXED);
+        if (index >= records_len) break;
+        if (!restore->file.records[index].is_dir) continue;
+        worker->err = restore_dir(worker, (uint32_t)index);
+    }
+
+    return NULL;
+}
+
+static int image_create(SnapshotFile *file, WatchfulSnapshot *snapshot, const char *root, int64_t stamp, int fd) {
+    /* The image is written to the file if there is one and otherwise kept in
+     * memory; either way it is read back like a saved file */
+    int err = 0;
+    void *map = MAP_FAILED;
+    size_t size = 0;
+    SnapshotOrder *order = NULL;
+    WatchfulTable dirs = {0};
+
+    pthread_mutex_lock(&snapshot->lock);
+
+    size_t len = 0;
+    order = malloc(sizeof(SnapshotOrder) * (snapshot->len + 1));
+    if (NULL == order) goto error;
+    for (size_t i = 0; i < snapshot->entries.cap; i++) {
+        for (WatchfulSnapshotEntry *entry = snapshot->entries.entries[i].value; NULL != entry; entry = entry->next) {
+            if (len == snapshot->len) break;
+            order_init(&order[len++], entry);
+        }
+    }
+    qsort(order, len, sizeof(SnapshotOrder), order_compare);
+    if (0 == len || strcmp(order[0].entry->path, root) || (len > 1 && order[1].depth == order[0].depth)) goto error;
+    if (len > UINT32_MAX) goto error;
+
+    /* Directories are looked up by path to find the parents of entries */
+    err = watchful_table_init(&dirs, 0);
+    if (err) goto error;
+    size_t names_len = strlen(root) + 1;
+    for (size_t i = 1; i < len; i++) names_len += order[i].name_len + 1;
+
+    size = sizeof(SnapshotHeader) + sizeof(SnapshotRecord) * len + names_len;
+    if (fd == -1) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else if (ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) goto error;
+
+    SnapshotHeader *header = map;
+    SnapshotRecord *records = (SnapshotRecord *)(header + 1);
+    char *names = (char *)(records + len);
+    memcpy(header->magic, SNAPSHOT_MAGIC, 8);
+    header->stamp = stamp;
+    header->records_len = len;
+    header->names_len = names_len;
+
+    size_t name_pos = 0;
+    for (size_t i = 0; i < len; i++) {
+        WatchfulSnapshotEntry *entry = order[i].entry;
+        SnapshotRecord *record = &records[i];
+        record->ino = (uint64_t)entry->ino;
+        record->size = (int64_t)entry->size;
+        record->mtime = entry->mtime;
+        record->is_dir = entry->is_dir;
+        record->children = 0;
+        record->children_len = 0;
+        record->parent = 0;
+
+        record->name = name_pos;
+        const char *name = (0 == i) ? entry->path : entry->path + order[i].parent_len;
+        size_t name_len = (0 == i) ? strlen(entry->path) : order[i].name_len;
+        memcpy(names + name_pos, name, name_len);
+        names[name_pos + name_len] = '\0';
+        name_pos += name_len + 1;
+
+        if (entry->is_dir) {
+            err = watchful_table_put(&dirs, entry->hash, (void *)(uintptr_t)(i + 1));
+            if (err) goto error;
+        }
+        if (0 == i) continue;
+
+        /* Entries whose directory is not recorded are left out */
+        char parent[PATH_MAX];
+        if (order[i].parent_len >= PATH_MAX) continue;
+        memcpy(parent, entry->path, order[i].parent_len);
+        parent[order[i].parent_len] = '\0';
+        uintptr_t found = (uintptr_t)watchful_table_get(&dirs, watchful_path_hash(parent));
+        if (0 == found || strcmp(order[found - 1].entry->path, parent)) continue;
+        record->parent = (uint32_t)(found - 1);
+        SnapshotRecord *dir = &records[found - 1];
+        if (0 == dir->children_len) dir->children = (uint32_t)i;
+        if (dir->children + dir->children_len == i) dir->children_len++;
+    }
+
+    pthread_mutex_unlock(&snapshot->lock);
+
+    watchful_table_deinit(&dirs);
+    free(order);
+
+    file->map = map;
+    file->size = size;
+    file->header = header;
+    file->records = records;
+    file->names = names;
+
+    return 0;
+
+error:
+    pthread_mutex_unlock(&snapshot->lock);
+    if (map != MAP_FAILED) munmap(map, size);
+    watchful_table_deinit(&dirs);
+    free(order);
+    file->map = NULL;
+    file->size = 0;
+    return 1;
+}
+
+static int restore_run(SnapshotRestore *restore, WatchfulEvent **changes, size_t *changes_len) {
+    /* The directories in the file are shared out between threads, with the
+     * calling thread as worker zero */
+    WatchfulMonitor *wm = restore->wm;
+    int err = 0;
+    *changes = NULL;
+    *changes_len = 0;
+    restore->racy = restore->file.header->stamp - SNAPSHOT_RACY;
+    restore->next = 0;
+
+    size_t threads = watchful_crawl_threads(wm->crawl.threads);
+    SnapshotWorker *workers = calloc(threads, sizeof(SnapshotWorker));
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if (NULL == workers || NULL == ids) goto error;
+
+    struct stat st;
+    if (stat(restore->root, &st) == -1) goto error;
+    for (size_t i = 0; i < threads; i++) workers[i].restore = restore;
+    if (restore_add(&workers[0], restore->root, &st)) goto error;
+
+    size_t started = 0;
+    for (size_t i = 1; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, restore_worker, &workers[i])) break;
+        started++;
+    }
+    restore_worker(&workers[0]);
+    for (size_t i = 1; i <= started; i++) pthread_join(ids[i], NULL);
+
+    size_t len = 0;
+    for (size_t i = 0; i < threads; i++) {
+        if (workers[i].err) err = 1;
+        len += workers[i].changes_len;
+    }
+    if (!err && len) {
+        *changes = malloc(sizeof(WatchfulEvent) * len);
+        if (NULL == *changes) err = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        if (!err && workers[i].changes_len) {
+            memcpy(*changes + *changes_len, workers[i].changes, sizeof(WatchfulEvent) * workers[i].changes_len);
+            *changes_len += workers[i].changes_len;
+        } else {
+            for (size_t j = 0; j < workers[i].changes_len; j++) free(workers[i].changes[j].path);
+        }
+        free(workers[i].changes);
+    }
+    if (err) goto error;
+
+    if (*changes_len) qsort(*changes, *changes_len, sizeof(WatchfulEvent), change_order);
+
+    free(workers);
+    free(ids);
+
+    return 0;
+
+error:
+    if (NULL != *changes) {
+        for (size_t i = 0; i < *changes_len; i++) free((*changes)[i].path);
+        free(*changes);
+    }
+    *changes = NULL;
+    *changes_len = 0;
+    free(workers);
+    free(ids);
+    return 1;
+}
+
+int watchful_snapshot_save(WatchfulSnapshot *snapshot, const char *root, const char *path, int64_t stamp) {
+    char *tmp_path = child_path(path, ".tmp", false);
+    if (NULL == tmp_path) return 1;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        free(tmp_path);
+        return 1;
+    }
+
+    SnapshotFile file;
+    int err = image_create(&file, snapshot, root, stamp, fd);
+
+    /* The file is replaced in one step so a crash leaves the old one */
+    if (!err) err = msync(file.map, file.size, MS_SYNC);
+    file_close(&file);
+    close(fd);
+    if (!err) err = rename(tmp_path, path);
+    if (err) unlink(tmp_path);
+    free(tmp_path);
+
+    return err ? 1 : 0;
+}
+
+int watchful_snapshot_restore(WatchfulSnapshot *snapshot, WatchfulMonitor *wm, const char *path, WatchfulEvent **changes, size_t *changes_len) {
+    /* Fails if there is no usable file, in which case nothing is changed */
+    *changes = NULL;
+    *changes_len = 0;
+
+    SnapshotRestore restore = {
+        .snapshot = snapshot,
+        .wm = wm,
+        .root = wm->path,
+        .reports_racy = true,
+    };
+    int64_t stamp = stamp_now();
+    int err = file_open(&restore.file, path, wm->path);
+    if (err) return 1;
+
+    err = restore_run(&restore, changes, changes_len);
+    file_close(&restore.file);
+    if (!err) snapshot->stamp = stamp;
+
+    return err;
+}
+
+int watchful_snapshot_refresh(WatchfulSnapshot *snapshot, WatchfulMonitor *wm, WatchfulEvent **changes, size_t *changes_len) {
+    /* The snapshot is imaged in memory and rebuilt from the tree the same way
+     * a saved file is restored, so directories that have not changed are not
+     * read again. It is only replaced if the whole tree could be compared. */
+    *changes = NULL;
+    *changes_len = 0;
+
+    WatchfulSnapshot *next = watchful_snapshot_create();
+    if (NULL == next) return 1;
+
+    SnapshotRestore restore = {
+        .snapshot = next,
+        .wm = wm,
+        .root = root_of(snapshot, wm),
+        .reports_racy = false,
+    };
+    int64_t stamp = stamp_now();
+    int err = image_create(&restore.file, snapshot, restore.root, snapshot->stamp, -1);
+    if (err) {
+        watchful_snapshot_destroy(next);
+        return 1;
+    }
+
+    err = restore_run(&restore, changes, changes_len);
+    file_close(&restore.file);
+    if (err) {
+        watchful_snapshot_destroy(next);
+        return 1;
+    }
+
+    pthread_mutex_lock(&snapshot->lock);
+    entries_free(snapshot);
+    watchful_table_deinit(&snapshot->entries);
+    snapshot->entries = next->entries;
+    snapshot->len = next->len;
+    snapshot->stamp = stamp;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    next->entries.entries = NULL;
+    next->entries.cap = 0;
+    next->entries.len = 0;
+    watchful_snapshot_destroy(next);
+
+    return 0;
+}
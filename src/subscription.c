@@ -0,0 +1,190 @@
+#include "watchful.h"
+
+/* Subscriptions share one monitor between consumers that each want a subtree
+ * of it and some types of event. They are indexed by a hash of the subtree's
+ * path, so an event is dispatched by looking up each directory above it (the
+ * hash is taken as the path is read) rather than by trying every subscriber.
+ * A subscriber sees an event once even if it is found through both paths of a
+ * rename. Overflows are given to every subscriber as they could affect any. */
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x100000001B3ULL
+
+/* Helper Functions */
+
+static char *prefix_create(const char *root, const char *path) {
+    /* The subtree is relative to the root unless absolute, and a trailing
+     * "**" for everything beneath is the same as the directory itself; any
+     * other pattern is refused as it would never match as a directory */
+    if (NULL == path) path = "";
+    size_t path_len = strlen(path);
+    bool is_wildstar = path_len >= 2 && !strcmp(path + path_len - 2, "**");
+    if (is_wildstar && (path_len == 2 || path[path_len - 3] == '/')) path_len -= 2;
+    for (size_t i = 0; i < path_len; i++) {
+        if (path[i] == '*' || path[i] == '?' || path[i] == '[' || path[i] == '\\') return NULL;
+    }
+    while (path_len && path[path_len - 1] == '/') path_len--;
+
+    size_t root_len = (path[0] == '/') ? 0 : strlen(root);
+    while (root_len && root[root_len - 1] == '/') root_len--;
+
+    char *prefix = malloc(sizeof(char) * (root_len + path_len + 3));
+    if (NULL == prefix) return NULL;
+
+    size_t len = 0;
+    memcpy(prefix, root, root_len);
+    len += root_len;
+    if (path_len && path[0] != '/') prefix[len++] = '/';
+    memcpy(prefix + len, path, path_len);
+    len += path_len;
+    prefix[len++] = '/';
+    prefix[len] = '\0';
+
+    return prefix;
+}
+
+static uint64_t prefix_hash(const char *prefix, size_t prefix_len) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < prefix_len; i++) {
+        hash ^= (unsigned char)prefix[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void notify(WatchfulSubscription *subscription, const WatchfulEvent *event, uint64_t stamp) {
+    if (subscription->seen == stamp) return;
+    subscription->seen = stamp;
+    subscription->callback(event, subscription->info);
+    return;
+}
+
+static void dispatch_path(WatchfulSubscriptions *subscriptions, const WatchfulEvent *event, const char *path, uint64_t stamp) {
+    /* Every directory above the path (and the path itself if a directory) is
+     * a prefix that can have subscribers */
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; path[i] && i < subscriptions->max_len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= FNV_PRIME;
+        if (path[i] != '/' || i + 1 < subscriptions->min_len) continue;
+
+        WatchfulSubscription *subscription = watchful_table_get(&subscriptions->prefixes, hash);
+        for (; NULL != subscription; subscription = subscription->next) {
+            if (subscription->prefix_len != i + 1) continue;
+            if (memcmp(subscription->prefix, path, i + 1)) continue;
+            if (!(subscription->events & event->type)) continue;
+            notify(subscription, event, stamp);
+        }
+    }
+    return;
+}
+
+static void bounds_update(WatchfulSubscriptions *subscriptions) {
+    subscriptions->min_len = 0;
+    subscriptions->max_len = 0;
+    for (size_t i = 0; i < subscriptions->prefixes.cap; i++) {
+        WatchfulSubscription *subscription = subscriptions->prefixes.entries[i].value;
+        for (; NULL != subscription; subscription = subscription->next) {
+            if (0 == subscriptions->min_len || subscription->prefix_len < subscriptions->min_len) subscriptions->min_len = subscription->prefix_len;
+            if (subscription->prefix_len > subscriptions->max_len) subscriptions->max_len = subscription->prefix_len;
+        }
+    }
+    return;
+}
+
+/* Subscription Functions */
+
+void watchful_subscriptions_init(WatchfulSubscriptions *subscriptions) {
+    subscriptions->prefixes.len = 0;
+    subscriptions->prefixes.cap = 0;
+    subscriptions->prefixes.entries = NULL;
+    subscriptions->len = 0;
+    subscriptions->min_len = 0;
+    subscriptions->max_len = 0;
+    subscriptions->dispatched = 0;
+    return;
+}
+
+void watchful_subscriptions_deinit(WatchfulSubscriptions *subscriptions) {
+    for (size_t i = 0; i < subscriptions->prefixes.cap; i++) {
+        WatchfulSubscription *subscription = subscriptions->prefixes.entries[i].value;
+        while (NULL != subscription) {
+            WatchfulSubscription *next = subscription->next;
+            free(subscription->prefix);
+            free(subscription);
+            subscription = next;
+        }
+    }
+    watchful_table_deinit(&subscriptions->prefixes);
+    watchful_subscriptions_init(subscriptions);
+    return;
+}
+
+WatchfulSubscription *watchful_subscriptions_add(WatchfulSubscriptions *subscriptions, const char *root, const char *path, int events, WatchfulCallback cb, void *info) {
+    if (NULL == cb) return NULL;
+
+    WatchfulSubscription *subscription = malloc(sizeof(WatchfulSubscription));
+    if (NULL == subscription) return NULL;
+
+    subscription->prefix = prefix_create(root, path);
+    if (NULL == subscription->prefix) goto error;
+    subscription->prefix_len = strlen(subscription->prefix);
+    subscription->events = events;
+    subscription->callback = cb;
+    subscription->info = info;
+    subscription->seen = 0;
+
+    /* Subscribers to the same subtree (or a colliding one) are chained */
+    uint64_t hash = prefix_hash(subscription->prefix, subscription->prefix_len);
+    subscription->next = watchful_table_get(&subscriptions->prefixes, hash);
+    if (watchful_table_put(&subscriptions->prefixes, hash, subscription)) goto error;
+
+    subscriptions->len++;
+    if (0 == subscriptions->min_len || subscription->prefix_len < subscriptions->min_len) subscriptions->min_len = subscription->prefix_len;
+    if (subscription->prefix_len > subscriptions->max_len) subscriptions->max_len = subscription->prefix_len;
+
+    return subscription;
+
+error:
+    free(subscription->prefix);
+    free(subscription);
+    return NULL;
+}
+
+int watchful_subscriptions_remove(WatchfulSubscriptions *subscriptions, WatchfulSubscription *subscription) {
+    uint64_t hash = prefix_hash(subscription->prefix, subscription->prefix_len);
+    WatchfulSubscription *first = watchful_table_get(&subscriptions->prefixes, hash);
+
+    WatchfulSubscription **link = &first;
+    while (NULL != *link && *link != subscription) link = &(*link)->next;
+    if (NULL == *link) return 1;
+    *link = subscription->next;
+
+    if (NULL == first) watchful_table_remove(&subscriptions->prefixes, hash);
+    else if (watchful_table_put(&subscriptions->prefixes, hash, first)) return 1;
+
+    free(subscription->prefix);
+    free(subscription);
+    subscriptions->len--;
+    bounds_update(subscriptions);
+
+    return 0;
+}
+
+void watchful_subscriptions_dispatch(WatchfulSubscriptions *subscriptions, const WatchfulEvent *event) {
+    if (0 == subscriptions->len) return;
+    uint64_t stamp = ++subscriptions->dispatched;
+
+    if (event->type == WATCHFUL_EVENT_OVERFLOW) {
+        for (size_t i = 0; i < subscriptions->prefixes.cap; i++) {
+            WatchfulSubscription *subscription = subscriptions->prefixes.entries[i].value;
+            for (; NULL != subscription; subscription = subscription->next) notify(subscription, event, stamp);
+        }
+        return;
+    }
+
+    dispatch_path(subscriptions, event, event->path, stamp);
+    if (NULL != event->old_path) dispatch_path(subscriptions, event, event->old_path, stamp);
+
+    return;
+}
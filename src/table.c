@@ -0,0 +1,127 @@
+#include "watchful.h"
+
+/* Helper Functions */
+
+static size_t slot_for_key(const WatchfulTable *table, uint64_t key) {
+    /* Fibonacci hashing spreads sequential keys (e.g. watch descriptors) */
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (table->cap - 1);
+}
+
+static int resize(WatchfulTable *table, size_t cap) {
+    WatchfulTableEntry *entries = calloc(cap, sizeof(WatchfulTableEntry));
+    if (NULL == entries) return 1;
+
+    WatchfulTableEntry *old_entries = table->entries;
+    size_t old_cap = table->cap;
+
+    table->entries = entries;
+    table->cap = cap;
+    table->len = 0;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (NULL == old_entries[i].value) continue;
+        size_t slot = slot_for_key(table, old_entries[i].key);
+        while (NULL != table->entries[slot].value) slot = (slot + 1) & (table->cap - 1);
+        table->entries[slot] = old_entries[i];
+        table->len++;
+    }
+
+    free(old_entries);
+
+    return 0;
+}
+
+/* Table Functions */
+
+int watchful_table_init(WatchfulTable *table, size_t cap) {
+    size_t pow2 = 16;
+    while (pow2 < cap * 2) pow2 *= 2;
+
+    table->len = 0;
+    table->cap = pow2;
+    table->entries = calloc(table->cap, sizeof(WatchfulTableEntry));
+    if (NULL == table->entries) return 1;
+
+    return 0;
+}
+
+void watchful_table_deinit(WatchfulTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->len = 0;
+    table->cap = 0;
+    return;
+}
+
+void watchful_table_clear(WatchfulTable *table) {
+    /* Keeps the capacity so that refilling does not allocate */
+    if (table->len) memset(table->entries, 0, sizeof(WatchfulTableEntry) * table->cap);
+    table->len = 0;
+    return;
+}
+
+void *watchful_table_get(const WatchfulTable *table, uint64_t key) {
+    if (0 == table->cap) return NULL;
+    size_t slot = slot_for_key(table, key);
+    while (NULL != table->entries[slot].value) {
+        if (table->entries[slot].key == key) return table->entries[slot].value;
+        slot = (slot + 1) & (table->cap - 1);
+    }
+    return NULL;
+}
+
+int watchful_table_put(WatchfulTable *table, uint64_t key, void *value) {
+    if (NULL == value) return 1;
+
+    /* Keep the load factor at or below one half */
+    if ((table->len + 1) * 2 > table->cap) {
+        int err = resize(table, (0 == table->cap) ? 16 : table->cap * 2);
+        if (err) return 1;
+    }
+
+    size_t slot = slot_for_key(table, key);
+    while (NULL != table->entries[slot].value) {
+        if (table->entries[slot].key == key) {
+            table->entries[slot].value = value;
+            return 0;
+        }
+        slot = (slot + 1) & (table->cap - 1);
+    }
+
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->len++;
+
+    return 0;
+}
+
+void *watchful_table_remove(WatchfulTable *table, uint64_t key) {
+    if (0 == table->cap) return NULL;
+
+    size_t mask = table->cap - 1;
+    size_t slot = slot_for_key(table, key);
+    while (NULL != table->entries[slot].value && table->entries[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    if (NULL == table->entries[slot].value) return NULL;
+
+    void *value = table->entries[slot].value;
+
+    /* Shift later entries in the probe run back so no tombstones are needed */
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (NULL != table->entries[next].value) {
+        size_t home = slot_for_key(table, table->entries[next].key);
+        bool movable = (hole <= next) ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable) {
+            table->entries[hole] = table->entries[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->entries[hole].key = 0;
+    table->entries[hole].value = NULL;
+    table->len--;
+
+    return value;
+}
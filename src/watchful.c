@@ -22,10 +22,11 @@ static WatchfulExcludes *excludes_create(size_t paths_len, const char **paths) {
 
     excludes->paths = NULL;
     excludes->len = paths_len;
+    excludes->matcher = NULL;
 
     if (excludes->len == 0) return excludes;
 
-    excludes->paths = malloc(sizeof(char *) * paths_len);;
+    excludes->paths = calloc(paths_len, sizeof(char *));
     if (NULL == excludes->paths) goto error;
 
     for (size_t i = 0; i < excludes->len; i++) {
@@ -33,11 +34,17 @@ static WatchfulExcludes *excludes_create(size_t paths_len, const char **paths) {
         if (NULL == excludes->paths[i]) goto error;
     }
 
+    excludes->matcher = watchful_matcher_create(excludes->len, excludes->paths);
+    if (NULL == excludes->matcher) goto error;
+
     return excludes;
 
 error:
-    for (size_t i = 0; i < excludes->len; i++) {
-        if (NULL != excludes->paths[i]) free(excludes->paths[i]);
+    if (NULL != excludes->paths) {
+        for (size_t i = 0; i < excludes->len; i++) {
+            if (NULL != excludes->paths[i]) free(excludes->paths[i]);
+        }
+        free(excludes->paths);
     }
     free(excludes);
 
@@ -93,11 +100,39 @@ bool watchful_path_is_prefixed(const char *path, const char *prefix) {
     return strncmp(prefix, path, strlen(prefix)) == 0;
 }
 
+uint64_t watchful_path_hash(const char *path) {
+    /* FNV-1a */
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
 /* Monitor Functions */
 
 int watchful_monitor_init(WatchfulMonitor *wm, WatchfulBackend *backend, const char *path, size_t excl_paths_len, const char **excl_paths, int events, double delay, WatchfulCallback cb, void *cb_info) {
-    (void)delay;
+    /* Everything deinitialising touches is set before anything can fail */
+    wm->is_initialised = true;
     wm->backend = (NULL == backend) ? &watchful_default_backend : backend;
+    wm->delay = (delay > 0) ? delay : 0;
+    wm->path = NULL;
+    wm->excludes = NULL;
+    wm->is_watching = false;
+    watchful_batch_init(&wm->batch);
+    wm->queue = NULL;
+    watchful_subscriptions_init(&wm->subscriptions);
+    wm->snapshot_path = NULL;
+    wm->includes = NULL;
+    wm->degraded = NULL;
+    wm->degraded_len = 0;
+    wm->degraded_cap = 0;
+    pthread_mutex_init(&wm->degraded_lock, NULL);
+    memset(&wm->stats, 0, sizeof(WatchfulStats));
+
+    int err = watchful_debounce_init(&wm->debounce, wm->delay);
+    if (err) goto error;
 
     wm->path = abs_path_create(path);
     if (NULL == wm->path) goto error;
@@ -108,12 +143,32 @@ int watchful_monitor_init(WatchfulMonitor *wm, WatchfulBackend *backend, const c
     if (watchful_monitor_excludes_path(wm, path)) goto error;
 
     wm->events = events;
-    wm->delay = 0;
     wm->callback = cb;
     wm->callback_info = cb_info;
-    wm->is_watching = false;
     wm->thread = pthread_self();
 
+    /* Crawl with one thread per online CPU unless told otherwise */
+    wm->crawl.threads = 0;
+    wm->crawl.visit_files = false;
+    wm->crawl.max_depth = 0;
+    wm->crawl.one_filesystem = false;
+    wm->crawl.dev = 0;
+    wm->crawl.is_lazy = false;
+    wm->crawl.duration = 0;
+    wm->crawl.dirs = 0;
+    wm->crawl.entries = 0;
+
+    wm->read_len = WATCHFUL_READ_LEN;
+    wm->read_wait = 0;
+    wm->loop = NULL;
+    wm->registry = NULL;
+    wm->is_external = false;
+    wm->poll_fd = -1;
+    wm->rescan = false;
+    wm->snapshot = NULL;
+    wm->interval = WATCHFUL_POLL_INTERVAL;
+    wm->budget = 0;
+
     return 0;
 
 error:
@@ -139,24 +194,40 @@ error:
 }
 
 void watchful_monitor_deinit(WatchfulMonitor *wm) {
+    /* A monitor whose initialisation failed has been deinitialised already */
+    if (!wm->is_initialised) return;
     watchful_monitor_stop(wm);
 
     if (NULL != wm->path) free(wm->path);
+    wm->path = NULL;
+    free(wm->snapshot_path);
+    wm->snapshot_path = NULL;
 
     if (NULL != wm->excludes) {
+        watchful_matcher_destroy(wm->excludes->matcher);
         for (size_t i = 0; i < wm->excludes->len; i++) {
             if (NULL != wm->excludes->paths[i]) free(wm->excludes->paths[i]);
         }
         if (NULL != wm->excludes->paths) free(wm->excludes->paths);
         free(wm->excludes);
+        wm->excludes = NULL;
     }
+    watchful_includes_destroy(wm->includes);
+    wm->includes = NULL;
 
     wm->events = 0;
     wm->delay = 0;
     wm->callback = NULL;
     wm->callback_info = NULL;
+    watchful_batch_deinit(&wm->batch);
+    watchful_debounce_deinit(&wm->debounce);
+    watchful_queue_destroy(wm->queue);
+    wm->queue = NULL;
+    watchful_subscriptions_deinit(&wm->subscriptions);
+    pthread_mutex_destroy(&wm->degraded_lock);
     wm->is_watching = false;
     wm->thread = pthread_self();
+    wm->is_initialised = false;
 
     return;
 }
@@ -170,16 +241,227 @@ void watchful_monitor_destroy(WatchfulMonitor *wm) {
 
 bool watchful_monitor_excludes_path(WatchfulMonitor *wm, const char *path) {
     if (wm->excludes->len == 0) return false;
-    for (size_t i = 0; i < wm->excludes->len; i++) {
-        const char *exclude = (const char *)wm->excludes->paths[i];
-        if (wildmatch(exclude, path, WM_WILDSTAR) == WM_MATCH) return true;
+    return watchful_matcher_matches(wm->excludes->matcher, path);
+}
+
+bool watchful_monitor_includes_path(WatchfulMonitor *wm, const char *path) {
+    if (NULL == wm->includes) return true;
+    return watchful_includes_matches(wm->includes, path);
+}
+
+int watchful_monitor_include(WatchfulMonitor *wm, size_t patterns_len, const char **patterns) {
+    /* Without patterns every path that is not excluded is reported */
+    if (wm->is_watching) return 1;
+
+    WatchfulIncludes *includes = NULL;
+    if (patterns_len) {
+        includes = watchful_includes_create(wm->path, patterns_len, patterns);
+        if (NULL == includes) return 1;
+    }
+
+    watchful_includes_destroy(wm->includes);
+    wm->includes = includes;
+
+    return 0;
+}
+
+int watchful_monitor_batch(WatchfulMonitor *wm, WatchfulBatchCallback cb, size_t max, double latency) {
+    if (wm->is_watching) return 1;
+    wm->batch.callback = cb;
+    wm->batch.max = max;
+    wm->batch.latency = (latency < 0) ? 0 : latency;
+    return 0;
+}
+
+int watchful_monitor_read(WatchfulMonitor *wm, size_t len, double wait) {
+    /* A read must fit at least one event with the longest name */
+    if (wm->is_watching) return 1;
+    wm->read_len = (len < WATCHFUL_READ_MIN) ? WATCHFUL_READ_MIN : (len > WATCHFUL_READ_MAX) ? WATCHFUL_READ_MAX : len;
+    wm->read_wait = (wait > 0) ? wait : 0;
+    return 0;
+}
+
+int watchful_monitor_interval(WatchfulMonitor *wm, double interval) {
+    /* The polling backend and degraded subtrees are looked at on a schedule */
+    if (wm->is_watching || interval <= 0) return 1;
+    wm->interval = interval;
+    return 0;
+}
+
+int watchful_monitor_budget(WatchfulMonitor *wm, size_t watches) {
+    /* Zero leaves the kernel's limit for the user as the only one */
+    if (wm->is_watching) return 1;
+    wm->budget = watches;
+    return 0;
+}
+
+int watchful_monitor_crawl(WatchfulMonitor *wm, size_t max_depth, bool one_filesystem, bool is_lazy) {
+    /* A depth of zero crawls without limit; a lazy crawl leaves directories
+     * unwatched until their parent sees activity */
+    if (wm->is_watching) return 1;
+    wm->crawl.max_depth = max_depth;
+    wm->crawl.one_filesystem = one_filesystem;
+    wm->crawl.is_lazy = is_lazy;
+    return 0;
+}
+
+int watchful_monitor_crawl_threads(WatchfulMonitor *wm, size_t threads) {
+    /* Zero crawls with one thread per online CPU (up to a limit) */
+    if (wm->is_watching) return 1;
+    wm->crawl.threads = threads;
+    return 0;
+}
+
+int watchful_monitor_degraded(WatchfulMonitor *wm, char ***paths, size_t *paths_len) {
+    /* The subtrees scanned on a schedule for want of watches are copied for
+     * the caller, who frees each path and the array */
+    *paths = NULL;
+    *paths_len = 0;
+
+    pthread_mutex_lock(&wm->degraded_lock);
+    size_t len = wm->degraded_len;
+    if (0 == len) goto done;
+
+    *paths = calloc(len, sizeof(char *));
+    if (NULL == *paths) goto error;
+    for (size_t i = 0; i < len; i++) {
+        size_t path_len = strlen(wm->degraded[i].path);
+        (*paths)[i] = malloc(sizeof(char) * (path_len + 1));
+        if (NULL == (*paths)[i]) goto error;
+        memcpy((*paths)[i], wm->degraded[i].path, path_len + 1);
+        (*paths_len)++;
     }
-    return false;
+
+done:
+    pthread_mutex_unlock(&wm->degraded_lock);
+    return 0;
+
+error:
+    pthread_mutex_unlock(&wm->degraded_lock);
+    for (size_t i = 0; i < *paths_len; i++) free((*paths)[i]);
+    free(*paths);
+    *paths = NULL;
+    *paths_len = 0;
+    return 1;
+}
+
+int watchful_monitor_stats(WatchfulMonitor *wm, WatchfulStats *stats) {
+    /* The counters are updated without ordering on the event thread so the
+     * figures are each current but not necessarily consistent together */
+    stats->events_read = __atomic_load_n(&wm->stats.events_read, __ATOMIC_RELAXED);
+    stats->events_delivered = __atomic_load_n(&wm->stats.events_delivered, __ATOMIC_RELAXED);
+    stats->events_filtered = __atomic_load_n(&wm->stats.events_filtered, __ATOMIC_RELAXED);
+    stats->events_excluded = __atomic_load_n(&wm->stats.events_excluded, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&wm->stats.overflows, __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&wm->stats.reads, __ATOMIC_RELAXED);
+    stats->bytes_read = __atomic_load_n(&wm->stats.bytes_read, __ATOMIC_RELAXED);
+    stats->watches = __atomic_load_n(&wm->stats.watches, __ATOMIC_RELAXED);
+    stats->watches_dead = __atomic_load_n(&wm->stats.watches_dead, __ATOMIC_RELAXED);
+    stats->watches_memory = __atomic_load_n(&wm->stats.watches_memory, __ATOMIC_RELAXED);
+    __atomic_load(&wm->crawl.duration, &stats->crawl_duration, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int watchful_monitor_loop(WatchfulMonitor *wm, WatchfulLoop *loop) {
+    /* Monitors without a loop run one of their own */
+    if (wm->is_watching) return 1;
+    wm->loop = loop;
+    return 0;
+}
+
+int watchful_monitor_registry(WatchfulMonitor *wm, WatchfulRegistry *registry) {
+    /* Monitors in a registry share its watches (and so must use inotify) */
+    if (wm->is_watching) return 1;
+    if (NULL != registry && wm->backend != &watchful_inotify) return 1;
+    wm->registry = registry;
+    return 0;
+}
+
+int watchful_monitor_rescan(WatchfulMonitor *wm, bool rescan) {
+    /* Rescanning after lost events needs a snapshot of the whole tree */
+    if (wm->is_watching) return 1;
+    wm->rescan = rescan;
+    return 0;
+}
+
+int watchful_monitor_persist(WatchfulMonitor *wm, const char *path) {
+    /* The snapshot is saved to the file on stopping and compared with the
+     * tree on starting so that changes made in between are reported */
+    if (wm->is_watching) return 1;
+    free(wm->snapshot_path);
+    wm->snapshot_path = NULL;
+    if (NULL == path) return 0;
+
+    size_t path_len = strlen(path);
+    wm->snapshot_path = malloc(sizeof(char) * (path_len + 1));
+    if (NULL == wm->snapshot_path) return 1;
+    memcpy(wm->snapshot_path, path, path_len + 1);
+
+    return 0;
+}
+
+int watchful_monitor_external(WatchfulMonitor *wm, bool external) {
+    /* An external monitor runs no threads: the embedder waits on its fd */
+    if (wm->is_watching) return 1;
+    if (external && NULL == wm->backend->process) return 1;
+    wm->is_external = external;
+    return 0;
+}
+
+int watchful_monitor_fd(WatchfulMonitor *wm) {
+    if (!wm->is_watching || !wm->is_external) return -1;
+    return wm->poll_fd;
+}
+
+int watchful_monitor_process(WatchfulMonitor *wm) {
+    if (!wm->is_watching || !wm->is_external) return 1;
+    return wm->backend->process(wm);
+}
+
+int watchful_monitor_coalesce(WatchfulMonitor *wm, bool coalesce) {
+    /* Coalescing works on a batch, so the batch's latency is its window */
+    if (wm->is_watching) return 1;
+    wm->batch.coalesce = coalesce;
+    return 0;
+}
+
+int watchful_monitor_queue(WatchfulMonitor *wm, size_t cap, int policy) {
+    /* Events are queued for polling instead of passed to callbacks */
+    if (wm->is_watching || NULL != wm->queue) return 1;
+    wm->queue = watchful_queue_create(cap, policy, wm->path);
+    if (NULL == wm->queue) return 1;
+    return 0;
+}
+
+WatchfulSubscription *watchful_monitor_subscribe(WatchfulMonitor *wm, const char *path, int events, WatchfulCallback cb, void *info) {
+    /* Each subscriber is given the events of its types beneath the path
+     * (relative to the root, or NULL for all of it) on the event thread. The
+     * path is a directory, optionally followed by "**", not a pattern. As
+     * events are dispatched without a lock, subscribers can only be added
+     * and removed while the monitor is stopped */
+    if (wm->is_watching) return NULL;
+    return watchful_subscriptions_add(&wm->subscriptions, wm->path, path, events, cb, info);
+}
+
+int watchful_monitor_unsubscribe(WatchfulMonitor *wm, WatchfulSubscription *subscription) {
+    if (wm->is_watching || NULL == subscription) return 1;
+    return watchful_subscriptions_remove(&wm->subscriptions, subscription);
+}
+
+const WatchfulEvent *watchful_monitor_poll(WatchfulMonitor *wm, double timeout) {
+    if (NULL == wm->queue) return NULL;
+    return watchful_queue_poll(wm->queue, timeout);
+}
+
+size_t watchful_monitor_drain(WatchfulMonitor *wm, WatchfulBatchCallback cb, void *info, double timeout) {
+    if (NULL == wm->queue) return 0;
+    return watchful_queue_drain(wm->queue, cb, info, timeout);
 }
 
 int watchful_monitor_start(WatchfulMonitor *wm) {
     if (wm->is_watching) return 1;
     int error = 0;
+    if (NULL != wm->queue) watchful_queue_open(wm->queue);
     error = wm->backend->setup(wm);
     if (error) return 1;
     wm->is_watching = true;
@@ -189,6 +471,7 @@ int watchful_monitor_start(WatchfulMonitor *wm) {
 int watchful_monitor_stop(WatchfulMonitor *wm) {
     if (!wm->is_watching) return 0;
     int error = 0;
+    if (NULL != wm->queue) watchful_queue_close(wm->queue);
     error = wm->backend->teardown(wm);
     if (error) return 1;
     wm->is_watching = false;
@@ -3,6 +3,9 @@
 
 #ifdef LINUX
 #define INOTIFY
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #endif
 
 #ifdef MACOS
@@ -11,6 +14,7 @@
 
 /* General */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,17 +23,23 @@
 #include "wildmatch.h"
 
 /* POSIX */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #ifdef INOTIFY
-#include <dirent.h>
-#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
-#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #endif
 
@@ -44,26 +54,90 @@
 #define WATCHFUL_EVENT_CREATED  0x2
 #define WATCHFUL_EVENT_DELETED  0x4
 #define WATCHFUL_EVENT_RENAMED  0x8
+#define WATCHFUL_EVENT_OVERFLOW 0x10
+
+#define WATCHFUL_SCOPE_NONE 0
+#define WATCHFUL_SCOPE_SOME 1
+#define WATCHFUL_SCOPE_ALL  2
+
+#define WATCHFUL_BATCH_MAX 1024
+
+#define WATCHFUL_LOOP_FDS 2
+
+#define WATCHFUL_READ_MIN 4096
+#define WATCHFUL_READ_LEN 65536
+#define WATCHFUL_READ_MAX 1048576
+
+#define WATCHFUL_DEBOUNCE_SLOTS 256
+
+#define WATCHFUL_POLL_INTERVAL 1.0
+
+#define WATCHFUL_MOVE_EXPIRY 0.05
+
+#define WATCHFUL_QUEUE_BLOCK       0
+#define WATCHFUL_QUEUE_DROP_OLDEST 1
+#define WATCHFUL_QUEUE_OVERFLOW    2
 
 /* Forward Declarations */
 struct WatchfulWatch;
 struct WatchfulEvent;
 struct WatchfulBackend;
 struct WatchfulMonitor;
+struct WatchfulCrawlEntry;
 /* struct WatchfulStream; */
 
 /* Type Aliases */
 typedef pthread_t WatchfulThread;
 typedef struct timespec WatchfulTime;
 typedef int (*WatchfulCallback)(const struct WatchfulEvent *, void *);
+typedef int (*WatchfulBatchCallback)(const struct WatchfulEvent *, size_t, void *);
+typedef int (*WatchfulCrawlVisit)(void *, const struct WatchfulCrawlEntry *, void **);
 
 /* Types */
 
+typedef struct WatchfulTableEntry {
+    uint64_t key;
+    void *value;
+} WatchfulTableEntry;
+
+typedef struct WatchfulTable {
+    size_t len;
+    size_t cap;
+    WatchfulTableEntry *entries;
+} WatchfulTable;
+
+typedef struct WatchfulScope {
+    int state;
+    struct WatchfulScope *next;
+    uint64_t patterns[];
+} WatchfulScope;
+
 typedef struct WatchfulWatch {
     int wd;
-    char *path;
+    char *name;
+    const WatchfulScope *scope;
+    size_t depth;
+    size_t watches;
+    bool is_lazy;
+    struct WatchfulWatch *parent;
+    struct WatchfulWatch *child;
+    struct WatchfulWatch *prev;
+    struct WatchfulWatch *next;
+    struct WatchfulWatch *newer;
+    struct WatchfulWatch *older;
 } WatchfulWatch;
 
+typedef struct WatchfulLevel {
+    WatchfulWatch *newest;
+    WatchfulWatch *oldest;
+} WatchfulLevel;
+
+typedef struct WatchfulMove {
+    char *old_path;
+    WatchfulWatch *moved;
+    double expires;
+} WatchfulMove;
+
 typedef struct WatchfulEvent {
     int type;
     time_t at;
@@ -71,31 +145,335 @@ typedef struct WatchfulEvent {
     char *old_path;
 } WatchfulEvent;
 
+typedef struct WatchfulArenaChunk {
+    struct WatchfulArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} WatchfulArenaChunk;
+
+typedef struct WatchfulArena {
+    WatchfulArenaChunk *head;
+    WatchfulArenaChunk *current;
+    size_t chunk_size;
+    size_t allocations;
+} WatchfulArena;
+
+typedef struct WatchfulArenaMark {
+    WatchfulArenaChunk *chunk;
+    size_t used;
+} WatchfulArenaMark;
+
+typedef struct WatchfulBatch {
+    WatchfulBatchCallback callback;
+    size_t max;
+    double latency;
+    WatchfulEvent *events;
+    size_t len;
+    size_t cap;
+    WatchfulTime first;
+    WatchfulArena arena;
+    bool coalesce;
+    WatchfulTable latest;
+    size_t allocations;
+} WatchfulBatch;
+
+typedef struct WatchfulDebounceEntry {
+    uint64_t hash;
+    int type;
+    time_t at;
+    char *path;
+    char *old_path;
+    char *buf;
+    size_t buf_len;
+    uint64_t deadline;
+    struct WatchfulDebounceEntry *prev;
+    struct WatchfulDebounceEntry *next;
+    struct WatchfulDebounceEntry *collision;
+} WatchfulDebounceEntry;
+
+typedef struct WatchfulDebounce {
+    double delay;
+    double tick;
+    uint64_t current;
+    WatchfulTable paths;
+    WatchfulDebounceEntry *wheel[WATCHFUL_DEBOUNCE_SLOTS];
+    WatchfulDebounceEntry *free;
+    size_t len;
+    size_t allocations;
+} WatchfulDebounce;
+
+typedef struct WatchfulQueue {
+    size_t cap;
+    int policy;
+    const char *path;
+    WatchfulEvent *events;
+    char **bufs;
+    size_t *bufs_len;
+    size_t head;
+    size_t tail;
+    size_t done;
+    WatchfulEvent *held;
+    char **held_bufs;
+    size_t *held_bufs_len;
+    bool overflowed;
+    bool closed;
+    size_t dropped;
+    int waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WatchfulQueue;
+
+typedef struct WatchfulSubscription {
+    char *prefix;
+    size_t prefix_len;
+    int events;
+    WatchfulCallback callback;
+    void *info;
+    uint64_t seen;
+    struct WatchfulSubscription *next;
+} WatchfulSubscription;
+
+typedef struct WatchfulSubscriptions {
+    WatchfulTable prefixes;
+    size_t len;
+    size_t min_len;
+    size_t max_len;
+    uint64_t dispatched;
+} WatchfulSubscriptions;
+
+typedef struct WatchfulLoopHandler {
+    int (*process)(void *info);
+    void *info;
+    int fds[WATCHFUL_LOOP_FDS];
+    size_t fds_len;
+    pthread_mutex_t lock;
+    size_t busy;
+    bool again;
+    bool removed;
+} WatchfulLoopHandler;
+
+typedef struct WatchfulLoop {
+    int epfd;
+    int efd;
+    pthread_t *threads;
+    size_t threads_len;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WatchfulTable handlers;
+    bool is_orphaned;
+} WatchfulLoop;
+
+typedef struct WatchfulMonitorList {
+    struct WatchfulMonitor **monitors;
+    size_t len;
+    size_t cap;
+} WatchfulMonitorList;
+
+typedef struct WatchfulRegistry {
+    int fd;
+    int timer_fd;
+    char *buf;
+    size_t read_len;
+    WatchfulLoop *loop;
+    bool owns_loop;
+    bool is_added;
+    bool is_processing;
+    WatchfulLoopHandler handler;
+    pthread_mutex_t lock;
+    pthread_mutex_t process_lock;
+    WatchfulTable shares;
+    WatchfulMonitorList attached;
+    WatchfulMonitorList scratch;
+} WatchfulRegistry;
+
+typedef struct WatchfulSnapshotEntry {
+    uint64_t hash;
+    ino_t ino;
+    off_t size;
+    int64_t mtime;
+    bool is_dir;
+    uint64_t gen;
+    uint64_t scanned;
+    struct WatchfulSnapshotEntry *next;
+    char path[];
+} WatchfulSnapshotEntry;
+
+typedef struct WatchfulSnapshot {
+    WatchfulTable entries;
+    size_t len;
+    uint64_t gen;
+    int64_t stamp;
+    char *root;
+    pthread_mutex_t lock;
+} WatchfulSnapshot;
+
+typedef struct WatchfulDegraded {
+    char *path;
+    size_t depth;
+    WatchfulSnapshot *snapshot;
+} WatchfulDegraded;
+
+typedef struct WatchfulStats {
+    uint64_t events_read;
+    uint64_t events_delivered;
+    uint64_t events_filtered;
+    uint64_t events_excluded;
+    uint64_t overflows;
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t watches;
+    uint64_t watches_dead;
+    uint64_t watches_memory;
+    double crawl_duration;
+} WatchfulStats;
+
+typedef struct WatchfulRescan {
+    pthread_t thread;
+    uint64_t since;
+    bool is_running;
+    bool is_done;
+    bool again;
+    int err;
+    WatchfulEvent *changes;
+    size_t changes_len;
+} WatchfulRescan;
+
+typedef struct WatchfulCrawl {
+    size_t threads;
+    bool visit_files;
+    size_t max_depth;
+    bool one_filesystem;
+    dev_t dev;
+    bool is_lazy;
+    double duration;
+    size_t dirs;
+    size_t entries;
+} WatchfulCrawl;
+
+typedef struct WatchfulCrawlEntry {
+    const char *path;
+    const char *name;
+    size_t name_len;
+    size_t depth;
+    bool is_dir;
+    int dir_fd;
+    void *parent;
+} WatchfulCrawlEntry;
+
 typedef struct WatchfulBackend {
     const char *name;
     int (*setup)(struct WatchfulMonitor *wm);
     int (*teardown)(struct WatchfulMonitor *wm);
+    int (*process)(struct WatchfulMonitor *wm);
 } WatchfulBackend;
 
+typedef struct WatchfulPattern {
+    const char *pattern;
+    size_t prefix_len;
+    const char *suffix;
+    size_t suffix_len;
+    const char *key;
+    size_t key_len;
+    char *stem;
+    bool is_segmented;
+    int32_t next;
+} WatchfulPattern;
+
+typedef struct WatchfulMatcher {
+    size_t patterns_len;
+    WatchfulPattern *patterns;
+    int32_t always;
+    uint8_t classes[256];
+    size_t classes_len;
+    size_t states_len;
+    size_t states_max;
+    int32_t *delta;
+    int32_t *fail;
+    int32_t *dict;
+    int32_t *out;
+    WatchfulTable scopes;
+    pthread_mutex_t scopes_lock;
+} WatchfulMatcher;
+
 typedef struct WatchfulExcludes {
     char **paths;
     size_t len;
+    WatchfulMatcher *matcher;
 } WatchfulExcludes;
 
+typedef struct WatchfulLiteral {
+    struct WatchfulLiteral *next;
+    size_t len;
+    char text[];
+} WatchfulLiteral;
+
+typedef struct WatchfulIncludes {
+    size_t len;
+    WatchfulTable names;
+    WatchfulTable suffixes;
+    size_t *suffix_lens;
+    size_t suffix_lens_len;
+    char **paths;
+    size_t paths_len;
+    WatchfulMatcher *matcher;
+} WatchfulIncludes;
+
 typedef struct WatchfulMonitor {
     WatchfulBackend *backend;
     char *path;
     WatchfulExcludes *excludes;
+    WatchfulIncludes *includes;
     int events;
     double delay;
     WatchfulCallback callback;
     void *callback_info;
+    WatchfulBatch batch;
+    WatchfulDebounce debounce;
+    WatchfulQueue *queue;
+    WatchfulSubscriptions subscriptions;
+    bool is_initialised;
     bool is_watching;
     WatchfulThread thread;
+    WatchfulCrawl crawl;
+    size_t read_len;
+    double read_wait;
+    WatchfulLoop *loop;
+    WatchfulRegistry *registry;
+    bool is_external;
+    int poll_fd;
+    bool rescan;
+    char *snapshot_path;
+    WatchfulSnapshot *snapshot;
+    double interval;
+    size_t budget;
+    WatchfulDegraded *degraded;
+    size_t degraded_len;
+    size_t degraded_cap;
+    pthread_mutex_t degraded_lock;
+    WatchfulStats stats;
 #if defined(INOTIFY)
     int fd;
+    int timer_fd;
+    char *buf;
+    bool owns_loop;
+    WatchfulLoopHandler handler;
+    WatchfulRescan rescanning;
+    bool is_processing;
+    pthread_mutex_t watches_lock;
     size_t watches_len;
-    WatchfulWatch **watches;
+    WatchfulWatch *root;
+    WatchfulTable wds;
+    WatchfulTable moves;
+    WatchfulLevel *levels;
+    size_t levels_len;
+    size_t watches_max;
+    bool is_rebalancing;
+    double degraded_next;
+    int mount_fd;
+    char *real_root;
+    WatchfulTable dirs;
+    WatchfulSnapshot *index;
 #elif defined(FSEVENTS)
     WatchfulTime *start_time;
     FSEventStreamRef ref;
@@ -105,8 +483,10 @@ typedef struct WatchfulMonitor {
 } WatchfulMonitor;
 
 /* Externs */
+extern WatchfulBackend watchful_fanotify;
 extern WatchfulBackend watchful_fsevents;
 extern WatchfulBackend watchful_inotify;
+extern WatchfulBackend watchful_poll;
 
 #if defined(LINUX)
 #define watchful_default_backend watchful_inotify
@@ -119,6 +499,101 @@ char *watchful_path_create(const char *path, const char *prefix, bool is_dir);
 char *watchful_path_add_sep(char *path);
 bool watchful_path_is_dir(const char *path);
 bool watchful_path_is_prefixed(const char *path, const char *prefix);
+uint64_t watchful_path_hash(const char *path);
+
+/* Table Functions */
+int watchful_table_init(WatchfulTable *table, size_t cap);
+void watchful_table_deinit(WatchfulTable *table);
+void watchful_table_clear(WatchfulTable *table);
+void *watchful_table_get(const WatchfulTable *table, uint64_t key);
+int watchful_table_put(WatchfulTable *table, uint64_t key, void *value);
+void *watchful_table_remove(WatchfulTable *table, uint64_t key);
+
+/* Matcher Functions */
+WatchfulMatcher *watchful_matcher_create(size_t patterns_len, char **patterns);
+void watchful_matcher_destroy(WatchfulMatcher *matcher);
+const WatchfulScope *watchful_matcher_scope(WatchfulMatcher *matcher, const WatchfulScope *parent, const char *dir);
+bool watchful_matcher_matches(const WatchfulMatcher *matcher, const char *path);
+bool watchful_matcher_matches_in(const WatchfulMatcher *matcher, const WatchfulScope *scope, const char *path);
+
+/* Include Functions */
+WatchfulIncludes *watchful_includes_create(const char *root, size_t patterns_len, const char **patterns);
+void watchful_includes_destroy(WatchfulIncludes *includes);
+bool watchful_includes_matches(const WatchfulIncludes *includes, const char *path);
+
+/* Arena Functions */
+void watchful_arena_init(WatchfulArena *arena, size_t chunk_size);
+void watchful_arena_deinit(WatchfulArena *arena);
+char *watchful_arena_alloc(WatchfulArena *arena, size_t len);
+char *watchful_arena_strdup(WatchfulArena *arena, const char *str);
+WatchfulArenaMark watchful_arena_mark(WatchfulArena *arena);
+void watchful_arena_rewind(WatchfulArena *arena, WatchfulArenaMark mark);
+void watchful_arena_reset(WatchfulArena *arena);
+
+/* Batch Functions */
+void watchful_batch_init(WatchfulBatch *batch);
+void watchful_batch_deinit(WatchfulBatch *batch);
+int watchful_batch_add(struct WatchfulMonitor *wm, int type, char *path, char *old_path);
+int watchful_batch_flush(struct WatchfulMonitor *wm);
+bool watchful_batch_is_due(struct WatchfulMonitor *wm);
+double watchful_batch_wait(struct WatchfulMonitor *wm);
+size_t watchful_batch_allocations(struct WatchfulMonitor *wm);
+
+/* Coalesce Functions */
+int watchful_coalesce(WatchfulTable *latest, WatchfulEvent *events, size_t *len);
+
+/* Debounce Functions */
+int watchful_debounce_init(WatchfulDebounce *debounce, double delay);
+void watchful_debounce_deinit(WatchfulDebounce *debounce);
+int watchful_debounce_add(struct WatchfulMonitor *wm, int type, const char *path, const char *old_path);
+int watchful_debounce_release(struct WatchfulMonitor *wm, bool all);
+double watchful_debounce_wait(struct WatchfulMonitor *wm);
+
+/* Queue Functions */
+WatchfulQueue *watchful_queue_create(size_t cap, int policy, const char *path);
+void watchful_queue_destroy(WatchfulQueue *queue);
+void watchful_queue_open(WatchfulQueue *queue);
+void watchful_queue_close(WatchfulQueue *queue);
+int watchful_queue_push(WatchfulQueue *queue, const WatchfulEvent *event);
+const WatchfulEvent *watchful_queue_poll(WatchfulQueue *queue, double timeout);
+size_t watchful_queue_drain(WatchfulQueue *queue, WatchfulBatchCallback cb, void *info, double timeout);
+
+/* Subscription Functions */
+void watchful_subscriptions_init(WatchfulSubscriptions *subscriptions);
+void watchful_subscriptions_deinit(WatchfulSubscriptions *subscriptions);
+WatchfulSubscription *watchful_subscriptions_add(WatchfulSubscriptions *subscriptions, const char *root, const char *path, int events, WatchfulCallback cb, void *info);
+int watchful_subscriptions_remove(WatchfulSubscriptions *subscriptions, WatchfulSubscription *subscription);
+void watchful_subscriptions_dispatch(WatchfulSubscriptions *subscriptions, const WatchfulEvent *event);
+
+/* Loop Functions */
+WatchfulLoop *watchful_loop_create(size_t threads);
+void watchful_loop_destroy(WatchfulLoop *loop);
+int watchful_loop_add(WatchfulLoop *loop, WatchfulLoopHandler *handler);
+void watchful_loop_remove(WatchfulLoop *loop, WatchfulLoopHandler *handler);
+int watchful_loop_attach(struct WatchfulMonitor *wm, int (*process)(void *info));
+void watchful_loop_detach(struct WatchfulMonitor *wm);
+int watchful_loop_arm(struct WatchfulMonitor *wm, double wait);
+double watchful_loop_wait(struct WatchfulMonitor *wm, double wait);
+int watchful_loop_set(int timer_fd, double wait);
+
+/* Registry Functions */
+WatchfulRegistry *watchful_registry_create(WatchfulLoop *loop);
+void watchful_registry_destroy(WatchfulRegistry *registry);
+
+/* Snapshot Functions */
+WatchfulSnapshot *watchful_snapshot_create(void);
+void watchful_snapshot_destroy(WatchfulSnapshot *snapshot);
+int watchful_snapshot_scan(WatchfulSnapshot *snapshot, struct WatchfulMonitor *wm);
+uint64_t watchful_snapshot_begin(WatchfulSnapshot *snapshot);
+void watchful_snapshot_apply(WatchfulSnapshot *snapshot, const WatchfulEvent *events, size_t len);
+int watchful_snapshot_diff(WatchfulSnapshot *snapshot, WatchfulSnapshot *scan, uint64_t since, WatchfulEvent **changes, size_t *changes_len);
+int watchful_snapshot_save(WatchfulSnapshot *snapshot, const char *root, const char *path, int64_t stamp);
+int watchful_snapshot_restore(WatchfulSnapshot *snapshot, struct WatchfulMonitor *wm, const char *path, WatchfulEvent **changes, size_t *changes_len);
+int watchful_snapshot_refresh(WatchfulSnapshot *snapshot, struct WatchfulMonitor *wm, WatchfulEvent **changes, size_t *changes_len);
+
+/* Crawl Functions */
+size_t watchful_crawl_threads(size_t threads);
+int watchful_crawl_run(WatchfulCrawl *crawl, const char *root, void *root_ctx, WatchfulCrawlVisit visit, void *info);
 
 /* Monitor Functions */
 int watchful_monitor_init(WatchfulMonitor *wm, WatchfulBackend *backend, const char *path, size_t excl_paths_len, const char** excl_paths, int events, double delay, WatchfulCallback cb, void *cb_info);
@@ -126,6 +601,29 @@ WatchfulMonitor *watchful_monitor_create(WatchfulBackend *backend, const char *p
 void watchful_monitor_deinit(WatchfulMonitor *wm);
 void watchful_monitor_destroy(WatchfulMonitor *wm);
 bool watchful_monitor_excludes_path(WatchfulMonitor *wm, const char *path);
+bool watchful_monitor_includes_path(WatchfulMonitor *wm, const char *path);
+int watchful_monitor_include(WatchfulMonitor *wm, size_t patterns_len, const char **patterns);
+int watchful_monitor_batch(WatchfulMonitor *wm, WatchfulBatchCallback cb, size_t max, double latency);
+int watchful_monitor_coalesce(WatchfulMonitor *wm, bool coalesce);
+int watchful_monitor_rescan(WatchfulMonitor *wm, bool rescan);
+int watchful_monitor_persist(WatchfulMonitor *wm, const char *path);
+int watchful_monitor_read(WatchfulMonitor *wm, size_t len, double wait);
+int watchful_monitor_interval(WatchfulMonitor *wm, double interval);
+int watchful_monitor_budget(WatchfulMonitor *wm, size_t watches);
+int watchful_monitor_crawl(WatchfulMonitor *wm, size_t max_depth, bool one_filesystem, bool is_lazy);
+int watchful_monitor_crawl_threads(WatchfulMonitor *wm, size_t threads);
+int watchful_monitor_degraded(WatchfulMonitor *wm, char ***paths, size_t *paths_len);
+int watchful_monitor_stats(WatchfulMonitor *wm, WatchfulStats *stats);
+int watchful_monitor_loop(WatchfulMonitor *wm, WatchfulLoop *loop);
+int watchful_monitor_registry(WatchfulMonitor *wm, WatchfulRegistry *registry);
+int watchful_monitor_external(WatchfulMonitor *wm, bool external);
+int watchful_monitor_fd(WatchfulMonitor *wm);
+int watchful_monitor_process(WatchfulMonitor *wm);
+int watchful_monitor_queue(WatchfulMonitor *wm, size_t cap, int policy);
+WatchfulSubscription *watchful_monitor_subscribe(WatchfulMonitor *wm, const char *path, int events, WatchfulCallback cb, void *info);
+int watchful_monitor_unsubscribe(WatchfulMonitor *wm, WatchfulSubscription *subscription);
+const WatchfulEvent *watchful_monitor_poll(WatchfulMonitor *wm, double timeout);
+size_t watchful_monitor_drain(WatchfulMonitor *wm, WatchfulBatchCallback cb, void *info, double timeout);
 int watchful_monitor_start(WatchfulMonitor *wm);
 int watchful_monitor_stop(WatchfulMonitor *wm);
 
@@ -0,0 +1,66 @@
+#include "check.h"
+
+/* Checks that once a monitor has grown to the size of its busiest read,
+ * handling the same kind of events again allocates nothing for them. */
+
+#define FILES 200
+#define ROUNDS 5
+
+static size_t delivered;
+
+static int count(const WatchfulEvent *event, void *info) {
+    (void)event;
+    (void)info;
+    delivered++;
+    return 0;
+}
+
+static bool all_delivered(void *info) {
+    (void)info;
+    return delivered >= FILES;
+}
+
+static void touch_all(const char *root) {
+    for (int i = 0; i < FILES; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "file-%d", i);
+        append_file(root, name, "x");
+    }
+    return;
+}
+
+static void test_steady(const char *root, double delay) {
+    WatchfulMonitor wm;
+    check(0 == watchful_monitor_init(&wm, NULL, root, 0, NULL, WATCHFUL_EVENT_MODIFIED, delay, count, NULL));
+    check(0 == watchful_monitor_external(&wm, true));
+    check(0 == watchful_monitor_start(&wm));
+
+    /* Two rounds to grow, then the rest must not allocate */
+    size_t warm = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        if (2 == round) warm = watchful_batch_allocations(&wm);
+        delivered = 0;
+        touch_all(root);
+        pump(&wm, all_delivered, NULL);
+        check(FILES == delivered);
+    }
+    check(warm == watchful_batch_allocations(&wm));
+
+    watchful_monitor_deinit(&wm);
+    return;
+}
+
+int main(void) {
+    if (check_skipped("allocations")) return 0;
+
+    char root[PATH_MAX];
+    root_create(root, "allocations");
+    touch_all(root);
+
+    test_steady(root, 0);
+    test_steady(root, 0.05);
+
+    root_remove(root);
+
+    return check_report("allocations");
+}
@@ -0,0 +1,102 @@
+#ifndef WATCHFUL_CHECK_H
+#define WATCHFUL_CHECK_H
+
+#include "../../src/watchful.h"
+
+#include <poll.h>
+
+/* The native tests cover what the Janet wrapper does not expose. Each is a
+ * program that runs its checks in turn and exits non-zero if any failed. */
+
+static int check_failures = 0;
+
+#define check(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while (0)
+
+#define check_str(actual, expect) do { \
+    const char *check_actual = (actual); \
+    const char *check_expect = (expect); \
+    if (NULL == check_actual || NULL == check_expect || strcmp(check_actual, check_expect)) { \
+        fprintf(stderr, "%s:%d: expected \"%s\", got \"%s\"\n", __FILE__, __LINE__, \
+                check_expect ? check_expect : "(null)", check_actual ? check_actual : "(null)"); \
+        check_failures++; \
+    } \
+} while (0)
+
+static int check_report(const char *name) {
+    if (check_failures) fprintf(stderr, "%s: %d check(s) failed\n", name, check_failures);
+    else printf("%s: ok\n", name);
+    return check_failures ? 1 : 0;
+}
+
+/* Fixtures */
+
+/* Tests that drive the inotify backend pass elsewhere without running */
+static inline bool check_skipped(const char *name) {
+#ifdef LINUX
+    (void)name;
+    return false;
+#else
+    printf("%s: skipped (needs the inotify backend)\n", name);
+    return true;
+#endif
+}
+
+/* Monitors under test are external so that a test decides when events are
+ * read; this processes them until done() holds (or five seconds pass) */
+static inline void pump(WatchfulMonitor *wm, bool (*done)(void *), void *info) {
+    int fd = watchful_monitor_fd(wm);
+    for (int i = 0; i < 500 && !done(info); i++) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 10) > 0) watchful_monitor_process(wm);
+    }
+    return;
+}
+
+/* Files are named relative to a root that ends in a slash */
+static inline void file_put(const char *root, const char *name, const char *text, const char *mode) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", root, name);
+    FILE *file = fopen(path, mode);
+    check(NULL != file);
+    if (NULL == file) return;
+    fputs(text, file);
+    fclose(file);
+    return;
+}
+
+static inline void write_file(const char *root, const char *name, const char *text) {
+    file_put(root, name, text, "w");
+    return;
+}
+
+static inline void append_file(const char *root, const char *name, const char *text) {
+    file_put(root, name, text, "a");
+    return;
+}
+
+/* Each %s in the command is the root */
+static inline void run(const char *command, const char *root) {
+    char buf[PATH_MAX * 4];
+    snprintf(buf, sizeof(buf), command, root, root, root, root);
+    check(0 == system(buf));
+    return;
+}
+
+static inline void root_create(char *root, const char *name) {
+    snprintf(root, PATH_MAX - 1, "/tmp/watchful-%s-XXXXXX", name);
+    check(NULL != mkdtemp(root));
+    strcat(root, "/");
+    return;
+}
+
+static inline void root_remove(const char *root) {
+    run("rm -rf %s", root);
+    return;
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include "check.h"
+
+/* Compares the matcher with trying each pattern in turn with wildmatch(),
+ * with and without the scopes that watches keep for their directories. */
+
+static const char *patterns[] = {
+    "/r/**/x",
+    "/r/a/**",
+    "/r/*.c",
+    "/r/**/*.o",
+    "/r/b/**/c",
+    "/r/\\*star",
+    "/r/e\\[1]/f",
+    "/r/[a-c]*/y",
+    "/r/[!x]/z",
+    "/r/[[:digit:]]n",
+    "/r/[]]q",
+    "/r/d?/**",
+    "/r/g/*/h/**",
+    "/r/k/**/",
+    "/r/lit/file",
+    "/r/m/**",
+    "*.c",
+    "r/*/x",
+    "*/a/**",
+};
+
+static const char *paths[] = {
+    "/r/x",
+    "/r/a/x",
+    "/r/a/b/x",
+    "/r/a/",
+    "/r/a/deep/f",
+    "/r/ab/f",
+    "/r/main.c",
+    "/r/s/main.c",
+    "/r/s/t/u.o",
+    "/r/u.o",
+    "/r/b/c",
+    "/r/b/1/2/c",
+    "/r/bc",
+    "/r/*star",
+    "/r/xstar",
+    "/r/e[1]/f",
+    "/r/e1/f",
+    "/r/bz/y",
+    "/r/cz/w/y",
+    "/r/dz/y",
+    "/r/a/z",
+    "/r/x/z",
+    "/r/ab/z",
+    "/r/5n",
+    "/r/nn",
+    "/r/]q",
+    "/r/d1/f",
+    "/r/d12/f",
+    "/r/g/1/h/i",
+    "/r/g/1/2/h/i",
+    "/r/k/1/",
+    "/r/k/1",
+    "/r/lit/file",
+    "/r/lit/filex",
+    "/r/m/",
+    "/r/m/n/o",
+    "/q/a/x",
+    "main.c",
+    "s/x",
+};
+
+#define PATTERNS_LEN (sizeof(patterns) / sizeof(patterns[0]))
+#define PATHS_LEN (sizeof(paths) / sizeof(paths[0]))
+
+static bool expected(char **set, size_t set_len, const char *path) {
+    for (size_t i = 0; i < set_len; i++) {
+        if (wildmatch(set[i], path, WM_WILDSTAR) == WM_MATCH) return true;
+    }
+    return false;
+}
+
+static bool matches_scoped(WatchfulMatcher *matcher, const char *path) {
+    /* Scopes are found for each directory down from the root, as watches
+     * find them when they are added */
+    char dir[PATH_MAX];
+    const WatchfulScope *scope = NULL;
+    for (const char *end = strchr(path + 1, '/'); NULL != end && end[1] != '\0'; end = strchr(end + 1, '/')) {
+        size_t len = end - path + 1;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+        scope = watchful_matcher_scope(matcher, scope, dir);
+        check(NULL != scope);
+        if (NULL == scope) return false;
+    }
+    return watchful_matcher_matches_in(matcher, scope, path);
+}
+
+static void compare(char **set, size_t set_len) {
+    WatchfulMatcher *matcher = watchful_matcher_create(set_len, set);
+    check(NULL != matcher);
+    if (NULL == matcher) return;
+
+    for (size_t i = 0; i < PATHS_LEN; i++) {
+        bool expect = expected(set, set_len, paths[i]);
+        if (expect != watchful_matcher_matches(matcher, paths[i])) {
+            fprintf(stderr, "%s: %s given %s first\n", paths[i], expect ? "missed" : "matched", set[0]);
+            check(false);
+        }
+        if (paths[i][0] == '/' && expect != matches_scoped(matcher, paths[i])) {
+            fprintf(stderr, "%s: %s in scope given %s first\n", paths[i], expect ? "missed" : "matched", set[0]);
+            check(false);
+        }
+    }
+
+    watchful_matcher_destroy(matcher);
+    return;
+}
+
+int main(void) {
+    /* Each pattern alone and then all of them together */
+    for (size_t i = 0; i < PATTERNS_LEN; i++) {
+        compare((char **)&patterns[i], 1);
+    }
+    compare((char **)patterns, PATTERNS_LEN);
+    return check_report("matcher");
+}
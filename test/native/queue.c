@@ -0,0 +1,108 @@
+#include "check.h"
+
+/* Fills the ring under each of the full-ring policies, with the consumer
+ * holding on to the last event it polled as it is allowed to. */
+
+#define CAP 4
+
+static void push(WatchfulQueue *queue, int i) {
+    char path[32];
+    snprintf(path, sizeof(path), "/r/%d", i);
+    WatchfulEvent event = {.type = WATCHFUL_EVENT_MODIFIED, .at = 0, .path = path, .old_path = NULL};
+    check(0 == watchful_queue_push(queue, &event));
+    return;
+}
+
+static void *push_many(void *arg) {
+    WatchfulQueue *queue = arg;
+    for (int i = 1; i <= CAP * 3; i++) push(queue, i);
+    return NULL;
+}
+
+static void test_block(void) {
+    WatchfulQueue *queue = watchful_queue_create(CAP, WATCHFUL_QUEUE_BLOCK, "/r/");
+    check(NULL != queue);
+
+    /* The producer waits for room rather than lose anything */
+    pthread_t thread;
+    check(0 == pthread_create(&thread, NULL, push_many, queue));
+    for (int i = 1; i <= CAP * 3; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/r/%d", i);
+        const WatchfulEvent *event = watchful_queue_poll(queue, 5);
+        check(NULL != event);
+        if (NULL != event) check_str(event->path, path);
+    }
+    pthread_join(thread, NULL);
+    check(0 == queue->dropped);
+
+    watchful_queue_destroy(queue);
+    return;
+}
+
+static void test_drop_oldest(void) {
+    WatchfulQueue *queue = watchful_queue_create(CAP, WATCHFUL_QUEUE_DROP_OLDEST, "/r/");
+    check(NULL != queue);
+
+    push(queue, 0);
+    const WatchfulEvent *held = watchful_queue_poll(queue, 0);
+    check(NULL != held);
+
+    /* The event still held is not in the way of the newest ones */
+    for (int i = 1; i <= 8; i++) push(queue, i);
+    check_str(held->path, "/r/0");
+    for (int i = 5; i <= 8; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/r/%d", i);
+        const WatchfulEvent *event = watchful_queue_poll(queue, 0);
+        check(NULL != event);
+        if (NULL != event) check_str(event->path, path);
+    }
+    check(NULL == watchful_queue_poll(queue, 0));
+    check(4 == queue->dropped);
+
+    watchful_queue_destroy(queue);
+    return;
+}
+
+static size_t drained_len;
+static char drained[CAP][32];
+
+static int drain_events(const WatchfulEvent *events, size_t len, void *info) {
+    (void)info;
+    for (size_t i = 0; i < len && drained_len < CAP; i++) {
+        snprintf(drained[drained_len++], sizeof(drained[0]), "%s", events[i].path);
+    }
+    return 0;
+}
+
+static void test_overflow(void) {
+    WatchfulQueue *queue = watchful_queue_create(CAP, WATCHFUL_QUEUE_OVERFLOW, "/r/");
+    check(NULL != queue);
+
+    /* The last slot is kept for the marker, which is queued once */
+    for (int i = 1; i <= 8; i++) push(queue, i);
+    check(CAP == watchful_queue_drain(queue, drain_events, NULL, 0));
+    check(CAP == drained_len);
+    check_str(drained[0], "/r/1");
+    check_str(drained[2], "/r/3");
+    check_str(drained[3], "/r/");
+    check(5 == queue->dropped);
+
+    /* The queue takes events again once there is room */
+    push(queue, 9);
+    const WatchfulEvent *event = watchful_queue_poll(queue, 0);
+    check(NULL != event);
+    if (NULL != event) check_str(event->path, "/r/9");
+    if (NULL != event) check(WATCHFUL_EVENT_MODIFIED == event->type);
+
+    watchful_queue_destroy(queue);
+    return;
+}
+
+int main(void) {
+    test_block();
+    test_drop_oldest();
+    test_overflow();
+    return check_report("queue");
+}
@@ -0,0 +1,179 @@
+#include "check.h"
+
+/* Runs monitors over snapshots: a rescan after the kernel's queue overflows,
+ * and restoring from a file that is racy or that cannot be trusted. The
+ * monitors are driven from here (as external monitors) so that an overflow
+ * can be forced by not reading until the queue is full. */
+
+#define SEEN_MAX 64
+
+typedef struct Seen {
+    size_t len;
+    int types[SEEN_MAX];
+    char paths[SEEN_MAX][PATH_MAX];
+} Seen;
+
+static Seen seen;
+
+static int record(const WatchfulEvent *event, void *info) {
+    /* The files made to fill the kernel's queue are not kept */
+    (void)info;
+    if (NULL != strstr(event->path, "/fill-")) return 0;
+    if (seen.len < SEEN_MAX) {
+        seen.types[seen.len] = event->type;
+        snprintf(seen.paths[seen.len], PATH_MAX, "%s", event->path);
+    }
+    seen.len++;
+    return 0;
+}
+
+static bool was_seen(int type, const char *root, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", root, name);
+    for (size_t i = 0; i < seen.len && i < SEEN_MAX; i++) {
+        if (seen.types[i] == type && !strcmp(seen.paths[i], path)) return true;
+    }
+    return false;
+}
+
+typedef struct Expected {
+    int type;
+    const char *root;
+    const char *name;
+} Expected;
+
+static bool is_seen(void *info) {
+    const Expected *expected = info;
+    return was_seen(expected->type, expected->root, expected->name);
+}
+
+static size_t queue_limit(void) {
+    size_t limit = 16384;
+    FILE *file = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+    if (NULL == file) return limit;
+    if (1 != fscanf(file, "%zu", &limit)) limit = 16384;
+    fclose(file);
+    return limit;
+}
+
+static void test_rescan(const char *root) {
+    write_file(root, "old", "old");
+    write_file(root, "gone", "gone");
+
+    WatchfulMonitor wm;
+    check(0 == watchful_monitor_init(&wm, NULL, root, 0, NULL, WATCHFUL_EVENT_ALL, 0, record, NULL));
+    check(0 == watchful_monitor_external(&wm, true));
+    check(0 == watchful_monitor_rescan(&wm, true));
+    check(0 == watchful_monitor_start(&wm));
+
+    /* Nothing is read until far more has happened than the kernel keeps */
+    size_t limit = queue_limit() + 1000;
+    for (size_t i = 0; i < limit; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "fill-%zu", i);
+        write_file(root, name, "");
+    }
+    run("mkdir %snew && echo inner > %snew/inner && rm %sgone", root);
+    write_file(root, "old", "longer than it was");
+
+    seen.len = 0;
+    Expected inner = {WATCHFUL_EVENT_CREATED, root, "new/inner"};
+    pump(&wm, is_seen, &inner);
+    check(was_seen(WATCHFUL_EVENT_OVERFLOW, root, ""));
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "new/"));
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "new/inner"));
+    check(was_seen(WATCHFUL_EVENT_DELETED, root, "gone"));
+    check(was_seen(WATCHFUL_EVENT_MODIFIED, root, "old"));
+
+    /* A directory found by the rescan is watched from then on */
+    seen.len = 0;
+    write_file(root, "new/later", "");
+    Expected later = {WATCHFUL_EVENT_CREATED, root, "new/later"};
+    pump(&wm, is_seen, &later);
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "new/later"));
+
+    watchful_monitor_deinit(&wm);
+    return;
+}
+
+static void restart(WatchfulMonitor *wm) {
+    seen.len = 0;
+    check(0 == watchful_monitor_start(wm));
+    check(0 == watchful_monitor_stop(wm));
+    return;
+}
+
+static void test_restore(const char *root, const char *snapshot) {
+    write_file(root, "old", "same");
+    struct timespec wait = {1, 100000000};
+    nanosleep(&wait, NULL);
+    write_file(root, "racy", "same");
+
+    WatchfulMonitor wm;
+    check(0 == watchful_monitor_init(&wm, NULL, root, 0, NULL, WATCHFUL_EVENT_ALL, 0, record, NULL));
+    check(0 == watchful_monitor_persist(&wm, snapshot));
+    restart(&wm);
+    check(0 == seen.len);
+
+    /* A file changed within a second of the snapshot could have changed
+     * again unseen, so it is reported though it looks the same */
+    restart(&wm);
+    check(1 == seen.len);
+    check(was_seen(WATCHFUL_EVENT_MODIFIED, root, "racy"));
+
+    /* Otherwise only what changed is reported */
+    nanosleep(&wait, NULL);
+    restart(&wm);
+    run("rm %sold && echo changed > %sracy && mkdir %sdir", root);
+    restart(&wm);
+    check(3 == seen.len);
+    check(was_seen(WATCHFUL_EVENT_DELETED, root, "old"));
+    check(was_seen(WATCHFUL_EVENT_MODIFIED, root, "racy"));
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "dir/"));
+
+    /* A directory replaced by another is deleted and created again, along
+     * with what was and is in it */
+    write_file(root, "dir/a", "a");
+    nanosleep(&wait, NULL);
+    restart(&wm);
+    run("mkdir %snew && echo b > %snew/b && rm -rf %sdir", root);
+    run("mv %snew %sdir", root);
+    restart(&wm);
+    check(4 == seen.len);
+    check(was_seen(WATCHFUL_EVENT_DELETED, root, "dir/a"));
+    check(was_seen(WATCHFUL_EVENT_DELETED, root, "dir/"));
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "dir/"));
+    check(was_seen(WATCHFUL_EVENT_CREATED, root, "dir/b"));
+
+    /* A file that cannot be trusted is the same as none at all */
+    struct stat st;
+    check(0 == stat(snapshot, &st));
+    check(0 == truncate(snapshot, st.st_size - 1));
+    write_file(root, "unseen", "");
+    restart(&wm);
+    check(0 == seen.len);
+
+    watchful_monitor_deinit(&wm);
+    return;
+}
+
+int main(void) {
+    if (check_skipped("snapshot")) return 0;
+
+    char rescan_root[PATH_MAX];
+    char restore_root[PATH_MAX];
+    root_create(rescan_root, "rescan");
+    root_create(restore_root, "restore");
+
+    char snapshot[PATH_MAX];
+    snprintf(snapshot, sizeof(snapshot), "%.*s.snapshot", (int)strlen(restore_root) - 1, restore_root);
+
+    test_rescan(rescan_root);
+    test_restore(restore_root, snapshot);
+
+    root_remove(rescan_root);
+    root_remove(restore_root);
+    remove(snapshot);
+
+    return check_report("snapshot");
+}
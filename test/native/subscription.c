@@ -0,0 +1,154 @@
+#include "check.h"
+
+/* Dispatches made-up events to subscriptions on a tree rooted at /r/. */
+
+typedef struct Seen {
+    size_t len;
+    const char *paths[8];
+} Seen;
+
+static int record(const WatchfulEvent *event, void *info) {
+    Seen *seen = info;
+    if (seen->len < 8) seen->paths[seen->len] = event->path;
+    seen->len++;
+    return 0;
+}
+
+static void dispatch(WatchfulSubscriptions *subscriptions, int type, const char *path, const char *old_path) {
+    WatchfulEvent event = {.type = type, .at = 0, .path = (char *)path, .old_path = (char *)old_path};
+    watchful_subscriptions_dispatch(subscriptions, &event);
+    return;
+}
+
+static void test_prefixes(void) {
+    WatchfulSubscriptions subscriptions;
+    watchful_subscriptions_init(&subscriptions);
+    Seen src = {0}, lib = {0}, all = {0}, abs = {0};
+
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "src", WATCHFUL_EVENT_ALL, record, &src));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "src/lib/**", WATCHFUL_EVENT_ALL, record, &lib));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", NULL, WATCHFUL_EVENT_ALL, record, &all));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "/r/src/lib/", WATCHFUL_EVENT_ALL, record, &abs));
+
+    /* A subtree takes in everything beneath it but not a sibling that
+     * shares its name as a prefix */
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/src/a.c", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/srcx/b.c", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/src/lib/c.c", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/src/lib/", NULL);
+
+    check(3 == src.len);
+    check_str(src.paths[0], "/r/src/a.c");
+    check_str(src.paths[1], "/r/src/lib/c.c");
+    check(2 == lib.len);
+    check_str(lib.paths[0], "/r/src/lib/c.c");
+    check_str(lib.paths[1], "/r/src/lib/");
+    check(2 == abs.len);
+    check(4 == all.len);
+
+    watchful_subscriptions_deinit(&subscriptions);
+    return;
+}
+
+static void test_patterns(void) {
+    WatchfulSubscriptions subscriptions;
+    watchful_subscriptions_init(&subscriptions);
+    Seen seen = {0};
+
+    /* A trailing ** is the directory itself; anything else is refused */
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "**", WATCHFUL_EVENT_ALL, record, &seen));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "src/**", WATCHFUL_EVENT_ALL, record, &seen));
+    check(NULL == watchful_subscriptions_add(&subscriptions, "/r/", "src/*.c", WATCHFUL_EVENT_ALL, record, &seen));
+    check(NULL == watchful_subscriptions_add(&subscriptions, "/r/", "src/**/*.c", WATCHFUL_EVENT_ALL, record, &seen));
+    check(NULL == watchful_subscriptions_add(&subscriptions, "/r/", "src**", WATCHFUL_EVENT_ALL, record, &seen));
+    check(NULL == watchful_subscriptions_add(&subscriptions, "/r/", "s?c/[ab]", WATCHFUL_EVENT_ALL, record, &seen));
+    check(2 == subscriptions.len);
+
+    watchful_subscriptions_deinit(&subscriptions);
+    return;
+}
+
+static void test_events(void) {
+    WatchfulSubscriptions subscriptions;
+    watchful_subscriptions_init(&subscriptions);
+    Seen deleted = {0};
+
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "src", WATCHFUL_EVENT_DELETED, record, &deleted));
+
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/src/a.c", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_MODIFIED, "/r/src/a.c", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_DELETED, "/r/src/a.c", NULL);
+    check(1 == deleted.len);
+
+    /* Overflows could affect any subtree so every subscriber is told */
+    dispatch(&subscriptions, WATCHFUL_EVENT_OVERFLOW, "/r/", NULL);
+    check(2 == deleted.len);
+
+    watchful_subscriptions_deinit(&subscriptions);
+    return;
+}
+
+static void test_renames(void) {
+    WatchfulSubscriptions subscriptions;
+    watchful_subscriptions_init(&subscriptions);
+    Seen both = {0}, from = {0}, to = {0};
+
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", NULL, WATCHFUL_EVENT_RENAMED, record, &both));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "old", WATCHFUL_EVENT_RENAMED, record, &from));
+    check(NULL != watchful_subscriptions_add(&subscriptions, "/r/", "new", WATCHFUL_EVENT_RENAMED, record, &to));
+
+    /* A subscriber is found through both paths but told once */
+    dispatch(&subscriptions, WATCHFUL_EVENT_RENAMED, "/r/new/f", "/r/old/f");
+    check(1 == both.len);
+    check(1 == from.len);
+    check(1 == to.len);
+
+    dispatch(&subscriptions, WATCHFUL_EVENT_RENAMED, "/r/old/g", "/r/old/f");
+    check(2 == both.len);
+    check(2 == from.len);
+    check(1 == to.len);
+
+    watchful_subscriptions_deinit(&subscriptions);
+    return;
+}
+
+static void test_unsubscribe(void) {
+    WatchfulSubscriptions subscriptions;
+    watchful_subscriptions_init(&subscriptions);
+    Seen shallow = {0}, deep = {0};
+
+    WatchfulSubscription *a = watchful_subscriptions_add(&subscriptions, "/r/", "a", WATCHFUL_EVENT_ALL, record, &shallow);
+    WatchfulSubscription *b = watchful_subscriptions_add(&subscriptions, "/r/", "a/b/c", WATCHFUL_EVENT_ALL, record, &deep);
+    check(NULL != a && NULL != b);
+    check(strlen("/r/a/") == subscriptions.min_len);
+    check(strlen("/r/a/b/c/") == subscriptions.max_len);
+
+    /* The bounds follow the subscriptions that are left */
+    check(0 == watchful_subscriptions_remove(&subscriptions, a));
+    check(1 == subscriptions.len);
+    check(strlen("/r/a/b/c/") == subscriptions.min_len);
+    check(strlen("/r/a/b/c/") == subscriptions.max_len);
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/a/x", NULL);
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/a/b/c/d", NULL);
+    check(0 == shallow.len);
+    check(1 == deep.len);
+
+    check(0 == watchful_subscriptions_remove(&subscriptions, b));
+    dispatch(&subscriptions, WATCHFUL_EVENT_CREATED, "/r/a/b/c/d", NULL);
+    check(1 == deep.len);
+    check(0 == subscriptions.len);
+    check(0 == subscriptions.min_len);
+    check(0 == subscriptions.max_len);
+
+    watchful_subscriptions_deinit(&subscriptions);
+    return;
+}
+
+int main(void) {
+    test_prefixes();
+    test_patterns();
+    test_events();
+    test_renames();
+    test_unsubscribe();
+    return check_report("subscription");
+}
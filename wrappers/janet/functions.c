@@ -1,8 +1,15 @@
 #include "wrapper.h"
 
-static void ev_callback(JanetEVGenericMessage msg) {
-    WatchfulEvent *event = msg.argp;
+/* Monitors that share watches use one registry for the whole process */
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+static WatchfulRegistry *registry = NULL;
+
+static void registry_create(void) {
+    registry = watchful_registry_create(NULL);
+    return;
+}
 
+static Janet event_struct(const WatchfulEvent *event) {
     Janet event_type;
     switch (event->type) {
         case WATCHFUL_EVENT_MODIFIED:
@@ -17,6 +24,9 @@ static void ev_callback(JanetEVGenericMessage msg) {
         case WATCHFUL_EVENT_RENAMED:
             event_type = janet_ckeywordv("renamed");
             break;
+        case WATCHFUL_EVENT_OVERFLOW:
+            event_type = janet_ckeywordv("overflow");
+            break;
         default:
             event_type = janet_wrap_nil();
     }
@@ -29,57 +39,66 @@ static void ev_callback(JanetEVGenericMessage msg) {
         janet_struct_put(st, janet_ckeywordv("old-path"), janet_cstringv(event->old_path));
     }
 
-    free(event->path);
-    free(event->old_path);
-    free(event);
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static void ev_callback(JanetEVGenericMessage msg) {
+    WatchfulEvent *events = msg.argp;
+    size_t events_len = (size_t)msg.argi;
 
     JanetFunction *give = janet_unwrap_function(msg.argj);
-    Janet args[1] = { janet_wrap_struct(janet_struct_end(st)) };
-    Janet result;
-    janet_pcall(give, 1, args, &result, NULL);
+    for (size_t i = 0; i < events_len; i++) {
+        Janet args[1] = { event_struct(&events[i]) };
+        Janet result;
+        janet_pcall(give, 1, args, &result, NULL);
+    }
+
+    free(events);
 
     return;
 }
 
-static WatchfulEvent *copy_event(const WatchfulEvent *src) {
-    WatchfulEvent *event = malloc(sizeof(WatchfulEvent));
-    if (NULL == event) return NULL;
-
-    event->type = src->type;
-    event->at = src->at;
-    event->path = NULL;
-    event->old_path = NULL;
+static WatchfulEvent *copy_events(const WatchfulEvent *src, size_t len) {
+    /* The events and their paths are copied into a single block */
+    size_t size = sizeof(WatchfulEvent) * len;
+    for (size_t i = 0; i < len; i++) {
+        size += strlen(src[i].path) + 1;
+        if (NULL != src[i].old_path) size += strlen(src[i].old_path) + 1;
+    }
 
-    event->path = malloc(sizeof(char) * (strlen(src->path) + 1));
-    if (NULL == event->path) goto error;
-    strcpy(event->path, src->path);
+    WatchfulEvent *events = malloc(size);
+    if (NULL == events) return NULL;
 
-    if (NULL == src->old_path) {
-        event->old_path = NULL;
-    } else {
-        event->old_path = malloc(sizeof(char) * (strlen(src->old_path) + 1));
-        if (NULL == event->old_path) goto error;
-        strcpy(event->old_path, src->old_path);
-    }
+    char *strings = (char *)(events + len);
+    for (size_t i = 0; i < len; i++) {
+        events[i].type = src[i].type;
+        events[i].at = src[i].at;
 
-    return event;
+        size_t path_len = strlen(src[i].path) + 1;
+        events[i].path = memcpy(strings, src[i].path, path_len);
+        strings += path_len;
 
-error:
-    free(event->path);
-    free(event->old_path);
-    free(event);
+        events[i].old_path = NULL;
+        if (NULL != src[i].old_path) {
+            size_t old_path_len = strlen(src[i].old_path) + 1;
+            events[i].old_path = memcpy(strings, src[i].old_path, old_path_len);
+            strings += old_path_len;
+        }
+    }
 
-    return NULL;
+    return events;
 }
 
-static int monitor_callback(const WatchfulEvent *event, void *info) {
+static int monitor_callback(const WatchfulEvent *events, size_t events_len, void *info) {
+    /* The whole batch is posted to the event loop as one message */
     CallbackInfo *callback_info = (CallbackInfo *)info;
 
-    WatchfulEvent *copy = copy_event(event);
+    WatchfulEvent *copy = copy_events(events, events_len);
     if (NULL == copy) return 1;
 
     JanetEVGenericMessage msg = {0};
     msg.argp = (void *)copy;
+    msg.argi = (int)events_len;
     msg.argj = janet_wrap_function(callback_info->fn);
 
     janet_ev_post_event(callback_info->vm, ev_callback, msg);
@@ -94,8 +113,6 @@ JANET_FN(cfun_monitor,
         "Native function for creating a monitor") {
     janet_fixarity(argc, 2);
 
-    WatchfulBackend *backend = NULL;
-
     const char *path = janet_getcstring(argv, 0);
     if (NULL == path) janet_panic("cannot get path");
     if (!watchful_path_is_dir(path)) janet_panic("path is not a directory");
@@ -116,6 +133,37 @@ JANET_FN(cfun_monitor,
         }
     }
 
+    size_t incl_paths_len = 0;
+    const char **incl_paths = NULL;
+    Janet included_paths = janet_struct_get(opts, janet_ckeywordv("included-paths"));
+    if (!janet_checktype(included_paths, JANET_NIL)) {
+        if (!janet_checktypes(included_paths, JANET_TFLAG_INDEXED)) janet_panic("included-paths option must be array or tuple");
+        const Janet *vals = NULL;
+        janet_indexed_view(included_paths, &vals, (int32_t *)&incl_paths_len);
+        incl_paths = janet_smalloc(sizeof(const char *) * incl_paths_len);
+        for (size_t i = 0; i < incl_paths_len; i++) {
+            incl_paths[i] = (const char *)janet_unwrap_string(vals[i]);
+        }
+    }
+
+    WatchfulBackend *backend = NULL;
+    Janet backend_opt = janet_struct_get(opts, janet_ckeywordv("backend"));
+    if (!janet_checktype(backend_opt, JANET_NIL)) {
+        if (!janet_checktype(backend_opt, JANET_KEYWORD)) janet_panic("backend option must be keyword");
+        JanetString name = janet_unwrap_keyword(backend_opt);
+        if (!janet_cstrcmp(name, "inotify"))
+            backend = &watchful_inotify;
+        else if (!janet_cstrcmp(name, "fanotify"))
+            backend = &watchful_fanotify;
+        else if (!janet_cstrcmp(name, "fsevents"))
+            backend = &watchful_fsevents;
+        else if (!janet_cstrcmp(name, "poll"))
+            backend = &watchful_poll;
+        else
+            janet_panicf("%j is not a backend", backend_opt);
+        if (NULL == backend->setup) janet_panicf("%j is not available on this platform", backend_opt);
+    }
+
     int events = WATCHFUL_EVENT_ALL;
     Janet excluded_events = janet_struct_get(opts, janet_ckeywordv("ignored-events"));
     if (!janet_checktype(excluded_events, JANET_NIL)) {
@@ -139,12 +187,76 @@ JANET_FN(cfun_monitor,
     }
 
     double delay = 0;
+    Janet delay_opt = janet_struct_get(opts, janet_ckeywordv("delay"));
+    if (!janet_checktype(delay_opt, JANET_NIL)) {
+        if (!janet_checktype(delay_opt, JANET_NUMBER) || janet_unwrap_number(delay_opt) < 0) janet_panic("delay option must be non-negative number");
+        delay = janet_unwrap_number(delay_opt);
+    }
+
+    size_t crawl_threads = 0;
+    Janet threads = janet_struct_get(opts, janet_ckeywordv("crawl-threads"));
+    if (!janet_checktype(threads, JANET_NIL)) {
+        if (!janet_checkint(threads) || janet_unwrap_integer(threads) < 0) janet_panic("crawl-threads option must be non-negative integer");
+        crawl_threads = (size_t)janet_unwrap_integer(threads);
+    }
+
+    /* Coalescing is either per read (true) or over a window in seconds */
+    double window = 0;
+    Janet coalesce = janet_struct_get(opts, janet_ckeywordv("coalesce"));
+    if (janet_checktype(coalesce, JANET_NUMBER)) {
+        if (janet_unwrap_number(coalesce) < 0) janet_panic("coalesce option must be boolean or non-negative number");
+        window = janet_unwrap_number(coalesce);
+    }
+
+    double interval = WATCHFUL_POLL_INTERVAL;
+    Janet interval_opt = janet_struct_get(opts, janet_ckeywordv("interval"));
+    if (!janet_checktype(interval_opt, JANET_NIL)) {
+        if (!janet_checktype(interval_opt, JANET_NUMBER) || janet_unwrap_number(interval_opt) <= 0) janet_panic("interval option must be positive number");
+        interval = janet_unwrap_number(interval_opt);
+    }
+
+    size_t budget = 0;
+    Janet budget_opt = janet_struct_get(opts, janet_ckeywordv("budget"));
+    if (!janet_checktype(budget_opt, JANET_NIL)) {
+        if (!janet_checkint(budget_opt) || janet_unwrap_integer(budget_opt) < 0) janet_panic("budget option must be non-negative integer");
+        budget = (size_t)janet_unwrap_integer(budget_opt);
+    }
+
+    size_t max_depth = 0;
+    Janet depth_opt = janet_struct_get(opts, janet_ckeywordv("depth"));
+    if (!janet_checktype(depth_opt, JANET_NIL)) {
+        if (!janet_checkint(depth_opt) || janet_unwrap_integer(depth_opt) <= 0) janet_panic("depth option must be positive integer");
+        max_depth = (size_t)janet_unwrap_integer(depth_opt);
+    }
+
+    const char *snapshot_path = NULL;
+    Janet snapshot = janet_struct_get(opts, janet_ckeywordv("snapshot"));
+    if (!janet_checktype(snapshot, JANET_NIL)) {
+        if (!janet_checktype(snapshot, JANET_STRING)) janet_panic("snapshot option must be string");
+        snapshot_path = (const char *)janet_unwrap_string(snapshot);
+    }
 
     WatchfulMonitor *wm = janet_abstract(&watchful_monitor_type, sizeof(WatchfulMonitor));
-    int error = watchful_monitor_init(wm, backend, path, excl_paths_len, excl_paths, events, delay, monitor_callback, NULL);
+    int error = watchful_monitor_init(wm, backend, path, excl_paths_len, excl_paths, events, delay, NULL, NULL);
     if (error) janet_panic("cannot initialise monitor");
+    watchful_monitor_batch(wm, monitor_callback, WATCHFUL_BATCH_MAX, window);
+    watchful_monitor_coalesce(wm, janet_truthy(coalesce));
+    watchful_monitor_rescan(wm, janet_truthy(janet_struct_get(opts, janet_ckeywordv("rescan"))));
+    if (watchful_monitor_persist(wm, snapshot_path)) janet_panic("cannot set snapshot file");
+    if (watchful_monitor_include(wm, incl_paths_len, incl_paths)) janet_panic("cannot set included paths");
+    watchful_monitor_interval(wm, interval);
+    watchful_monitor_budget(wm, budget);
+    watchful_monitor_crawl(wm, max_depth,
+            janet_truthy(janet_struct_get(opts, janet_ckeywordv("one-filesystem"))),
+            janet_truthy(janet_struct_get(opts, janet_ckeywordv("lazy"))));
+    watchful_monitor_crawl_threads(wm, crawl_threads);
+    if (janet_truthy(janet_struct_get(opts, janet_ckeywordv("shared")))) {
+        pthread_once(&registry_once, registry_create);
+        if (NULL == registry || watchful_monitor_registry(wm, registry)) janet_panic("cannot share watches");
+    }
 
     if (NULL != excl_paths) janet_sfree(excl_paths);
+    if (NULL != incl_paths) janet_sfree(incl_paths);
 
     return janet_wrap_abstract(wm);
 }
@@ -159,6 +271,54 @@ JANET_FN(cfun_is_watching,
     return janet_wrap_boolean((int)wm->is_watching);
 }
 
+JANET_FN(cfun_degraded,
+        "(_watchful/degraded monitor)",
+        "Native function for listing directories scanned instead of watched") {
+    janet_fixarity(argc, 1);
+
+    WatchfulMonitor *wm = janet_getabstract(argv, 0, &watchful_monitor_type);
+
+    char **paths = NULL;
+    size_t paths_len = 0;
+    int error = watchful_monitor_degraded(wm, &paths, &paths_len);
+    if (error) janet_panic("cannot list degraded directories");
+
+    JanetArray *result = janet_array((int32_t)paths_len);
+    for (size_t i = 0; i < paths_len; i++) {
+        janet_array_push(result, janet_cstringv(paths[i]));
+        free(paths[i]);
+    }
+    free(paths);
+
+    return janet_wrap_array(result);
+}
+
+JANET_FN(cfun_stats,
+        "(_watchful/stats monitor)",
+        "Native function for getting the counters and gauges of a monitor") {
+    janet_fixarity(argc, 1);
+
+    WatchfulMonitor *wm = janet_getabstract(argv, 0, &watchful_monitor_type);
+
+    WatchfulStats stats;
+    watchful_monitor_stats(wm, &stats);
+
+    JanetKV *st = janet_struct_begin(11);
+    janet_struct_put(st, janet_ckeywordv("events-read"), janet_wrap_number((double)stats.events_read));
+    janet_struct_put(st, janet_ckeywordv("events-delivered"), janet_wrap_number((double)stats.events_delivered));
+    janet_struct_put(st, janet_ckeywordv("events-filtered"), janet_wrap_number((double)stats.events_filtered));
+    janet_struct_put(st, janet_ckeywordv("events-excluded"), janet_wrap_number((double)stats.events_excluded));
+    janet_struct_put(st, janet_ckeywordv("overflows"), janet_wrap_number((double)stats.overflows));
+    janet_struct_put(st, janet_ckeywordv("reads"), janet_wrap_number((double)stats.reads));
+    janet_struct_put(st, janet_ckeywordv("bytes-read"), janet_wrap_number((double)stats.bytes_read));
+    janet_struct_put(st, janet_ckeywordv("watches"), janet_wrap_number((double)stats.watches));
+    janet_struct_put(st, janet_ckeywordv("dead-watches"), janet_wrap_number((double)stats.watches_dead));
+    janet_struct_put(st, janet_ckeywordv("watch-memory"), janet_wrap_number((double)stats.watches_memory));
+    janet_struct_put(st, janet_ckeywordv("crawl-duration"), janet_wrap_number(stats.crawl_duration));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
 JANET_FN(cfun_start,
         "(_watchful/start monitor give-fn)",
         "Native function for starting a watch") {
@@ -201,6 +361,8 @@ JANET_MODULE_ENTRY(JanetTable *env) {
         JANET_REG("start", cfun_start),
         JANET_REG("stop", cfun_stop),
         JANET_REG("watching?", cfun_is_watching),
+        JANET_REG("degraded", cfun_degraded),
+        JANET_REG("stats", cfun_stats),
         JANET_REG_END
     });
 }